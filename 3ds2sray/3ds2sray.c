@@ -28,6 +28,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <lib3ds/matrix.h>
 #include <lib3ds/vector.h>
 #include <lib3ds/light.h>
+#include "meshfile.h"
 
 enum {
 	MESHES		= 1,
@@ -43,13 +44,15 @@ int write_matlib(Lib3dsFile *file, FILE *out);
 int write_objects(Lib3dsFile *file, FILE *out);
 int write_camera(Lib3dsFile *file, FILE *out);
 int write_lights(Lib3dsFile *file, FILE *out);
+int write_mesh_data(Lib3dsMesh *m, Lib3dsVector *norm, FILE *out);
 
 char *fname;
 unsigned int expsel;
+int binary;	/* write the geometry to binary mesh files */
 
 int main(int argc, char **argv)
 {
-	int i;
+	int i, res;
 	Lib3dsFile *file;
 	FILE *out = stdout;
 
@@ -83,6 +86,10 @@ int main(int argc, char **argv)
 				expsel |= ENV;
 				break;
 
+			case 'b':
+				binary = 1;
+				break;
+
 			default:
 				fprintf(stderr, "unrecognized option: %s\n", argv[i]);
 				return 1;
@@ -111,13 +118,13 @@ int main(int argc, char **argv)
 	}
 	lib3ds_file_eval(file, 0);
 
-	write_scene(file, out);
+	res = write_scene(file, out);
 
 	lib3ds_file_free(file);
 	if(out != stdout) {
 		fclose(out);
 	}
-	return 0;
+	return res == -1 ? 1 : 0;
 }
 
 int write_scene(Lib3dsFile *file, FILE *out)
@@ -138,7 +145,9 @@ int write_scene(Lib3dsFile *file, FILE *out)
 		write_lights(file, out);
 	}
 	if(expsel & MESHES) {
-		write_objects(file, out);
+		if(write_objects(file, out) == -1) {
+			return -1;
+		}
 	}
 
 	fprintf(out, "</scene>\n");
@@ -239,6 +248,18 @@ int write_objects(Lib3dsFile *file, FILE *out)
 				node->data.object.pivot[2], node->data.object.pivot[1]);*/
 
 		/* mesh */
+		if(binary) {
+			if(write_mesh_data(m, norm, out) == -1) {
+				free(norm);
+				return -1;
+			}
+			free(norm);
+
+			fprintf(out, "\t</object>\n");
+			m = m->next;
+			continue;
+		}
+
 		fprintf(out, "\t\t<mesh>\n");
 		for(i=0; i<m->points; i++) {
 			fprintf(out, "\t\t\t<vertex id=\"%d\" val=\"%.3f %.3f %.3f\"/>\n", i,
@@ -280,6 +301,78 @@ int write_objects(Lib3dsFile *file, FILE *out)
 	return 0;
 }
 
+/* writes the mesh to <mesh name>.smesh, and the <mesh> element referencing it.
+ * The normals are per face corner, so every corner becomes a separate vertex,
+ * just like when the xml is loaded.
+ */
+int write_mesh_data(Lib3dsMesh *m, Lib3dsVector *norm, FILE *out)
+{
+	int i, j, res;
+	char mfname[256], *cptr;
+	int num_verts = m->faces * 3;
+	float *pos, *nvec = 0, *tvec = 0;
+	uint32_t *faces;
+
+	sprintf(mfname, "%.240s.smesh", m->name);
+	for(cptr = mfname; *cptr; cptr++) {
+		if(*cptr == '/' || *cptr == '\\') {
+			*cptr = '_';
+		}
+	}
+
+	pos = malloc(num_verts * 3 * sizeof *pos);
+	faces = malloc(num_verts * sizeof *faces);
+	if(norm) {
+		nvec = malloc(num_verts * 3 * sizeof *nvec);
+	}
+	if(m->texels) {
+		tvec = malloc(num_verts * 2 * sizeof *tvec);
+	}
+	if(!pos || !faces || (norm && !nvec) || (m->texels && !tvec)) {
+		perror("failed to allocate mesh arrays");
+		free(pos);
+		free(faces);
+		free(nvec);
+		free(tvec);
+		return -1;
+	}
+
+	for(i=0; i<m->faces; i++) {
+		for(j=0; j<3; j++) {
+			int idx = m->faceL[i].points[j];
+			int vidx = i * 3 + j;
+
+			pos[vidx * 3] = m->pointL[idx].pos[0];
+			pos[vidx * 3 + 1] = m->pointL[idx].pos[2];
+			pos[vidx * 3 + 2] = m->pointL[idx].pos[1];
+
+			if(nvec) {
+				nvec[vidx * 3] = norm[vidx][0];
+				nvec[vidx * 3 + 1] = norm[vidx][2];
+				nvec[vidx * 3 + 2] = norm[vidx][1];
+			}
+			if(tvec) {
+				tvec[vidx * 2] = m->texelL[idx][0];
+				tvec[vidx * 2 + 1] = m->texelL[idx][1];
+			}
+			faces[vidx] = vidx;
+		}
+	}
+
+	res = write_mesh_file(mfname, num_verts, pos, nvec, 0, tvec, m->faces, faces);
+
+	free(pos);
+	free(faces);
+	free(nvec);
+	free(tvec);
+
+	if(res == -1) {
+		return -1;
+	}
+	fprintf(out, "\t\t<mesh file=\"%s\"/>\n", mfname);
+	return 0;
+}
+
 /* XXX what to do with multiple cameras? currently ignoring all but the first */
 int write_camera(Lib3dsFile *file, FILE *out)
 {
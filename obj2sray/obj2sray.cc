@@ -21,23 +21,41 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <errno.h>
 #include <assert.h>
 #include <typeinfo>
+#include <vector>
 #include <henge.h>
+#include "meshfile.h"
 
 using namespace henge;
 
 bool write_xml(FILE *fp, scene *scn);
+static bool write_mesh(FILE *fp, const char *name, trimesh *mesh);
+
+/* write the geometry to binary mesh files instead of inline in the xml */
+static bool binary;
 
 int main(int argc, char **argv)
 {
-	char path[512], *fname;
+	char path[512], *fname = 0;
+
+	for(int i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-b") == 0) {
+			binary = true;
+		} else if(!fname && argv[i][0] != '-') {
+			fname = argv[i];
+		} else {
+			fname = 0;
+			break;
+		}
+	}
 
-	if(argc != 2) {
-		fprintf(stderr, "usage: %s <filename>\n", argv[0]);
+	if(!fname) {
+		fprintf(stderr, "usage: %s [-b] <filename>\n", argv[0]);
+		fprintf(stderr, "  -b: write each mesh to a binary <object name>.smesh file\n");
 		return 1;
 	}
 	henge::init_no_gl();
 
-	strcpy(path, argv[1]);
+	strcpy(path, fname);
 	if((fname = strrchr(path, '/'))) {
 		*fname++ = 0;
 		set_path(path);
@@ -138,10 +156,18 @@ bool write_xml(FILE *fp, scene *scn)
 		Vector3 scale = obj[i]->get_local_scaling();
 		fprintf(fp, " scale=\"%.4f %.4f %.4f\"/>\n", scale.x, scale.y, scale.z);
 
+		trimesh *mesh = obj[i]->get_mesh();
+
+		if(binary) {
+			if(!write_mesh(fp, name, mesh)) {
+				return false;
+			}
+			fprintf(fp, "\t</object>\n");
+			continue;
+		}
+
 		fprintf(fp, "\t\t<mesh>\n");
 
-		trimesh *mesh = obj[i]->get_mesh();
-		
 		Vector3 *vert = mesh->get_data_vec3(EL_VERTEX);
 		int num_verts = mesh->get_count(EL_VERTEX);
 
@@ -234,3 +260,61 @@ bool write_xml(FILE *fp, scene *scn)
 	fprintf(fp, "</scene>\n");
 	return true;
 }
+
+/* writes the mesh to <name>.smesh, and the <mesh> element referencing it */
+static bool write_mesh(FILE *fp, const char *name, trimesh *mesh)
+{
+	char fname[256];
+	snprintf(fname, sizeof fname, "%s.smesh", name);
+
+	// don't let object names escape the current directory
+	for(char *cptr = fname; *cptr; cptr++) {
+		if(*cptr == '/' || *cptr == '\\') {
+			*cptr = '_';
+		}
+	}
+
+	Vector3 *vert = mesh->get_data_vec3(EL_VERTEX);
+	Vector3 *norm = mesh->get_data_vec3(EL_NORMAL);
+	Vector2 *tc = mesh->get_data_vec2(EL_TEXCOORD);
+	int num_verts = mesh->get_count(EL_VERTEX);
+
+	std::vector<float> pos, nvec, tvec;
+
+	// flip z just like the xml writer
+	for(int i=0; i<num_verts; i++) {
+		pos.push_back(vert[i].x);
+		pos.push_back(vert[i].y);
+		pos.push_back(-vert[i].z);
+
+		if(norm) {
+			nvec.push_back(norm[i].x);
+			nvec.push_back(norm[i].y);
+			nvec.push_back(-norm[i].z);
+		}
+		if(tc) {
+			tvec.push_back(tc[i].x);
+			tvec.push_back(tc[i].y);
+		}
+	}
+
+	std::vector<uint32_t> faces;
+
+	unsigned int *indices = mesh->get_data_int(EL_INDEX);
+	if(indices) {
+		int num_idx = mesh->get_count(EL_INDEX) / 3 * 3;
+		faces.assign(indices, indices + num_idx);
+	} else {
+		for(int i=0; i<num_verts / 3 * 3; i++) {
+			faces.push_back(i);
+		}
+	}
+
+	if(write_mesh_file(fname, num_verts, pos.empty() ? 0 : &pos[0], nvec.empty() ? 0 : &nvec[0],
+				0, tvec.empty() ? 0 : &tvec[0], (int)faces.size() / 3, faces.empty() ? 0 : &faces[0]) == -1) {
+		return false;
+	}
+
+	fprintf(fp, "\t\t<mesh file=\"%s\"/>\n", fname);
+	return true;
+}
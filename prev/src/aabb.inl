@@ -0,0 +1 @@
+../../src/aabb.inl
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/bvh.h
\ No newline at end of file
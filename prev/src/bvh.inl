@@ -0,0 +1 @@
+../../src/bvh.inl
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/geom.h
\ No newline at end of file
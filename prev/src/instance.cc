@@ -0,0 +1 @@
+../../src/instance.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/instance.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/irrcache.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/irrcache.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/mapfile.c
\ No newline at end of file
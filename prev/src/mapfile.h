@@ -0,0 +1 @@
+../../src/mapfile.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/meshcache.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/meshfile.c
\ No newline at end of file
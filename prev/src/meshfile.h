@@ -0,0 +1 @@
+../../src/meshfile.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/pmapcache.cc
\ No newline at end of file
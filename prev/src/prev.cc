@@ -26,6 +26,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "cam.h"
 #include "scene.h"
 #include "mesh.h"
+#include "instance.h"
 #include "sphere.h"
 #include "cylinder.h"
 #include "opt.h"
@@ -152,6 +153,8 @@ static void disp()
 				if(show_mesh_octrees) {
 					draw_octree(m->get_tree(), Color(0, 0.5, 0));
 				}
+			} else if(dynamic_cast<MeshInstance*>(obj[i])) {
+				draw_mesh(((MeshInstance*)obj[i])->get_mesh());
 			} else if(dynamic_cast<Sphere*>(obj[i])) {
 				draw_sphere((Sphere*)obj[i]);
 			} else if(dynamic_cast<Cylinder*>(obj[i])) {
@@ -217,7 +220,7 @@ static void disp()
 
 	/* draw photon maps */
 	if(pmap) {
-		Photon **phot = pmap->get_photons();
+		const PackedPhoton *phot = pmap->get_photons();
 
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -227,13 +230,14 @@ static void disp()
 		glBegin(GL_POINTS);
 		for(size_t i=0; i<pmap->size(); i++) {
 			if(use_photon_color) {
-				glColor3f(phot[i]->col.x, phot[i]->col.y, phot[i]->col.z);
-				//fprintf(stderr, "%.3f %.3f %.3f\n", phot[i]->col.x, phot[i]->col.y, phot[i]->col.z);
+				Color col = photon_power(phot + i);
+				glColor3f(col.x, col.y, col.z);
+				//fprintf(stderr, "%.3f %.3f %.3f\n", col.x, col.y, col.z);
 			} else {
 				glColor3f(0, 1, 0);
 			}
 
-			glVertex3f(phot[i]->pos.x, phot[i]->pos.y, phot[i]->pos.z);
+			glVertex3fv(phot[i].pos);
 		}
 		glEnd();
 
@@ -285,13 +289,13 @@ static void draw_mesh(const Mesh *mesh)
 	glBegin(GL_TRIANGLES);
 
 	for(int i=0; i<num_tri; i++) {
-		const Triangle *tri = mesh->get_face(i);
+		const Face *face = mesh->get_face(i);
 
 		for(int j=0; j<3; j++) {
-			const Vertex *v = tri->v + j;
-			glNormal3f(v->norm.x, v->norm.y, v->norm.z);
-			glTexCoord2f(v->tex.x, v->tex.y);
-			glVertex3f(v->pos.x, v->pos.y, v->pos.z);
+			Vertex v = mesh->get_vertex(face->v[j]);
+			glNormal3f(v.norm.x, v.norm.y, v.norm.z);
+			glTexCoord2f(v.tex.x, v.tex.y);
+			glVertex3f(v.pos.x, v.pos.y, v.pos.z);
 		}
 	}
 
@@ -302,16 +306,13 @@ static void draw_mesh(const Mesh *mesh)
 		glColor3f(0.2, 0.3, 0.8);
 
 		glBegin(GL_LINES);
-		for(int i=0; i<num_tri; i++) {
-			const Triangle *tri = mesh->get_face(i);
-
-			for(int j=0; j<3; j++) {
-				const Vertex *v = tri->v + j;
-				Vector3 nend = v->pos + v->norm * normal_scale_factor;
+		int num_verts = mesh->get_vertex_count();
+		for(int i=0; i<num_verts; i++) {
+			Vertex v = mesh->get_vertex(i);
+			Vector3 nend = v.pos + v.norm * normal_scale_factor;
 
-				glVertex3f(v->pos.x, v->pos.y, v->pos.z);
-				glVertex3f(nend.x, nend.y, nend.z);
-			}
+			glVertex3f(v.pos.x, v.pos.y, v.pos.z);
+			glVertex3f(nend.x, nend.y, nend.z);
 		}
 		glEnd();
 	}
@@ -432,13 +433,8 @@ static void draw_camera(const Camera *cam)
 	glPopAttrib();
 }
 
-template <typename T>
-static void draw_octnode(OctNode<T> *node, void *cls)
+static void draw_octnode(const OctFlatNode *node, const Color *col)
 {
-	if(!node) return;
-
-	Color *col = (Color*)cls;
-
 	float xsz = node->box.max[0] - node->box.min[0];
 	float ysz = node->box.max[1] - node->box.min[1];
 	float zsz = node->box.max[2] - node->box.min[2];
@@ -462,7 +458,10 @@ static void draw_octnode(OctNode<T> *node, void *cls)
 template <typename T>
 static void draw_octree(Octree<T> *tree, const Color &col)
 {
-	tree->traverse(OCT_PREORDER, draw_octnode, (void*)&col);
+	int num_nodes = tree->get_node_count();
+	for(int i=0; i<num_nodes; i++) {
+		draw_octnode(tree->get_node(i), &col);
+	}
 }
 
 static void mult_glmatrix(const Matrix4x4 &xform)
@@ -0,0 +1 @@
+../../src/raypacket.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/raypacket.h
\ No newline at end of file
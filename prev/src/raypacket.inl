@@ -0,0 +1 @@
+../../src/raypacket.inl
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/rng.cc
\ No newline at end of file
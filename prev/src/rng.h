@@ -0,0 +1 @@
+../../src/rng.h
\ No newline at end of file
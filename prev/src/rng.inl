@@ -0,0 +1 @@
+../../src/rng.inl
\ No newline at end of file
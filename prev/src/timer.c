@@ -0,0 +1 @@
+../../src/timer.c
\ No newline at end of file
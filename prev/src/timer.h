@@ -0,0 +1 @@
+../../src/timer.h
\ No newline at end of file
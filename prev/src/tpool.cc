@@ -0,0 +1 @@
+../../src/tpool.cc
\ No newline at end of file
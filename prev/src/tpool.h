@@ -0,0 +1 @@
+../../src/tpool.h
\ No newline at end of file
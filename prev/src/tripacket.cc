@@ -0,0 +1 @@
+../../src/tripacket.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../../src/tripacket.h
\ No newline at end of file
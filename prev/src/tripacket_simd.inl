@@ -0,0 +1 @@
+../../src/tripacket_simd.inl
\ No newline at end of file
@@ -20,9 +20,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <vmath/vmath.h>
 #include "xmltree.h"
+#include "geom.h"
 
 struct SurfPoint;
 
+/** Ray data precalculated once, for testing the same ray against many boxes */
+struct BoxTestRay {
+	geom_t origin[3];
+	geom_t inv_dir[3];
+	int sign[3];
+
+	BoxTestRay() {}
+	inline BoxTestRay(const Ray &ray);
+};
+
 /** Axis-aligned bounding box */
 class AABox {
 public:
@@ -38,7 +49,35 @@ public:
 
 	bool contains(const Vector3 &pt) const;
 	bool intersect(const Ray &ray, SurfPoint *pt = 0) const;
+
+	/** expand the box to include another box */
+	inline void expand(const AABox &box);
+
+	inline double surface_area() const;
 };
 
+/** Compact box, in geom_t precision, used for the nodes of the acceleration
+ * structures.
+ */
+struct GeomBox {
+	geom_t min[3], max[3];
+
+	/** set from an AABox, rounding outwards if geom_t is less precise */
+	inline void set(const AABox &box);
+
+	/** intersects a precalculated ray with the box, within the parametric
+	 * interval [tmin, tmax]. If tnear is not null, it's set to the parametric
+	 * distance where the ray enters the box (clamped to tmin).
+	 */
+	inline bool intersect(const BoxTestRay &ray, double tmin, double tmax, double *tnear = 0) const;
+
+	/** set to the linear interpolation of boxes a and b, padded to make up
+	 * for the rounding errors of the interpolation.
+	 */
+	inline void lerp(const GeomBox &a, const GeomBox &b, geom_t t);
+};
+
+#include "aabb.inl"
+
 
 #endif	// AABB_H_
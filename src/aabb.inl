@@ -0,0 +1,116 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+inline BoxTestRay::BoxTestRay(const Ray &ray)
+{
+	for(int i=0; i<3; i++) {
+		origin[i] = ray.origin[i];
+
+		// avoid infinities, which misbehave with -ffast-math. a zero inverse
+		// marks a ray parallel to the slabs of this axis.
+		double d = ray.dir[i];
+		if(fabs(d) < XSMALL_NUMBER) {
+			inv_dir[i] = 0.0;
+			sign[i] = 0;
+		} else {
+			inv_dir[i] = (geom_t)(1.0 / d);
+			sign[i] = inv_dir[i] < 0.0 ? 1 : 0;
+		}
+	}
+}
+
+inline void AABox::expand(const AABox &box)
+{
+	if(box.min.x < min.x) min.x = box.min.x;
+	if(box.min.y < min.y) min.y = box.min.y;
+	if(box.min.z < min.z) min.z = box.min.z;
+
+	if(box.max.x > max.x) max.x = box.max.x;
+	if(box.max.y > max.y) max.y = box.max.y;
+	if(box.max.z > max.z) max.z = box.max.z;
+}
+
+inline double AABox::surface_area() const
+{
+	Vector3 d = max - min;
+	if(d.x < 0.0 || d.y < 0.0 || d.z < 0.0) {
+		return 0.0;
+	}
+	return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+inline void GeomBox::set(const AABox &box)
+{
+	for(int i=0; i<3; i++) {
+		min[i] = (geom_t)box.min[i];
+		max[i] = (geom_t)box.max[i];
+
+		if(min[i] > box.min[i]) {
+			min[i] = nextafter(min[i], -GEOM_MAX);
+		}
+		if(max[i] < box.max[i]) {
+			max[i] = nextafter(max[i], GEOM_MAX);
+		}
+	}
+}
+
+/* slab test, same as AABox::intersect(const Ray&, SurfPoint*), but with the
+ * reciprocal direction and the direction signs calculated once per ray.
+ */
+inline bool GeomBox::intersect(const BoxTestRay &ray, double tmin, double tmax, double *tnear) const
+{
+	const geom_t *bbox[2] = {min, max};
+	geom_t t0 = (geom_t)tmin;
+	geom_t t1 = (geom_t)tmax;
+
+	for(int i=0; i<3; i++) {
+		if(ray.inv_dir[i] == 0.0) {
+			if(ray.origin[i] < min[i] || ray.origin[i] > max[i]) {
+				return false;
+			}
+			continue;
+		}
+
+		geom_t tnear_slab = (bbox[ray.sign[i]][i] - ray.origin[i]) * ray.inv_dir[i];
+		geom_t tfar_slab = (bbox[1 - ray.sign[i]][i] - ray.origin[i]) * ray.inv_dir[i];
+		tfar_slab *= GEOM_SLAB_SCALE;
+
+		if(tnear_slab > t0) t0 = tnear_slab;
+		if(tfar_slab < t1) t1 = tfar_slab;
+
+		if(t0 > t1) {
+			return false;
+		}
+	}
+
+	if(tnear) {
+		*tnear = t0;
+	}
+	return true;
+}
+
+inline void GeomBox::lerp(const GeomBox &a, const GeomBox &b, geom_t t)
+{
+	for(int i=0; i<3; i++) {
+		geom_t pad = (fabs(a.min[i]) + fabs(b.min[i])) * (geom_t)(2.0 * GEOM_EPSILON);
+		min[i] = a.min[i] + (b.min[i] - a.min[i]) * t - pad;
+
+		pad = (fabs(a.max[i]) + fabs(b.max[i])) * (geom_t)(2.0 * GEOM_EPSILON);
+		max[i] = a.max[i] + (b.max[i] - a.max[i]) * t + pad;
+	}
+}
@@ -26,6 +26,7 @@ XFormNode::XFormNode()
 {
 	parent = 0;
 	name = 0;
+	xform_static = false;
 
 	xform_cache.set_invalid_key(INT_MIN);
 
@@ -57,6 +58,10 @@ XFormNode &XFormNode::operator =(const XFormNode &node)
 	rtrack = node.rtrack;
 	pivot = node.pivot;
 
+	xform_stime = node.xform_stime;
+	xform_samples = node.xform_samples;
+	xform_static = node.xform_static;
+
 	return *this;
 }
 
@@ -125,7 +130,7 @@ void XFormNode::set_interpolator(Interpolator interp)
 	ptrack.set_interpolator(interp);
 	rtrack.set_interpolator(interp);
 	strack.set_interpolator(interp);
-	xform_cache.invalidate();
+	invalidate_xform();
 }
 
 void XFormNode::set_extrapolator(Extrapolator extrap)
@@ -133,7 +138,7 @@ void XFormNode::set_extrapolator(Extrapolator extrap)
 	ptrack.set_extrapolator(extrap);
 	rtrack.set_extrapolator(extrap);
 	strack.set_extrapolator(extrap);
-	xform_cache.invalidate();
+	invalidate_xform();
 }
 
 void XFormNode::set_name(const char *name)
@@ -156,7 +161,7 @@ void XFormNode::add_child(XFormNode *child)
 {
 	if(find(children.begin(), children.end(), child) == children.end()) {
 		child->parent = this;
-		child->xform_cache.invalidate();
+		child->invalidate_xform();
 		children.push_back(child);
 	}
 }
@@ -166,7 +171,7 @@ void XFormNode::remove_child(XFormNode *child)
 	vector<XFormNode*>::iterator iter;
 	iter = find(children.begin(), children.end(), child);
 	if(iter != children.end()) {
-		(*iter)->xform_cache.invalidate();
+		(*iter)->invalidate_xform();
 		children.erase(iter);
 	}
 }
@@ -184,7 +189,7 @@ int XFormNode::get_children_count() const
 void XFormNode::set_pivot(const Vector3 &p)
 {
 	pivot = p;
-	xform_cache.invalidate();
+	invalidate_xform();
 }
 
 const Vector3 &XFormNode::get_pivot() const
@@ -195,19 +200,19 @@ const Vector3 &XFormNode::get_pivot() const
 void XFormNode::reset_position()
 {
 	ptrack.reset(Vector3(0, 0, 0));
-	xform_cache.invalidate();
+	invalidate_xform();
 }
 
 void XFormNode::reset_rotation()
 {
 	rtrack.reset(Quaternion());
-	xform_cache.invalidate();
+	invalidate_xform();
 }
 
 void XFormNode::reset_scaling()
 {
 	strack.reset(Vector3(1, 1, 1));
-	xform_cache.invalidate();
+	invalidate_xform();
 }
 
 void XFormNode::reset_xform()
@@ -226,9 +231,7 @@ void XFormNode::set_position(const Vector3 &pos, int time)
 		ptrack.add_key(TrackKey<Vector3>(pos, time));
 	}
 
-	if(xform_cache.is_valid(time)) {
-		xform_cache.invalidate();
-	}
+	invalidate_xform();
 }
 
 static void set_rotation_quat(Track<Quaternion> *track, const Quaternion &rot, int time)
@@ -245,9 +248,7 @@ void XFormNode::set_rotation(const Quaternion &rot, int time)
 {
 	set_rotation_quat(&rtrack, rot, time);
 
-	if(xform_cache.is_valid(time)) {
-		xform_cache.invalidate();
-	}
+	invalidate_xform();
 }
 
 void XFormNode::set_rotation(const Vector3 &euler, int time)
@@ -258,18 +259,14 @@ void XFormNode::set_rotation(const Vector3 &euler, int time)
 	zrot.set_rotation(Vector3(0, 0, 1), euler.z);
 	set_rotation_quat(&rtrack, xrot * yrot * zrot, time);
 
-	if(xform_cache.is_valid(time)) {
-		xform_cache.invalidate();
-	}
+	invalidate_xform();
 }
 
 void XFormNode::set_rotation(double angle, const Vector3 &axis, int time)
 {
 	set_rotation_quat(&rtrack, Quaternion(axis, angle), time);
 
-	if(xform_cache.is_valid(time)) {
-		xform_cache.invalidate();
-	}
+	invalidate_xform();
 }
 
 void XFormNode::set_scaling(const Vector3 &s, int time)
@@ -281,9 +278,7 @@ void XFormNode::set_scaling(const Vector3 &s, int time)
 		strack.add_key(TrackKey<Vector3>(s, time));
 	}
 
-	if(xform_cache.is_valid(time)) {
-		xform_cache.invalidate();
-	}
+	invalidate_xform();
 }
 	
 void XFormNode::translate(const Vector3 &pos, int time)
@@ -295,9 +290,7 @@ void XFormNode::translate(const Vector3 &pos, int time)
 		ptrack.add_key(TrackKey<Vector3>(pos, time));
 	}
 
-	if(xform_cache.is_valid(time)) {
-		xform_cache.invalidate();
-	}
+	invalidate_xform();
 }
 
 void XFormNode::rotate(const Quaternion &rot, int time)
@@ -309,9 +302,7 @@ void XFormNode::rotate(const Quaternion &rot, int time)
 		rtrack.add_key(TrackKey<Quaternion>(rot, time));
 	}
 
-	if(xform_cache.is_valid(time)) {
-		xform_cache.invalidate();
-	}
+	invalidate_xform();
 }
 
 void XFormNode::rotate(const Vector3 &euler, int time)
@@ -337,9 +328,7 @@ void XFormNode::scale(const Vector3 &s, int time)
 		strack.add_key(TrackKey<Vector3>(s, time));
 	}
 
-	if(xform_cache.is_valid(time)) {
-		xform_cache.invalidate();
-	}
+	invalidate_xform();
 }
 
 Vector3 XFormNode::get_position(int time) const
@@ -390,6 +379,11 @@ Vector3 XFormNode::get_scaling(int time) const
 
 Matrix4x4 XFormNode::get_xform_matrix(int time) const
 {
+	Matrix4x4 res;
+	if(get_xform_sample(time, false, &res)) {
+		return res;
+	}
+
 	if(xform_cache.is_valid(time)) {
 		return xform_cache.get_data().xform;
 	}
@@ -420,6 +414,11 @@ Matrix4x4 XFormNode::get_xform_matrix(int time) const
 
 Matrix4x4 XFormNode::get_inv_xform_matrix(int time) const
 {
+	Matrix4x4 res;
+	if(get_xform_sample(time, true, &res)) {
+		return res;
+	}
+
 	if(!xform_cache.is_valid(time)) {
 		get_xform_matrix(time);	// calculate invxform
 	}
@@ -431,3 +430,99 @@ Matrix3x3 XFormNode::get_rot_matrix(int time) const
 	Quaternion rot = get_rotation(time);
 	return rot.get_rotation_matrix();
 }
+
+bool XFormNode::is_static() const
+{
+	if(ptrack.get_key_count() > 1 || rtrack.get_key_count() > 1 || strack.get_key_count() > 1) {
+		return false;
+	}
+	return !parent || parent->is_static();
+}
+
+void XFormNode::sample_xform(int t0, int t1, int num_samples)
+{
+	clear_xform_samples();	// so that we evaluate the tracks below
+
+	bool static_node = is_static();
+	int count = 1;
+	if(!static_node && t1 > t0 && num_samples > 1) {
+		count = min(num_samples, t1 - t0 + 1);
+	}
+
+	std::vector<int> stime(count);
+	std::vector<XFormCache> samples(count);
+
+	for(int i=0; i<count; i++) {
+		// integer sample times, so that they're exact if the interval is short
+		stime[i] = count > 1 ? t0 + (int)((long)(t1 - t0) * i / (count - 1)) : t0;
+		samples[i].xform = get_xform_matrix(stime[i]);
+		samples[i].inv_xform = get_inv_xform_matrix(stime[i]);
+	}
+
+	xform_stime.swap(stime);
+	xform_samples.swap(samples);
+	xform_static = static_node;
+}
+
+void XFormNode::clear_xform_samples()
+{
+	xform_stime.clear();
+	xform_samples.clear();
+	xform_static = false;
+}
+
+void XFormNode::invalidate_xform()
+{
+	xform_cache.invalidate();
+	clear_xform_samples();
+}
+
+/* looks up the (inverse if inv is true) transformation at the specified time
+ * in the baked samples. Returns false if the time is outside the sampled range.
+ */
+bool XFormNode::get_xform_sample(int time, bool inv, Matrix4x4 *res) const
+{
+	int count = (int)xform_stime.size();
+	if(!count) {
+		return false;
+	}
+
+	if(xform_static) {
+		*res = inv ? xform_samples[0].inv_xform : xform_samples[0].xform;
+		return true;
+	}
+	if(time < xform_stime[0] || time > xform_stime[count - 1]) {
+		return false;
+	}
+
+	// find the last sample at or before time
+	int idx = upper_bound(xform_stime.begin(), xform_stime.end(), time) - xform_stime.begin() - 1;
+
+	const XFormCache &a = xform_samples[idx];
+	if(xform_stime[idx] == time) {
+		*res = inv ? a.inv_xform : a.xform;
+		return true;
+	}
+
+	/* between samples, interpolate the transformation and invert it, since
+	 * the interpolated inverses wouldn't be its inverse. Both are cached, as
+	 * a ray needs both at the same time.
+	 */
+	if(!xform_cache.is_valid(time)) {
+		const XFormCache &b = xform_samples[idx + 1];
+		double t = (double)(time - xform_stime[idx]) / (double)(xform_stime[idx + 1] - xform_stime[idx]);
+
+		XFormCache xfc;
+		for(int i=0; i<4; i++) {
+			for(int j=0; j<4; j++) {
+				xfc.xform.m[i][j] = a.xform.m[i][j] + (b.xform.m[i][j] - a.xform.m[i][j]) * t;
+			}
+		}
+		xfc.inv_xform = xfc.xform.inverse();
+		xform_cache.set_data(xfc, time);
+	}
+
+	const XFormCache &xfc = xform_cache.get_data();
+	*res = inv ? xfc.inv_xform : xfc.xform;
+	return true;
+}
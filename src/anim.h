@@ -124,6 +124,14 @@ private:
 
 	mutable DataCache<XFormCache, int> xform_cache;
 
+	// transformations baked by sample_xform, at increasing times
+	std::vector<int> xform_stime;
+	std::vector<XFormCache> xform_samples;
+	bool xform_static;
+
+	void invalidate_xform();
+	bool get_xform_sample(int time, bool inv, Matrix4x4 *res) const;
+
 public:
 	XFormNode();
 	XFormNode(const XFormNode &node);
@@ -202,6 +210,18 @@ public:
 	virtual Matrix4x4 get_inv_xform_matrix(int time = 0) const;
 	/** get the rotation part of the transformation matrix for any given time value */
 	virtual Matrix3x3 get_rot_matrix(int time = 0) const;
+
+	/** returns true if neither this node, nor any of its parents are animated */
+	virtual bool is_static() const;
+
+	/** bakes the transformation matrices at num_samples times spread over the
+	 * interval [t0, t1] (or a single one if the node is static). Until the
+	 * node is modified, get_xform_matrix and get_inv_xform_matrix look up
+	 * times in that interval in these samples, interpolating linearly between
+	 * them, instead of evaluating the keyframe tracks.
+	 */
+	virtual void sample_xform(int t0, int t1, int num_samples);
+	virtual void clear_xform_samples();
 };
 
 #include "anim.inl"
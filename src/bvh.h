@@ -0,0 +1,149 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <vector>
+#include "aabb.h"
+#include "octree.h"	// for OctStats
+#include "raypacket.h"
+
+template <typename T>
+struct BVHItem {
+	// XXX data must be a pointer to an object with an intersect function
+	T data;
+	AABox box;	// over the whole motion interval, for moving items
+};
+
+/** BVH nodes are stored in a single array. The two children of an inner node
+ * are always adjacent, starting at index first. For leaves, first is the
+ * index of the first item in the (leaf-ordered) item array.
+ */
+struct BVHNode {
+	GeomBox box;	// over the whole motion interval, for moving items
+	int first;
+	int num_items;	// zero for inner nodes
+};
+
+/** the position of a ray's time among the key times of a BVH */
+struct BVHKeyTime {
+	int key;	// first of the two key boxes to interpolate, -1 for the node box
+	geom_t t;	// interpolation factor between them
+};
+
+/** Bounding volume hierarchy, built with the surface area heuristic.
+ *
+ * For motion blur, items may be added with a number of bounding boxes
+ * (keys), at evenly spaced times over the shutter interval. Every node
+ * then stores its bounds at the same times, and rays are tested against
+ * the node bounds interpolated at their time, instead of the much larger
+ * bounds over the whole interval.
+ */
+template <typename T>
+class BVH {
+private:
+	int items_per_leaf, max_depth;
+
+	std::vector<BVHItem<T> > items;
+	std::vector<BVHNode> nodes;
+	AABox bounds;
+
+	// motion keys: num_keys boxes per item and node, if num_keys > 1
+	int num_keys;
+	int key_t0, key_t1;
+	std::vector<AABox> item_keys;
+	std::vector<GeomBox> node_keys;
+
+	std::vector<int> item_pos;	// position of each item in the order they were added
+	double build_cost;
+
+	bool show_build_stats;
+
+	void build_rec(int nidx, int *idx, int start, int end, const Vector3 *cent,
+			const AABox *bbox, int lvl);
+	void build_keys();
+	double calc_cost() const;
+
+	inline BVHKeyTime key_time(long time) const;
+	inline const GeomBox *node_box(int nidx, const BVHKeyTime &kt, GeomBox *tmp) const;
+
+public:
+	BVH();
+
+	/** set the maximum tree depth */
+	void set_max_depth(int max_depth);
+	int get_max_depth() const;
+
+	/** set the maximum number of items per leaf. Nodes with fewer items may
+	 * still be split, if the surface area heuristic deems it worthwhile, but
+	 * nodes with more items are always split, unless they can't be.
+	 */
+	void set_max_items_per_leaf(int num);
+	int get_max_items_per_leaf() const;
+
+	void set_build_stats(bool bs);
+
+	/** clears the tree, and sets it up for static items */
+	void clear();
+
+	/** sets up the cleared tree for moving items, with num_keys bounding
+	 * boxes each, at evenly spaced times over [t0, t1]. May also be called
+	 * with the same number of keys before a refit, to move the interval.
+	 */
+	void set_motion(int t0, int t1, int num_keys);
+	int get_motion_keys() const;
+
+	/** add an item which stays within box */
+	void add(const AABox &box, const T &data);
+	/** add a moving item with its num_keys bounding boxes, see set_motion */
+	void add(const AABox *keys, const T &data);
+	void build();
+
+	/** replace the bounds of the n-th item added to a built tree, before
+	 * calling refit. keys must hold as many boxes as set_motion asked for.
+	 */
+	void set_item_bounds(int n, const AABox *keys);
+
+	/** recalculates the node bounds of a built tree bottom-up, after some
+	 * items moved, keeping the structure of the tree.
+	 * \return the SAH cost of the tree, relative to its cost when it was
+	 * built. The tree should be rebuilt when that grows too much.
+	 */
+	double refit();
+
+	/** find the nearest intersection between a given ray and the items in
+	 * the tree. Same semantics as Octree::intersect.
+	 */
+	const BVHItem<T> *intersect(const Ray &ray, SurfPoint *pt = 0) const;
+
+	/** packet version of intersect. Same semantics as Octree::intersect */
+	void intersect(const RayPacket &pkt, SurfPoint *pt, const BVHItem<T> **item) const;
+
+	/** returns true as soon as any item is found to intersect the ray.
+	 * Same semantics as Octree::occluded.
+	 */
+	bool occluded(const Ray &ray) const;
+
+	const AABox &get_bounds() const;
+
+	bool stats(OctStats *st) const;
+};
+
+#include "bvh.inl"
+
+#endif	// BVH_H_
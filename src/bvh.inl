@@ -0,0 +1,720 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <limits.h>
+#include <float.h>
+#include <algorithm>
+#include "object.h"
+#include "opt.h"
+
+#define BVH_NUM_BINS	16
+#define BVH_STACK_SIZE	64
+
+// relative cost of a traversal step, compared to an item intersection
+#define BVH_TRAV_COST	0.25
+
+template <typename T>
+BVH<T>::BVH()
+{
+	items_per_leaf = 4;
+	max_depth = BVH_STACK_SIZE - 2;
+	show_build_stats = VERBOSE;
+
+	clear();
+}
+
+template <typename T>
+void BVH<T>::set_max_depth(int max_depth)
+{
+	// the traversal stack must be able to hold a full path
+	this->max_depth = std::min(max_depth, BVH_STACK_SIZE - 2);
+}
+
+template <typename T>
+int BVH<T>::get_max_depth() const
+{
+	return max_depth;
+}
+
+template <typename T>
+void BVH<T>::set_max_items_per_leaf(int num)
+{
+	items_per_leaf = num;
+}
+
+template <typename T>
+int BVH<T>::get_max_items_per_leaf() const
+{
+	return items_per_leaf;
+}
+
+template <typename T>
+void BVH<T>::set_build_stats(bool bs)
+{
+	show_build_stats = bs;
+}
+
+template <typename T>
+void BVH<T>::clear()
+{
+	items.clear();
+	nodes.clear();
+	bounds.min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+	bounds.max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	num_keys = 1;
+	key_t0 = key_t1 = 0;
+	item_keys.clear();
+	node_keys.clear();
+
+	item_pos.clear();
+	build_cost = 0.0;
+}
+
+template <typename T>
+void BVH<T>::set_motion(int t0, int t1, int num_keys)
+{
+	if(t1 <= t0 || num_keys < 2) {
+		num_keys = 1;
+	}
+	this->num_keys = num_keys;
+	key_t0 = t0;
+	key_t1 = t1;
+}
+
+template <typename T>
+int BVH<T>::get_motion_keys() const
+{
+	return num_keys;
+}
+
+template <typename T>
+void BVH<T>::add(const AABox &box, const T &data)
+{
+	if(num_keys > 1) {
+		for(int i=0; i<num_keys; i++) {
+			item_keys.push_back(box);
+		}
+	}
+
+	BVHItem<T> item;
+	item.data = data;
+	item.box = box;
+
+	items.push_back(item);
+	bounds.expand(box);
+}
+
+template <typename T>
+void BVH<T>::add(const AABox *keys, const T &data)
+{
+	BVHItem<T> item;
+	item.data = data;
+	item.box = keys[0];
+
+	for(int i=0; i<num_keys; i++) {
+		item.box.expand(keys[i]);
+		if(num_keys > 1) {
+			item_keys.push_back(keys[i]);
+		}
+	}
+
+	items.push_back(item);
+	bounds.expand(item.box);
+}
+
+template <typename T>
+void BVH<T>::build()
+{
+	nodes.clear();
+
+	int num_items = (int)items.size();
+	if(!num_items) {
+		return;
+	}
+
+	std::vector<int> idx(num_items);
+	std::vector<Vector3> cent(num_items);
+	std::vector<AABox> bbox(num_items);
+
+	/* the tree is built around the boxes of moving items at the middle of
+	 * the interval, rather than the boxes of their whole motion.
+	 */
+	for(int i=0; i<num_items; i++) {
+		idx[i] = i;
+		bbox[i] = num_keys > 1 ? item_keys[i * num_keys + num_keys / 2] : items[i].box;
+		cent[i] = (bbox[i].min + bbox[i].max) * 0.5;
+	}
+
+	nodes.reserve(2 * num_items);
+	nodes.push_back(BVHNode());
+	build_rec(0, &idx[0], 0, num_items, &cent[0], &bbox[0], 0);
+
+	// reorder the items so that each leaf refers to a contiguous range
+	std::vector<BVHItem<T> > sorted(num_items);
+	item_pos.resize(num_items);
+	for(int i=0; i<num_items; i++) {
+		sorted[i] = items[idx[i]];
+		item_pos[idx[i]] = i;
+	}
+	items.swap(sorted);
+
+	if(num_keys > 1) {
+		std::vector<AABox> sorted_keys(item_keys.size());
+		for(int i=0; i<num_items; i++) {
+			for(int j=0; j<num_keys; j++) {
+				sorted_keys[i * num_keys + j] = item_keys[idx[i] * num_keys + j];
+			}
+		}
+		item_keys.swap(sorted_keys);
+
+		build_keys();
+	}
+	build_cost = calc_cost();
+
+	if(show_build_stats) {
+		OctStats st;
+
+		if(stats(&st)) {
+			printf("bvh h:%d in:%d out:%d items:%d (%d - %d, avg: %d)\n", st.height,
+					st.num_inner, st.num_leaves, st.num_items, st.min_items, st.max_items, st.avg_items);
+		}
+	}
+}
+
+/* binned SAH build, see: "On fast Construction of SAH-based Bounding Volume
+ * Hierarchies", Ingo Wald, IEEE Symposium on Interactive Ray Tracing 2007.
+ */
+template <typename T>
+void BVH<T>::build_rec(int nidx, int *idx, int start, int end, const Vector3 *cent,
+		const AABox *bbox, int lvl)
+{
+	int count = end - start;
+
+	// box encloses the items over the whole motion interval, sbox is for the SAH
+	AABox box, sbox, cbox;
+	box.min = sbox.min = cbox.min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+	box.max = sbox.max = cbox.max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for(int i=start; i<end; i++) {
+		box.expand(items[idx[i]].box);
+		sbox.expand(bbox[idx[i]]);
+		cbox.expand(AABox(cent[idx[i]], cent[idx[i]]));
+	}
+	nodes[nidx].box.set(box);
+
+	// find the best split plane among the bin boundaries of all 3 axes
+	int best_axis = -1, best_bin = 0;
+	double best_cost = DBL_MAX;
+
+	if(count > 1 && lvl < max_depth) {
+		for(int axis=0; axis<3; axis++) {
+			double extent = cbox.max[axis] - cbox.min[axis];
+			if(extent <= XSMALL_NUMBER) {
+				continue;
+			}
+			double bin_scale = BVH_NUM_BINS * (1.0 - XSMALL_NUMBER) / extent;
+
+			AABox bin_box[BVH_NUM_BINS];
+			int bin_count[BVH_NUM_BINS] = {0};
+
+			for(int i=0; i<BVH_NUM_BINS; i++) {
+				bin_box[i].min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+				bin_box[i].max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			}
+
+			for(int i=start; i<end; i++) {
+				int bin = (int)((cent[idx[i]][axis] - cbox.min[axis]) * bin_scale);
+				bin_count[bin]++;
+				bin_box[bin].expand(bbox[idx[i]]);
+			}
+
+			// sweep from the right, to get the area of every right-hand side
+			double right_area[BVH_NUM_BINS];
+			int right_count[BVH_NUM_BINS];
+			AABox acc = bin_box[BVH_NUM_BINS - 1];
+			int nacc = 0;
+
+			for(int i=BVH_NUM_BINS-1; i>0; i--) {
+				acc.expand(bin_box[i]);
+				nacc += bin_count[i];
+				right_area[i] = acc.surface_area();
+				right_count[i] = nacc;
+			}
+
+			// then sweep from the left, evaluating the split after each bin
+			acc = bin_box[0];
+			nacc = 0;
+
+			for(int i=0; i<BVH_NUM_BINS-1; i++) {
+				acc.expand(bin_box[i]);
+				nacc += bin_count[i];
+
+				if(!nacc || !right_count[i + 1]) {
+					continue;
+				}
+
+				double cost = acc.surface_area() * nacc + right_area[i + 1] * right_count[i + 1];
+				if(cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = i;
+				}
+			}
+		}
+	}
+
+	double area = sbox.surface_area();
+	if(area > 0.0) {
+		best_cost = BVH_TRAV_COST + best_cost / area;
+	}
+
+	bool make_leaf = count <= 1 || lvl >= max_depth;
+	if(!make_leaf && count <= items_per_leaf) {
+		// small enough for a leaf, split only if the SAH says it pays off
+		make_leaf = best_axis == -1 || best_cost >= (double)count;
+	}
+
+	if(make_leaf) {
+		nodes[nidx].first = start;
+		nodes[nidx].num_items = count;
+		return;
+	}
+
+	int mid;
+	if(best_axis != -1) {
+		double extent = cbox.max[best_axis] - cbox.min[best_axis];
+		double bin_scale = BVH_NUM_BINS * (1.0 - XSMALL_NUMBER) / extent;
+
+		int *iter = idx + start;
+		int *split = idx + end;
+		while(iter < split) {
+			int bin = (int)((cent[*iter][best_axis] - cbox.min[best_axis]) * bin_scale);
+			if(bin <= best_bin) {
+				iter++;
+			} else {
+				std::swap(*iter, *--split);
+			}
+		}
+		mid = (int)(split - idx);
+	} else {
+		// all centroids coincide, just split the list in half
+		mid = (start + end) / 2;
+	}
+
+	int child = (int)nodes.size();
+	nodes[nidx].first = child;
+	nodes[nidx].num_items = 0;
+
+	nodes.push_back(BVHNode());
+	nodes.push_back(BVHNode());
+
+	build_rec(child, idx, start, mid, cent, bbox, lvl + 1);
+	build_rec(child + 1, idx, mid, end, cent, bbox, lvl + 1);
+}
+
+template <typename T>
+void BVH<T>::set_item_bounds(int n, const AABox *keys)
+{
+	int pos = item_pos[n];
+
+	items[pos].box = keys[0];
+	for(int i=0; i<num_keys; i++) {
+		items[pos].box.expand(keys[i]);
+		if(num_keys > 1) {
+			item_keys[pos * num_keys + i] = keys[i];
+		}
+	}
+}
+
+template <typename T>
+double BVH<T>::refit()
+{
+	int num_nodes = (int)nodes.size();
+	if(!num_nodes) {
+		return 1.0;
+	}
+
+	// same reverse pass as build_keys, for the bounds over the whole interval
+	std::vector<AABox> box(num_nodes);
+
+	for(int i=num_nodes-1; i>=0; i--) {
+		const BVHNode *node = &nodes[i];
+
+		if(node->num_items) {
+			box[i] = items[node->first].box;
+			for(int j=1; j<node->num_items; j++) {
+				box[i].expand(items[node->first + j].box);
+			}
+		} else {
+			box[i] = box[node->first];
+			box[i].expand(box[node->first + 1]);
+		}
+		nodes[i].box.set(box[i]);
+	}
+	bounds = box[0];
+
+	if(num_keys > 1) {
+		build_keys();
+	}
+
+	return build_cost > 0.0 ? calc_cost() / build_cost : 1.0;
+}
+
+/* calculates the key boxes of all nodes bottom-up. Children always come after
+ * their parent in the node array, so a reverse pass visits them first.
+ */
+template <typename T>
+void BVH<T>::build_keys()
+{
+	int num_nodes = (int)nodes.size();
+
+	std::vector<AABox> keys(num_nodes * num_keys);
+	node_keys.resize(num_nodes * num_keys);
+
+	for(int i=num_nodes-1; i>=0; i--) {
+		const BVHNode *node = &nodes[i];
+		AABox *nkeys = &keys[i * num_keys];
+
+		for(int j=0; j<num_keys; j++) {
+			if(node->num_items) {
+				nkeys[j] = item_keys[node->first * num_keys + j];
+				for(int k=1; k<node->num_items; k++) {
+					nkeys[j].expand(item_keys[(node->first + k) * num_keys + j]);
+				}
+			} else {
+				nkeys[j] = keys[node->first * num_keys + j];
+				nkeys[j].expand(keys[(node->first + 1) * num_keys + j]);
+			}
+			node_keys[i * num_keys + j].set(nkeys[j]);
+		}
+	}
+}
+
+static inline double bvh_box_area(const GeomBox &box)
+{
+	double dx = box.max[0] - box.min[0];
+	double dy = box.max[1] - box.min[1];
+	double dz = box.max[2] - box.min[2];
+	return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+/* SAH cost of the whole tree, relative to the area of the root */
+template <typename T>
+double BVH<T>::calc_cost() const
+{
+	double root_area = bvh_box_area(nodes[0].box);
+	if(root_area <= 0.0) {
+		return 0.0;
+	}
+
+	double cost = 0.0;
+	for(size_t i=0; i<nodes.size(); i++) {
+		double area = bvh_box_area(nodes[i].box);
+		cost += area * (nodes[i].num_items ? (double)nodes[i].num_items : BVH_TRAV_COST);
+	}
+	return cost / root_area;
+}
+
+template <typename T>
+inline BVHKeyTime BVH<T>::key_time(long time) const
+{
+	BVHKeyTime kt;
+	kt.key = -1;
+	kt.t = 0.0;
+
+	if(num_keys > 1 && time >= key_t0 && time <= key_t1) {
+		double f = (double)(time - key_t0) / (double)(key_t1 - key_t0) * (num_keys - 1);
+		kt.key = std::min((int)f, num_keys - 2);
+		kt.t = (geom_t)(f - kt.key);
+	}
+	return kt;
+}
+
+/* returns the bounds of a node at the given key time. Interpolated bounds are
+ * written to tmp. Times outside the motion interval get the node box, which
+ * covers all of it.
+ */
+template <typename T>
+inline const GeomBox *BVH<T>::node_box(int nidx, const BVHKeyTime &kt, GeomBox *tmp) const
+{
+	if(kt.key < 0) {
+		return &nodes[nidx].box;
+	}
+
+	const GeomBox *keys = &node_keys[nidx * num_keys + kt.key];
+	tmp->lerp(keys[0], keys[1], kt.t);
+	return tmp;
+}
+
+struct BVHStackItem {
+	int node;
+	double tnear;
+};
+
+template <typename T>
+const BVHItem<T> *BVH<T>::intersect(const Ray &ray, SurfPoint *pt) const
+{
+	if(nodes.empty()) {
+		return 0;
+	}
+
+	BoxTestRay bray(ray);
+	BVHKeyTime kt = key_time(ray.time);
+	GeomBox tmp0, tmp1;
+
+	SurfPoint pt0;
+	pt0.dist = 1.0;	// rays are parametric segments in [0, 1]
+	const BVHItem<T> *closest = 0;
+
+	BVHStackItem stack[BVH_STACK_SIZE];
+	int top = 0;
+
+	if(!node_box(0, kt, &tmp0)->intersect(bray, 0.0, 1.0, &stack[0].tnear)) {
+		return 0;
+	}
+	stack[top++].node = 0;
+
+	while(top > 0) {
+		top--;
+		if(stack[top].tnear > pt0.dist) {
+			continue;	// a closer intersection was found since this was pushed
+		}
+		const BVHNode *node = &nodes[stack[top].node];
+
+		if(node->num_items) {
+			const BVHItem<T> *item = &items[node->first];
+
+			for(int i=0; i<node->num_items; i++) {
+				SurfPoint pt;
+
+				// XXX data must be a pointer to an object with an intersect function
+				if(item[i].data->intersect(ray, &pt) && pt.dist <= pt0.dist) {
+					pt0 = pt;
+					closest = item + i;
+				}
+			}
+			continue;
+		}
+
+		// visit the nearest child first, by pushing it last
+		int c0 = node->first;
+		double t0 = 0.0, t1 = 0.0;
+		bool hit0 = node_box(c0, kt, &tmp0)->intersect(bray, 0.0, pt0.dist, &t0);
+		bool hit1 = node_box(c0 + 1, kt, &tmp1)->intersect(bray, 0.0, pt0.dist, &t1);
+
+		if(hit0 && hit1) {
+			bool swap = t1 < t0;
+			stack[top].node = c0 + (swap ? 0 : 1);
+			stack[top++].tnear = swap ? t0 : t1;
+			stack[top].node = c0 + (swap ? 1 : 0);
+			stack[top++].tnear = swap ? t1 : t0;
+		} else if(hit0) {
+			stack[top].node = c0;
+			stack[top++].tnear = t0;
+		} else if(hit1) {
+			stack[top].node = c0 + 1;
+			stack[top++].tnear = t1;
+		}
+	}
+
+	if(closest && pt) {
+		*pt = pt0;
+	}
+	return closest;
+}
+
+struct BVHPacketStackItem {
+	int node;
+	int first;	// first ray of the packet which hit the parent node
+};
+
+template <typename T>
+void BVH<T>::intersect(const RayPacket &pkt, SurfPoint *pt, const BVHItem<T> **item) const
+{
+	double tmax[RAY_PACKET_SIZE];
+	for(int i=0; i<pkt.count; i++) {
+		tmax[i] = 1.0;
+		item[i] = 0;
+	}
+
+	if(nodes.empty()) {
+		return;
+	}
+
+	// interpolated node bounds are only used if all rays share the same time
+	BVHKeyTime kt = key_time(pkt.ray[0].time);
+	for(int i=1; i<pkt.count; i++) {
+		if(pkt.ray[i].time != pkt.ray[0].time) {
+			kt.key = -1;
+			break;
+		}
+	}
+	GeomBox tmp, tmp0, tmp1;
+
+	BVHPacketStackItem stack[BVH_STACK_SIZE];
+	int top = 0;
+
+	stack[top].node = 0;
+	stack[top++].first = 0;
+
+	while(top > 0) {
+		top--;
+		const BVHNode *node = &nodes[stack[top].node];
+		const GeomBox *box = node_box(stack[top].node, kt, &tmp);
+
+		double pkt_tmax = 0.0;
+		for(int i=stack[top].first; i<pkt.count; i++) {
+			if(tmax[i] > pkt_tmax) pkt_tmax = tmax[i];
+		}
+		if(pkt.misses(*box, pkt_tmax)) {
+			continue;
+		}
+
+		double tnear;
+		int first = pkt.first_hit(*box, stack[top].first, tmax, &tnear);
+		if(first == -1) {
+			continue;
+		}
+
+		if(node->num_items) {
+			const BVHItem<T> *it = &items[node->first];
+
+			for(int i=first; i<pkt.count; i++) {
+				if(i > first && !box->intersect(pkt.bray[i], 0.0, tmax[i])) {
+					continue;
+				}
+
+				for(int j=0; j<node->num_items; j++) {
+					SurfPoint sp;
+
+					if(it[j].data->intersect(pkt.ray[i], &sp) && sp.dist <= tmax[i]) {
+						pt[i] = sp;
+						tmax[i] = sp.dist;
+						item[i] = it + j;
+					}
+				}
+			}
+			continue;
+		}
+
+		// visit the child nearest to the first active ray first, by pushing it last
+		int c0 = node->first;
+		double t0, t1;
+		if(!node_box(c0, kt, &tmp0)->intersect(pkt.bray[first], 0.0, tmax[first], &t0)) {
+			t0 = DBL_MAX;
+		}
+		if(!node_box(c0 + 1, kt, &tmp1)->intersect(pkt.bray[first], 0.0, tmax[first], &t1)) {
+			t1 = DBL_MAX;
+		}
+		bool swap = t1 < t0;
+
+		stack[top].node = c0 + (swap ? 0 : 1);
+		stack[top++].first = first;
+		stack[top].node = c0 + (swap ? 1 : 0);
+		stack[top++].first = first;
+	}
+}
+
+template <typename T>
+bool BVH<T>::occluded(const Ray &ray) const
+{
+	if(nodes.empty()) {
+		return false;
+	}
+
+	BoxTestRay bray(ray);
+	BVHKeyTime kt = key_time(ray.time);
+	GeomBox tmp;
+
+	if(!node_box(0, kt, &tmp)->intersect(bray, 0.0, 1.0)) {
+		return false;
+	}
+
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while(top > 0) {
+		const BVHNode *node = &nodes[stack[--top]];
+
+		if(node->num_items) {
+			const BVHItem<T> *item = &items[node->first];
+
+			for(int i=0; i<node->num_items; i++) {
+				if(item[i].data->occluded(ray)) {
+					return true;
+				}
+			}
+			continue;
+		}
+
+		int c0 = node->first;
+		if(node_box(c0, kt, &tmp)->intersect(bray, 0.0, 1.0)) {
+			stack[top++] = c0;
+		}
+		if(node_box(c0 + 1, kt, &tmp)->intersect(bray, 0.0, 1.0)) {
+			stack[top++] = c0 + 1;
+		}
+	}
+	return false;
+}
+
+template <typename T>
+const AABox &BVH<T>::get_bounds() const
+{
+	return bounds;
+}
+
+static inline void bvh_gather_stats(const std::vector<BVHNode> &nodes, int nidx, OctStats *st, int lvl)
+{
+	const BVHNode *node = &nodes[nidx];
+
+	st->height = MAX(st->height, lvl);
+
+	if(node->num_items) {
+		st->num_leaves++;
+		st->num_items += node->num_items;
+
+		if(node->num_items < st->min_items) {
+			st->min_items = node->num_items;
+		}
+		if(node->num_items > st->max_items) {
+			st->max_items = node->num_items;
+		}
+	} else {
+		st->num_inner++;
+
+		bvh_gather_stats(nodes, node->first, st, lvl + 1);
+		bvh_gather_stats(nodes, node->first + 1, st, lvl + 1);
+	}
+}
+
+template <typename T>
+bool BVH<T>::stats(OctStats *st) const
+{
+	if(nodes.empty()) return false;
+
+	memset(st, 0, sizeof *st);
+	st->min_items = INT_MAX;
+	st->max_items = 0;
+
+	bvh_gather_stats(nodes, 0, st, 0);
+
+	st->avg_items = st->num_items / st->num_leaves;
+	return true;
+}
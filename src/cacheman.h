@@ -18,43 +18,44 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef CACHEMAN_H_
 #define CACHEMAN_H_
 
-#include <vector>
-
 #ifndef NO_THREADS
-#ifdef __GNUC__
-#include <ext/hash_map>
-#else
-#include <hash_map>
+#include "tpool.h"
 #endif
 
-#include <pthread.h>
-#endif
+/* thread indices 0 to 2^DCACHE_MAX_CHUNKS - 2 get a slot in the cache */
+#define DCACHE_MAX_CHUNKS	12
 
 /** DataCache implements the concept of a cached bit of data
  * per thread. The cached data has an associated key, if the
  * key supplied to is_valid, is different than the key stored
  * with the cache, then the cache needs updating. Otherwise, the
  * value returned by get_data can be used.
+ *
+ * Each thread uses the slot selected by its thread index (see
+ * get_thread_index), so no locking or lookups are involved. Slots are
+ * allocated in chunks of doubling size, the first time a thread with an
+ * index in that chunk needs them, and never move afterwards.
  */
 template <typename D, typename K = long>
 class DataCache {
 private:
-	std::vector<D> data;
-	std::vector<K> key;
+	struct Slot {
+		D data;
+		K key;
+	};
+	// chunk n holds the slots of thread indices 2^n - 1 to 2^(n+1) - 2
+	Slot *chunk[DCACHE_MAX_CHUNKS];
 	K invalid_key;
 
-#ifndef NO_THREADS
-#ifdef __GNUC__
-	typedef __gnu_cxx::hash_map<pthread_t, int> hash_table;
-#else
-	typedef std::hash_map<pthread_t, int> hash_table;
-#endif
-	mutable hash_table thread_id_map;
-#endif
-
-	int get_index() const;
+	Slot *get_slot(bool alloc) const;
 
 public:
+	DataCache();
+	DataCache(const DataCache &dc);	// caches aren't copied, only the invalid key
+	~DataCache();
+
+	DataCache &operator =(const DataCache &dc);
+
 	/** set the key value to be considered invalid */
 	void set_invalid_key(const K &inval);
 
@@ -16,39 +16,73 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <assert.h>
-#include <pthread.h>
+#include <string.h>
 
 template <typename D, typename K>
-int DataCache<D, K>::get_index() const
+DataCache<D, K>::DataCache()
+	: invalid_key()
 {
-	if(data.size() == 1) return 0;
-
-#ifndef NO_THREADS
-	pthread_t thread = pthread_self();
-
-	hash_table::iterator iter = thread_id_map.find(thread);
-	if(iter == thread_id_map.end()) {
-		static pthread_mutex_t resize_mutex = PTHREAD_MUTEX_INITIALIZER;
-		pthread_mutex_lock(&resize_mutex);
+	memset(chunk, 0, sizeof chunk);
+}
 
-		int count = (int)data.size();
+template <typename D, typename K>
+DataCache<D, K>::DataCache(const DataCache<D, K> &dc)
+	: invalid_key(dc.invalid_key)
+{
+	memset(chunk, 0, sizeof chunk);
+}
 
-		((DataCache<D, K>*)this)->data.resize(count + 1);
-		((DataCache<D, K>*)this)->key.resize(count + 1, invalid_key);
+template <typename D, typename K>
+DataCache<D, K>::~DataCache()
+{
+	for(int i=0; i<DCACHE_MAX_CHUNKS; i++) {
+		delete [] chunk[i];
+	}
+}
 
-		thread_id_map[thread] = count;
+template <typename D, typename K>
+DataCache<D, K> &DataCache<D, K>::operator =(const DataCache<D, K> &dc)
+{
+	invalid_key = dc.invalid_key;
+	invalidate();
+	return *this;
+}
 
-		pthread_mutex_unlock(&resize_mutex);
-		return count;
-	}
-	return iter->second;
+/* returns the slot of the calling thread, or 0 if it hasn't been allocated
+ * yet and alloc is false.
+ */
+template <typename D, typename K>
+typename DataCache<D, K>::Slot *DataCache<D, K>::get_slot(bool alloc) const
+{
+#ifndef NO_THREADS
+	int idx = get_thread_index();
 #else
-	if(data.empty()) {
-		((DataCache<D, K>*)this)->data.resize(1);
-		((DataCache<D, K>*)this)->key.resize(1, invalid_key);
-	}
-	return 0;
+	int idx = 0;
 #endif
+	int c = 31 - __builtin_clz(idx + 1);	// floor(log2(idx + 1))
+	assert(c < DCACHE_MAX_CHUNKS);
+
+	Slot *slots = __atomic_load_n(chunk + c, __ATOMIC_ACQUIRE);
+	if(!slots) {
+		if(!alloc) {
+			return 0;
+		}
+
+		int count = 1 << c;
+		Slot *new_slots = new Slot[count];
+		for(int i=0; i<count; i++) {
+			new_slots[i].key = invalid_key;
+		}
+
+		// another thread of the same chunk may have beaten us to it
+		Slot **dest = (Slot**)chunk + c;
+		if(__atomic_compare_exchange_n(dest, &slots, new_slots, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			slots = new_slots;
+		} else {
+			delete [] new_slots;
+		}
+	}
+	return slots + idx - ((1 << c) - 1);
 }
 
 template <typename D, typename K>
@@ -60,21 +94,20 @@ void DataCache<D, K>::set_invalid_key(const K &inval)
 template <typename D, typename K>
 bool DataCache<D, K>::is_valid(const K &key) const
 {
-	if(data.empty()) {
-		return false;
-	}
-
-	int idx = get_index();
-	assert(idx < (int)data.size());
-
-	return key == this->key[idx];
+	Slot *slot = get_slot(false);
+	return slot && key == slot->key;
 }
 
 template <typename D, typename K>
 void DataCache<D, K>::invalidate()
 {
-	for(size_t i=0; i<key.size(); i++) {
-		key[i] = invalid_key;
+	for(int i=0; i<DCACHE_MAX_CHUNKS; i++) {
+		if(chunk[i]) {
+			int count = 1 << i;
+			for(int j=0; j<count; j++) {
+				chunk[i][j].key = invalid_key;
+			}
+		}
 	}
 }
 
@@ -82,18 +115,13 @@ void DataCache<D, K>::invalidate()
 template <typename D, typename K>
 const D &DataCache<D, K>::get_data() const
 {
-	int idx = get_index();
-	assert(idx < (int)data.size());
-
-	return data[idx];
+	return get_slot(true)->data;
 }
 
 template <typename D, typename K>
 void DataCache<D, K>::set_data(const D &data, const K &key)
 {
-	int idx = get_index();
-	assert(idx < (int)this->data.size());
-
-	this->data[idx] = data;
-	this->key[idx] = key;
+	Slot *slot = get_slot(true);
+	slot->data = data;
+	slot->key = key;
 }
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "camera.h"
 #include "opt.h"
+#include "rng.h"
 
 
 enum { CAM_FREE, CAM_TARGET };
@@ -125,8 +126,8 @@ Ray Camera::get_primary_ray(int x, int y, int sub, unsigned int time) const
 	double py = 1.0 - ((double)y / (double)opt.height) * ysz;
 
 	if(sub > 0) {
-		px += xsz * (frand(1.0) - 0.5) / (double)opt.width;
-		py += ysz * (frand(1.0) - 0.5) / (double)opt.height;
+		px += xsz * (rng_frand(1.0) - 0.5) / (double)opt.width;
+		py += ysz * (rng_frand(1.0) - 0.5) / (double)opt.height;
 	}
 
 	Ray ray(Vector3(0, 0, 0), Vector3(px, py, 1.0 / tan(0.5 * vfov)));
@@ -135,7 +136,7 @@ Ray Camera::get_primary_ray(int x, int y, int sub, unsigned int time) const
 
 	// for motion blur, use a random time within the frame interval
 	if(opt.mblur && sub > 0) {
-		ray.time += rand() % shutter - shutter / 2;
+		ray.time += rng_int(shutter) - shutter / 2;
 	}
 
 	return ray.transformed(get_matrix(ray.time));
@@ -0,0 +1,47 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GEOM_H_
+#define GEOM_H_
+
+#include <float.h>
+
+/** geom_t is the scalar type of the geometry stored in the intersection core:
+ * the triangle packets of meshes, and the node boxes of the octree and bvh.
+ * By default it's single precision, which halves their memory footprint, and
+ * doubles the number of triangles tested per SIMD instruction. Build with
+ * -DGEOM_DOUBLE to use double precision throughout.
+ *
+ * Either way, hit distances, positions and surface properties are computed
+ * in double precision.
+ */
+#ifdef GEOM_DOUBLE
+typedef double geom_t;
+#define GEOM_EPSILON	DBL_EPSILON
+#define GEOM_MAX		DBL_MAX
+#else
+typedef float geom_t;
+#define GEOM_EPSILON	FLT_EPSILON
+#define GEOM_MAX		FLT_MAX
+#endif
+
+/* the far distance of slab tests is scaled by this, to make up for rounding
+ * errors, see: "Robust BVH Ray Traversal", Thiago Ize, JCGT 2013.
+ */
+#define GEOM_SLAB_SCALE		((geom_t)(1.0 + 3.0 * GEOM_EPSILON))
+
+#endif	// GEOM_H_
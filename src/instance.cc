@@ -0,0 +1,136 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <float.h>
+#include "instance.h"
+#include "scene.h"
+
+MeshInstance::MeshInstance(const Mesh *mesh)
+{
+	this->mesh = mesh;
+}
+
+bool MeshInstance::load_xml(struct xml_node *node)
+{
+	if(!Object::load_xml(node)) {
+		return false;
+	}
+
+	struct xml_attr *attr;
+
+	node = node->chld;
+	while(node) {
+		if(strcmp(node->name, "meshref") == 0) {
+			if(!(attr = xml_get_attr(node, "name"))) {
+				fprintf(stderr, "invalid mesh reference in object %s: no name attribute\n",
+						get_name());
+				return false;
+			}
+
+			Scene *scn = get_scene();
+			if(!(mesh = scn->get_mesh(attr->str))) {
+				fprintf(stderr, "mesh %s referenced by object %s does not exist\n",
+						attr->str, get_name());
+				return false;
+			}
+		}
+		node = node->next;
+	}
+
+	if(!mesh) {
+		fprintf(stderr, "<meshref> not found in instance object %s\n", get_name());
+		return false;
+	}
+	return true;
+}
+
+void MeshInstance::set_mesh(const Mesh *mesh)
+{
+	this->mesh = mesh;
+	bbcache.invalidate();
+}
+
+const Mesh *MeshInstance::get_mesh() const
+{
+	return mesh;
+}
+
+/* transforms the corners of the local bounding box of the mesh, instead of
+ * all its vertices, to avoid touching the geometry for every instance.
+ */
+void MeshInstance::calc_bounds(AABox *aabb, int msec) const
+{
+	const AABox &lbox = mesh->get_tree()->get_bounds();
+	Matrix4x4 xform = get_xform_matrix(msec);
+
+	aabb->min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+	aabb->max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for(int i=0; i<8; i++) {
+		Vector3 pos = Vector3(i & 1 ? lbox.max.x : lbox.min.x,
+				i & 2 ? lbox.max.y : lbox.min.y,
+				i & 4 ? lbox.max.z : lbox.min.z).transformed(xform);
+
+		if(pos.x < aabb->min.x) aabb->min.x = pos.x;
+		if(pos.y < aabb->min.y) aabb->min.y = pos.y;
+		if(pos.z < aabb->min.z) aabb->min.z = pos.z;
+
+		if(pos.x > aabb->max.x) aabb->max.x = pos.x;
+		if(pos.y > aabb->max.y) aabb->max.y = pos.y;
+		if(pos.z > aabb->max.z) aabb->max.z = pos.z;
+	}
+}
+
+/* conservative, any acceleration structure node overlapping the bounds of
+ * the instance gets it.
+ */
+bool MeshInstance::in_box(const AABox *box, int msec) const
+{
+	AABox bbox;
+	get_bounds(&bbox, msec);
+	return bbox.in_box(box);
+}
+
+bool MeshInstance::intersect(const Ray &wray, SurfPoint *pt) const
+{
+	// transform ray to the local coordinates of the mesh
+	Matrix4x4 inv_mat = get_inv_xform_matrix(wray.time);
+	Ray ray = wray.transformed(inv_mat);
+
+	if(!mesh->intersect_local(ray, pt)) {
+		return false;
+	}
+
+	if(pt) {
+		Matrix4x4 xform = get_xform_matrix(ray.time);
+		Matrix4x4 inv_trans = inv_mat.transposed();
+
+		// transform everything back into world coordinates
+		pt->pos.transform(xform);
+		pt->normal.transform(inv_trans);
+		pt->tangent.transform(inv_trans);
+
+		pt->normal.normalize();
+		pt->tangent.normalize();
+	}
+	return true;
+}
+
+bool MeshInstance::occluded(const Ray &wray) const
+{
+	return mesh->occluded_local(wray.transformed(get_inv_xform_matrix(wray.time)));
+}
@@ -0,0 +1,211 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <math.h>
+#include "irrcache.h"
+
+/* limits of the record distances, relative to the size of the scene */
+#define MIN_SPACING		0.002
+#define MAX_SPACING		0.128
+
+#define MAX_DEPTH		20
+
+IrrCache::Node::Node(const Vector3 &center, double half_size)
+{
+	this->center = center;
+	this->half_size = half_size;
+	for(int i=0; i<8; i++) {
+		child[i] = 0;
+	}
+}
+
+IrrCache::Node::~Node()
+{
+	for(int i=0; i<8; i++) {
+		delete child[i];
+	}
+}
+
+IrrCache::IrrCache()
+{
+	root = 0;
+	accuracy = 0.2;
+	min_spacing = max_spacing = 0.0;
+	num_rec = 0;
+
+	pthread_rwlock_init(&lock, 0);
+}
+
+IrrCache::~IrrCache()
+{
+	delete root;
+	pthread_rwlock_destroy(&lock);
+}
+
+void IrrCache::clear(const AABox &bounds, double accuracy)
+{
+	pthread_rwlock_wrlock(&lock);
+
+	Vector3 size = bounds.max - bounds.min;
+	double max_size = size.x > size.y ? size.x : size.y;
+	if(size.z > max_size) max_size = size.z;
+
+	delete root;
+	root = new Node((bounds.min + bounds.max) / 2.0, max_size * 0.5 + 1e-4);
+	num_rec = 0;
+
+	this->accuracy = accuracy;
+
+	double diag = size.length();
+	min_spacing = diag * MIN_SPACING;
+	max_spacing = diag * MAX_SPACING;
+
+	pthread_rwlock_unlock(&lock);
+}
+
+/* adds the contribution of the records in rec which are valid at pos, to the
+ * weighted sum of irradiance.
+ */
+static void add_valid(const std::vector<IrrRecord> &rec, double accuracy,
+		const Vector3 &pos, const Vector3 &norm, Color *sum, double *sum_w)
+{
+	for(size_t i=0; i<rec.size(); i++) {
+		const IrrRecord *r = &rec[i];
+
+		Vector3 offs = pos - r->pos;
+
+		// skip records in front of pos
+		if(dot_product(offs, (norm + r->norm) * 0.5) < -0.05 * r->dist) {
+			continue;
+		}
+
+		double ndot = dot_product(norm, r->norm);
+		double err = offs.length() / r->dist + sqrt(ndot < 1.0 ? 1.0 - ndot : 0.0);
+		if(err >= accuracy) {
+			continue;
+		}
+
+		// falls off to zero at the edge of the valid region
+		double w = err > 1e-6 ? 1.0 / err - 1.0 / accuracy : 1e6;
+
+		Vector3 rot = cross_product(r->norm, norm);
+		*sum += Color(r->irrad.x + dot_product(rot, r->rot_grad[0]) + dot_product(offs, r->trans_grad[0]),
+				r->irrad.y + dot_product(rot, r->rot_grad[1]) + dot_product(offs, r->trans_grad[1]),
+				r->irrad.z + dot_product(rot, r->rot_grad[2]) + dot_product(offs, r->trans_grad[2])) * w;
+		*sum_w += w;
+	}
+}
+
+bool IrrCache::lookup(const Vector3 &pos, const Vector3 &norm, Color *irrad) const
+{
+	Color sum;
+	double sum_w = 0.0;
+
+	pthread_rwlock_rdlock(&lock);
+
+	/* a record is stored in the node containing its position, with a half
+	 * size at least as large as its valid radius, so only nodes within a
+	 * half size of pos can have records valid there.
+	 */
+	const Node *stack[MAX_DEPTH * 8 + 1];
+	int top = 0;
+
+	if(root) {
+		stack[top++] = root;
+	}
+	while(top > 0) {
+		const Node *node = stack[--top];
+		add_valid(node->rec, accuracy, pos, norm, &sum, &sum_w);
+
+		for(int i=0; i<8; i++) {
+			const Node *c = node->child[i];
+			if(!c) continue;
+
+			double reach = c->half_size * 2.0;
+			if(fabs(pos.x - c->center.x) <= reach && fabs(pos.y - c->center.y) <= reach &&
+					fabs(pos.z - c->center.z) <= reach) {
+				stack[top++] = c;
+			}
+		}
+	}
+
+	pthread_rwlock_unlock(&lock);
+
+	if(sum_w <= 0.0) {
+		return false;
+	}
+
+	sum /= sum_w;
+	irrad->x = sum.x > 0.0 ? sum.x : 0.0;
+	irrad->y = sum.y > 0.0 ? sum.y : 0.0;
+	irrad->z = sum.z > 0.0 ? sum.z : 0.0;
+	irrad->w = 0.0;
+	return true;
+}
+
+void IrrCache::add(const IrrRecord &rec)
+{
+	IrrRecord r = rec;
+
+	// don't let the irradiance extrapolated by the gradient go negative
+	for(int i=0; i<3; i++) {
+		double grad = r.trans_grad[i].length();
+		if(grad * r.dist > r.irrad[i]) {
+			r.dist = r.irrad[i] / grad;
+		}
+	}
+	if(r.dist < min_spacing) r.dist = min_spacing;
+	if(r.dist > max_spacing) r.dist = max_spacing;
+
+	double rad = r.dist * accuracy;
+
+	pthread_rwlock_wrlock(&lock);
+
+	Node *node = root;
+	if(node) {
+		Vector3 offs = r.pos - node->center;
+		bool inside = fabs(offs.x) <= node->half_size && fabs(offs.y) <= node->half_size &&
+			fabs(offs.z) <= node->half_size;
+
+		for(int depth=0; inside && depth<MAX_DEPTH; depth++) {
+			double half = node->half_size * 0.5;
+			if(half < rad) break;
+
+			int idx = (r.pos.x > node->center.x ? 1 : 0) | (r.pos.y > node->center.y ? 2 : 0) |
+				(r.pos.z > node->center.z ? 4 : 0);
+
+			if(!node->child[idx]) {
+				Vector3 center;
+				center.x = node->center.x + (idx & 1 ? half : -half);
+				center.y = node->center.y + (idx & 2 ? half : -half);
+				center.z = node->center.z + (idx & 4 ? half : -half);
+				node->child[idx] = new Node(center, half);
+			}
+			node = node->child[idx];
+		}
+
+		node->rec.push_back(r);
+		num_rec++;
+	}
+
+	pthread_rwlock_unlock(&lock);
+}
+
+int IrrCache::size() const
+{
+	return num_rec;
+}
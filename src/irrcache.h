@@ -0,0 +1,87 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef IRRCACHE_H_
+#define IRRCACHE_H_
+
+#include <vector>
+#include <pthread.h>
+#include <vmath/vmath.h>
+#include "color.h"
+#include "aabb.h"
+
+/** Indirect irradiance computed at a point, with its gradients (Ward &
+ * Heckbert) for each color channel.
+ */
+struct IrrRecord {
+	Vector3 pos, norm;
+	Color irrad;
+	Vector3 rot_grad[3];	// change with the rotation of the normal
+	Vector3 trans_grad[3];	// change with the translation of the point
+	double dist;			// harmonic mean distance of the surfaces seen
+};
+
+/** Irradiance cache (Ward). Stores records of indirect irradiance at sparse
+ * points of the scene, in an octree, and interpolates them at any nearby
+ * point which is within the valid radius of one or more records.
+ *
+ * Lookups and additions may be done concurrently by any number of threads.
+ */
+class IrrCache {
+private:
+	struct Node {
+		Vector3 center;
+		double half_size;
+		std::vector<IrrRecord> rec;
+		Node *child[8];
+
+		Node(const Vector3 &center, double half_size);
+		~Node();
+	};
+
+	Node *root;
+	double accuracy;
+	double min_spacing, max_spacing;
+	int num_rec;
+
+	mutable pthread_rwlock_t lock;
+
+	IrrCache(const IrrCache&);
+	IrrCache &operator =(const IrrCache&);
+
+public:
+	IrrCache();
+	~IrrCache();
+
+	/** removes all records, and sets up the cache for a scene with the
+	 * given bounds. accuracy is the maximum interpolation error allowed
+	 * (Ward's a), smaller values mean more records.
+	 */
+	void clear(const AABox &bounds, double accuracy);
+
+	/** interpolates the irradiance at pos, from the records valid there.
+	 * Returns false if there aren't any, and a new record is needed.
+	 */
+	bool lookup(const Vector3 &pos, const Vector3 &norm, Color *irrad) const;
+
+	/** adds a record, clamping its distance to the spacing limits */
+	void add(const IrrRecord &rec);
+
+	int size() const;
+};
+
+#endif	// IRRCACHE_H_
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "octree.h"	// for AABox
 #include "object.h"
 #include "opt.h"
+#include "rng.h"
 
 enum { POINT_LIGHT, SPHERE_LIGHT, BOX_LIGHT };
 static const char *type_name[] = {
@@ -140,7 +141,7 @@ Photon Light::gen_photon(unsigned int msec, unsigned int sampling) const
 	if(proj) {
 		p.dir = proj->gen_dir(true);
 	} else {
-		p.dir = sphrand(1.0);
+		p.dir = rng_sphrand(1.0);
 	}
 	p.dir *= RAY_MAGNITUDE;
 
@@ -271,7 +272,7 @@ float SphLight::get_radius() const
 
 Vector3 SphLight::get_point(unsigned int msec) const
 {
-	return get_position(msec) + sphrand(radius);
+	return get_position(msec) + rng_sphrand(radius);
 }
 
 
@@ -346,9 +347,9 @@ Vector3 BoxLight::get_dimensions() const
 Vector3 BoxLight::get_point(unsigned int msec) const
 {
 	Vector3 v;
-	v.x = frand(dim.x) - 0.5 * dim.x;
-	v.y = frand(dim.y) - 0.5 * dim.y;
-	v.z = frand(dim.z) - 0.5 * dim.z;
+	v.x = rng_frand(dim.x) - 0.5 * dim.x;
+	v.y = rng_frand(dim.y) - 0.5 * dim.y;
+	v.z = rng_frand(dim.z) - 0.5 * dim.z;
 
 	return v.transformed(get_xform_matrix());
 }
@@ -0,0 +1,199 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mapfile.h"
+
+#if defined(__APPLE__) && defined(__MACH__)
+# ifndef __unix__
+#  define __unix__	1
+# endif
+#endif
+
+#if defined(unix) || defined(__unix__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
+
+void *map_file(const char *fname, size_t *size)
+{
+	void *data;
+
+#ifdef USE_MMAP
+	int fd;
+	struct stat st;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		return 0;
+	}
+	if(fstat(fd, &st) == -1) {
+		close(fd);
+		return 0;
+	}
+	if(st.st_size <= 0) {
+		close(fd);
+		errno = EINVAL;
+		return 0;
+	}
+	*size = st.st_size;
+
+	data = mmap(0, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(data == (void*)MAP_FAILED) {
+		return 0;
+	}
+#else
+	FILE *fp;
+	long fsize;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		return 0;
+	}
+	fseek(fp, 0, SEEK_END);
+	fsize = ftell(fp);
+	rewind(fp);
+
+	if(fsize <= 0) {
+		fclose(fp);
+		errno = EINVAL;
+		return 0;
+	}
+	if(!(data = malloc(fsize))) {
+		fclose(fp);
+		return 0;
+	}
+	*size = fsize;
+
+	if(fread(data, 1, *size, fp) != *size) {
+		fclose(fp);
+		free(data);
+		errno = EIO;
+		return 0;
+	}
+	fclose(fp);
+#endif
+	return data;
+}
+
+void unmap_file(void *data, size_t size)
+{
+	if(!data) return;
+
+#ifdef USE_MMAP
+	munmap(data, size);
+#else
+	free(data);
+#endif
+}
+
+uint64_t align_offs(uint64_t offs, unsigned int align)
+{
+	return (offs + align - 1) & ~(uint64_t)(align - 1);
+}
+
+int valid_file_array(uint64_t offs, uint64_t count, size_t elem_size, unsigned int align,
+		size_t size)
+{
+	/* offs + count * elem_size could wrap around for bogus values */
+	if(offs % align || offs > size) {
+		return 0;
+	}
+	return (size - offs) / elem_size >= count;
+}
+
+int write_file_array(FILE *fp, const void *data, size_t size, uint64_t offs)
+{
+	static const char zeros[64];
+	long pad = (long)offs - ftell(fp);
+
+	while(pad > 0) {
+		size_t sz = pad < (long)sizeof zeros ? (size_t)pad : sizeof zeros;
+		if(fwrite(zeros, 1, sz, fp) != sz) {
+			return -1;
+		}
+		pad -= sz;
+	}
+	if(size && fwrite(data, 1, size, fp) != size) {
+		return -1;
+	}
+	return 0;
+}
+
+FILE *create_tmp_file(const char *fname, char *tmpname, size_t tmpname_size)
+{
+	/* the pid keeps concurrent renders from writing the same temporary file */
+#ifdef USE_MMAP
+	snprintf(tmpname, tmpname_size, "%s.%d", fname, (int)getpid());
+#else
+	snprintf(tmpname, tmpname_size, "%s.tmp", fname);
+#endif
+	return fopen(tmpname, "wb");
+}
+
+int commit_tmp_file(FILE *fp, const char *tmpname, const char *fname, int ok)
+{
+	/* buffered data is written out on close, which may fail too */
+	if(fclose(fp) != 0) {
+		ok = 0;
+	}
+	if(!ok || rename(tmpname, fname) == -1) {
+		remove(tmpname);
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *ptr = data;
+	size_t i;
+
+	for(i=0; i<size; i++) {
+		hash = (hash ^ ptr[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+uint64_t hash_int(uint64_t hash, int x)
+{
+	return hash_bytes(hash, &x, sizeof x);
+}
+
+uint64_t hash_double(uint64_t hash, double x)
+{
+	return hash_bytes(hash, &x, sizeof x);
+}
+
+uint64_t hash_file(uint64_t hash, FILE *fp)
+{
+	char buf[4096];
+	size_t sz;
+
+	rewind(fp);
+	while((sz = fread(buf, 1, sizeof buf, fp)) > 0) {
+		hash = hash_bytes(hash, buf, sz);
+	}
+	return ferror(fp) ? 0 : hash;
+}
@@ -0,0 +1,79 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MAPFILE_H_
+#define MAPFILE_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* helpers shared by the binary files which are mapped in memory and used in
+ * place (mesh files, and the mesh and photon caches): mapping them, laying
+ * out and checking their aligned arrays, writing them out in one piece, and
+ * hashing what the caches depend on.
+ */
+
+/* initial value for hash_bytes and friends (64bit FNV-1a) */
+#define HASH_INIT	0xcbf29ce484222325ULL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** maps a whole file in memory read-only (or reads it where mmap isn't
+ * available), and stores its size in *size. Returns 0 and sets errno on
+ * failure, which includes empty files. Release it with unmap_file.
+ */
+void *map_file(const char *fname, size_t *size);
+void unmap_file(void *data, size_t size);
+
+/** rounds offs up to a multiple of align, which must be a power of two */
+uint64_t align_offs(uint64_t offs, unsigned int align);
+
+/** checks that a file of the given size holds count elements at offs, and
+ * that offs is a multiple of align, without overflowing on bogus offsets.
+ */
+int valid_file_array(uint64_t offs, uint64_t count, size_t elem_size, unsigned int align,
+		size_t size);
+
+/** pads the file with zeros up to offs, then writes the array.
+ * Returns -1 on failure.
+ */
+int write_file_array(FILE *fp, const void *data, size_t size, uint64_t offs);
+
+/** creates a temporary file next to fname, to be renamed to fname by
+ * commit_tmp_file when it's complete, so that nobody ever maps a partially
+ * written file. tmpname must have room for the name of fname plus 16 chars.
+ */
+FILE *create_tmp_file(const char *fname, char *tmpname, size_t tmpname_size);
+/** closes the temporary file, and renames it to fname if ok is non-zero and
+ * closing it succeeded, otherwise removes it. Returns -1 on failure.
+ */
+int commit_tmp_file(FILE *fp, const char *tmpname, const char *fname, int ok);
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+uint64_t hash_int(uint64_t hash, int x);
+uint64_t hash_double(uint64_t hash, double x);
+/** hashes the contents of a file from the start. Returns 0 on read errors */
+uint64_t hash_file(uint64_t hash, FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* MAPFILE_H_ */
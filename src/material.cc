@@ -172,6 +172,16 @@ bool Material::have_attribute(const char *name) const
 	return find_attribute(name) != 0;
 }
 
+int Material::get_attribute_count() const
+{
+	return (int)mattr.size();
+}
+
+const MatAttrib &Material::get_attribute(int idx) const
+{
+	return mattr[idx];
+}
+
 MatAttrib *Material::find_attribute(const char *name)
 {
 	MatAttrib cmpattr(name, 0);
@@ -93,6 +93,9 @@ public:
 
 	bool have_attribute(const char *name) const;
 
+	int get_attribute_count() const;
+	const MatAttrib &get_attribute(int idx) const;
+
 	MatAttrib *find_attribute(const char *name);
 	const MatAttrib *find_attribute(const char *name) const;
 
@@ -20,28 +20,54 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "mesh.h"
 #include "scene.h"
 
-static inline bool check_clock(const Vector3 &v0, const Vector3 &v1,
-		const Vector3 &v2, const Vector3 &normal);
-
-static void interp_face(Vertex *interp, const Triangle &tri, const Vector3 &ispos,
-		const Vector3 &normal);
+static inline bool intersect_tri(const Vector3 &v0, const Vector3 &e1, const Vector3 &e2,
+		const Ray &ray, double *t, double *u, double *v);
+
+/* stores val as element idx of an optional attribute stream, which is kept
+ * empty as long as no element has been given a value.
+ */
+template <typename T>
+static inline void set_attrib(std::vector<T> *stream, int idx, const T *val)
+{
+	if(!val && stream->empty()) {
+		return;
+	}
+	stream->resize(idx + 1);
+	if(val) {
+		(*stream)[idx] = *val;
+	}
+}
 
 
-void Triangle::calc_normal()
+Mesh::Mesh()
 {
-	Vector3 v1 = v[2].pos - v[0].pos;
-	Vector3 v2 = v[1].pos - v[0].pos;
+	valid_octree = false;
+
+	pkt_arr = 0;
+	leaf_pkt_arr = 0;
+	num_packets = 0;
+
+	cache_map = 0;
+	cache_map_size = 0;
 
-	norm = cross_product(v1, v2).normalized();
+	geom_hash = 0;
 }
 
-void Triangle::calc_bounds(AABox *aabb, const Matrix4x4 &xform) const
+Mesh::~Mesh()
+{
+	octree.clear();
+	free_cache();
+}
+
+// ---- triangles ----
+
+void Mesh::calc_face_bounds(int face, AABox *aabb, const Matrix4x4 &xform) const
 {
 	aabb->min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
 	aabb->max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 
 	for(int i=0; i<3; i++) {
-		Vector3 pos = v[i].pos.transformed(xform);
+		Vector3 pos = vpos[faces[face].v[i]].transformed(xform);
 
 		if(pos.x < aabb->min.x) aabb->min.x = pos.x;
 		if(pos.y < aabb->min.y) aabb->min.y = pos.y;
@@ -53,13 +79,13 @@ void Triangle::calc_bounds(AABox *aabb, const Matrix4x4 &xform) const
 	}
 }
 
-bool Triangle::in_box(const AABox *box, const Matrix4x4 &xform) const
+bool Mesh::face_in_box(int face, const AABox *box, const Matrix4x4 &xform) const
 {
 	Vector3 verts[3];
 
 	// first test if any vertex is inside the box
 	for(int i=0; i<3; i++) {
-		verts[i] = v[i].pos.transformed(xform);
+		verts[i] = vpos[faces[face].v[i]].transformed(xform);
 
 		if(box->contains(verts[i])) {
 			return true;
@@ -89,24 +115,28 @@ bool Triangle::in_box(const AABox *box, const Matrix4x4 &xform) const
 		Vector3(box->min.x, box->max.y, box->max.z)
 	};
 
+	Vector3 e1 = verts[1] - verts[0];
+	Vector3 e2 = verts[2] - verts[0];
+	double t, u, v;
+
 	for(int i=0; i<4; i++) {
 		Ray ray;
 
 		ray.origin = boxv[i];
 		ray.dir = boxv[(i + 1) & 3] - ray.origin;
-		if(intersect(ray, 0)) {
+		if(intersect_tri(verts[0], e1, e2, ray, &t, &u, &v)) {
 			return true;
 		}
 
 		ray.origin = boxv[i + 4];
 		ray.origin = boxv[((i + 1) & 3) + 4] - ray.origin;
-		if(intersect(ray, 0)) {
+		if(intersect_tri(verts[0], e1, e2, ray, &t, &u, &v)) {
 			return true;
 		}
 
 		ray.origin = boxv[i];
 		ray.dir = boxv[i + 4] - ray.origin;
-		if(intersect(ray, 0)) {
+		if(intersect_tri(verts[0], e1, e2, ray, &t, &u, &v)) {
 			return true;
 		}
 	}
@@ -114,54 +144,110 @@ bool Triangle::in_box(const AABox *box, const Matrix4x4 &xform) const
 	return false;
 }
 
-bool Triangle::intersect(const Ray &ray, SurfPoint *sp) const
+bool Mesh::intersect_face(int face, const Ray &ray, double *t, double *u, double *v) const
 {
-	Vector3 v1 = v[1].pos - v[0].pos;
-	Vector3 v2 = v[2].pos - v[0].pos;
-	Vector3 normal = cross_product(v1, v2);
+	const Vector3 &v0 = vpos[faces[face].v[0]];
+	const Vector3 &v1 = vpos[faces[face].v[1]];
+	const Vector3 &v2 = vpos[faces[face].v[2]];
 
-	double n_dot_dir;
-	if(fabs(n_dot_dir = dot_product(normal, ray.dir)) < Scene::epsilon) {
-		return false;	// parallel to the plane
+	return intersect_tri(v0, v1 - v0, v2 - v0, ray, t, u, v);
+}
+
+/* fills in the surface properties of a hit at barycentric coordinates (u, v),
+ * by interpolating the vertex attributes of the triangle.
+ */
+void Mesh::calc_surface(SurfPoint *sp, int face, const Ray &ray, double t, double u, double v) const
+{
+	const int *vidx = faces[face].v;
+	double w = 1.0 - u - v;
+
+	sp->dist = t;
+	sp->pos = ray.origin + ray.dir * t;
+
+	if(!vtex.empty()) {
+		sp->texcoord = vtex[vidx[0]] * w + vtex[vidx[1]] * u + vtex[vidx[2]] * v;
+	} else {
+		sp->texcoord = Vector2(0, 0);
 	}
 
-	// vertex-to-origin
-	Vector3 vo_vec = ray.origin - v[0].pos;
+	if(!vtang.empty()) {
+		sp->tangent = vtang[vidx[0]] * w + vtang[vidx[1]] * u + vtang[vidx[2]] * v;
+	} else {
+		sp->tangent = Vector3(0, 0, 0);
+	}
 
-	// calc intersection distance
-	double t = -dot_product(normal, vo_vec) / n_dot_dir;
-	if(t < Scene::epsilon || t > 1.0) {
-		return false;	// plane in the opposite subspace or after the end of the ray
+	Vector3 norm;
+	if(!vnorm.empty()) {
+		norm = vnorm[vidx[0]] * w + vnorm[vidx[1]] * u + vnorm[vidx[2]] * v;
+	}
+	if(norm.length_sq() < XSMALL_NUMBER) {
+		const Vector3 &v0 = vpos[vidx[0]];
+		norm = cross_product(vpos[vidx[1]] - v0, vpos[vidx[2]] - v0);
 	}
+	sp->normal = norm;
+}
 
-	// intersection point
-	Vector3 pos = ray.origin + ray.dir * t;
+/* octree leaf visitors for Mesh::intersect and Mesh::occluded */
+struct LeafQuery {
+	const Ray *ray;
+	const TriPacket *packets;
+	const int *leaf_packets;
+	const Vector3 *vpos;	// for rechecking single precision occluders
+	const Face *faces;
 
-	// check inside/outside
-	for(int i=0; i<3; i++) {
-		if(!check_clock(v[i].pos, v[(i + 1) % 3].pos, pos, normal)) {
-			return false;	// outside of the triangle
-		}
+	int face;
+	double t, u, v;
+};
+
+static bool intersect_leaf(int leaf, double *tmax, void *cls)
+{
+	LeafQuery *q = (LeafQuery*)cls;
+
+	int first = q->leaf_packets[leaf];
+	int count = q->leaf_packets[leaf + 1] - first;
+
+	int face = tri_packet_intersect(q->packets + first, count, *q->ray, tmax, &q->u, &q->v);
+	if(face >= 0) {
+		q->face = face;
+		q->t = *tmax;
 	}
+	return false;
+}
 
-	if(sp) {
-		sp->dist = t;
-		sp->pos = pos;
+static bool occluded_leaf(int leaf, double *tmax, void *cls)
+{
+	LeafQuery *q = (LeafQuery*)cls;
+
+	int first = q->leaf_packets[leaf];
+	int count = q->leaf_packets[leaf + 1] - first;
+
+	if(!tri_packet_occluded(q->packets + first, count, *q->ray)) {
+		return false;
+	}
 
-		Vertex v;
-		interp_face(&v, *this, pos, normal);
+#ifndef GEOM_DOUBLE
+	/* the packets are single precision, so only trust the hit if one of the
+	 * leaf's triangles is hit in double precision too, as in intersect_local.
+	 */
+	for(int i=0; i<count; i++) {
+		const TriPacket *pkt = q->packets + first + i;
 
-		sp->texcoord = v.tex;
+		for(int j=0; j<TRI_PACKET_SIZE; j++) {
+			if(pkt->face[j] < 0) continue;
 
-		if(v.norm.length_sq() < XSMALL_NUMBER) {
-			sp->normal = normal;//.normalized();
-		} else {
-			sp->normal = v.norm;//.normalized();
-		}
+			const int *vidx = q->faces[pkt->face[j]].v;
+			const Vector3 &v0 = q->vpos[vidx[0]];
 
-		sp->tangent = v.tang;
+			double t, u, v;
+			if(intersect_tri(v0, q->vpos[vidx[1]] - v0, q->vpos[vidx[2]] - v0, *q->ray, &t, &u, &v)) {
+				return true;
+			}
+		}
 	}
+	return false;
+#else
 	return true;
+#endif
 }
 
 // ---- mesh ----
@@ -175,7 +261,7 @@ void Mesh::calc_bounds(AABox *box, int msec) const
 
 	for(size_t i=0; i<faces.size(); i++) {
 		AABox fbox;
-		faces[i].calc_bounds(&fbox, xform);
+		calc_face_bounds((int)i, &fbox, xform);
 
 		if(fbox.min.x < box->min.x) box->min.x = fbox.min.x;
 		if(fbox.min.y < box->min.y) box->min.y = fbox.min.y;
@@ -191,18 +277,51 @@ void Mesh::calc_bounds(AABox *box, int msec) const
 // if you're looking for Mesh::load_xml, it's implemented in meshload.cc
 
 
-void Mesh::add_face(const Triangle &face)
+int Mesh::add_vertex(const Vector3 &pos, const Vector3 *norm, const Vector3 *tang, const Vector2 *tex)
 {
+	int idx = (int)vpos.size();
+	vpos.push_back(pos);
+
+	set_attrib(&vnorm, idx, norm);
+	set_attrib(&vtang, idx, tang);
+	set_attrib(&vtex, idx, tex);
+
+	valid_octree = false;
+	return idx;
+}
+
+void Mesh::add_face(int v0, int v1, int v2)
+{
+	Face face;
+	face.v[0] = v0;
+	face.v[1] = v1;
+	face.v[2] = v2;
 	faces.push_back(face);
+
 	valid_octree = false;
 }
 
+int Mesh::get_vertex_count() const
+{
+	return (int)vpos.size();
+}
+
+Vertex Mesh::get_vertex(int n) const
+{
+	Vertex v;
+	v.pos = vpos[n];
+	if(n < (int)vnorm.size()) v.norm = vnorm[n];
+	if(n < (int)vtang.size()) v.tang = vtang[n];
+	if(n < (int)vtex.size()) v.tex = vtex[n];
+	return v;
+}
+
 int Mesh::get_face_count() const
 {
 	return (int)faces.size();
 }
 
-const Triangle *Mesh::get_face(int n) const
+const Face *Mesh::get_face(int n) const
 {
 	return &faces[n];
 }
@@ -210,6 +329,24 @@ const Triangle *Mesh::get_face(int n) const
 void Mesh::build_tree(void)
 {
 	octree.clear();
+	free_cache();
+
+	packets.clear();
+	leaf_packets.clear();
+	pkt_arr = 0;
+	leaf_pkt_arr = 0;
+	num_packets = 0;
+
+	// the geometry may have changed since the last build
+	geom_hash = 0;
+
+	if(opt.meshcache) {
+		calc_geom_hash();
+		if(load_cache(opt.meshcache)) {
+			valid_octree = true;
+			return;
+		}
+	}
 
 	octree.set_max_depth(opt.meshoct_max_depth);
 	octree.set_max_items_per_node(opt.meshoct_max_items);
@@ -218,21 +355,65 @@ void Mesh::build_tree(void)
 
 	for(size_t i=0; i<faces.size(); i++) {
 		AABox box;
-		faces[i].calc_bounds(&box, idmat);
+		calc_face_bounds((int)i, &box, idmat);
 
-		octree.add(box, &faces[i]);
+		octree.add(box, (int)i);
 	}
 
 	octree.build();
+
+	// pack the triangles of each leaf
+	int num_nodes = octree.get_node_count();
+
+	leaf_packets.resize(num_nodes + 1);
+
+	for(int i=0; i<num_nodes; i++) {
+		const OctFlatNode *node = octree.get_node(i);
+		leaf_packets[i] = (int)packets.size();
+
+		if(node->child) continue;
+
+		for(int j=0; j<node->num_items; j++) {
+			int slot = j % TRI_PACKET_SIZE;
+			if(!slot) {
+				packets.push_back(TriPacket());
+			}
+
+			int face = octree.get_leaf_item(i, j)->data;
+			const int *vidx = faces[face].v;
+			packets.back().set(slot, face, vpos[vidx[0]], vpos[vidx[1]], vpos[vidx[2]]);
+		}
+	}
+	leaf_packets[num_nodes] = (int)packets.size();
+
+	pkt_arr = packets.empty() ? 0 : &packets[0];
+	leaf_pkt_arr = &leaf_packets[0];
+	num_packets = (int)packets.size();
+
 	valid_octree = true;
+
+	if(opt.meshcache) {
+		save_cache(opt.meshcache);
+	}
 }
 
-Octree<Triangle*> *Mesh::get_tree()
+uint64_t Mesh::get_geometry_hash() const
+{
+	if(!valid_octree) {
+		((Mesh*)this)->build_tree();
+	}
+	if(!geom_hash) {
+		((Mesh*)this)->calc_geom_hash();
+	}
+	return geom_hash;
+}
+
+Octree<int> *Mesh::get_tree()
 {
 	return &octree;
 }
 
-const Octree<Triangle*> *Mesh::get_tree() const
+const Octree<int> *Mesh::get_tree() const
 {
 	return &octree;
 }
@@ -242,7 +423,7 @@ bool Mesh::in_box(const AABox *box, int msec) const
 	Matrix4x4 xform = get_xform_matrix(msec);
 
 	for(size_t i=0; i<faces.size(); i++) {
-		if(faces[i].in_box(box, xform)) {
+		if(face_in_box((int)i, box, xform)) {
 			return true;
 		}
 	}
@@ -251,48 +432,15 @@ bool Mesh::in_box(const AABox *box, int msec) const
 
 bool Mesh::intersect(const Ray &wray, SurfPoint *sp) const
 {
-	SurfPoint sp0;
-	sp0.dist = DBL_MAX;
-	const Triangle *face0 = 0;
-
-	if(!valid_octree) {
-		((Mesh*)this)->build_tree();
-	}
-
 	// transform ray to local coordinates
 	Matrix4x4 inv_mat = get_inv_xform_matrix(wray.time);
 	Ray ray = wray.transformed(inv_mat);
 
-	if(valid_octree) {
-		OctItem<Triangle*> *item = octree.intersect(ray, &sp0);
-		if(item) {
-			face0 = item->data;
-		}
-	} else {
-		static bool warned = false;
-		if(!warned) {
-			printf("warning: tracing rays through a mesh without an octree (slow)\n");
-			warned = true;
-		}
-
-		for(size_t i=0; i<faces.size(); i++) {
-			SurfPoint sp;
-			if(faces[i].intersect(ray, &sp)) {
-				if(sp.dist < sp0.dist) {
-					sp0 = sp;
-					face0 = &faces[i];
-				}
-			}
-		}
-	}
-
-	if(!face0) {
+	if(!intersect_local(ray, sp)) {
 		return false;
 	}
 
 	if(sp) {
-		*sp = sp0;
-
 		Matrix4x4 xform = get_xform_matrix(ray.time);
 		Matrix4x4 inv_trans = inv_mat.transposed();
 
@@ -307,139 +455,140 @@ bool Mesh::intersect(const Ray &wray, SurfPoint *sp) const
 	return true;
 }
 
-static inline bool check_clock(const Vector3 &v0, const Vector3 &v1,
-		const Vector3 &v2, const Vector3 &normal)
+bool Mesh::occluded(const Ray &wray) const
 {
-	Vector3 test = cross_product(v1 - v0, v2 - v0);
-	return dot_product(test, normal) >= 0.0;
+	// transform ray to local coordinates
+	return occluded_local(wray.transformed(get_inv_xform_matrix(wray.time)));
 }
 
-#define LERP(a, b, t)	((a) + ((b) - (a)) * (t))
-
-/* see Glassner; ch: 2; section: 3.3 (Eric Haines) */
-/* TODO: readify this write-only piece of shit */
-static void interp_face(Vertex *interp, const Triangle &tri, const Vector3 &ispos,
-		const Vector3 &normal)
+bool Mesh::intersect_local(const Ray &ray, SurfPoint *sp) const
 {
-	Vector2 res;
-	Vector3 p00, p01, p11, p10, na, nb, nc, pa, pb, pc, pd;
-	double du0, du1, du2, dv0, dv1, dv2;
-
-	double s00, s10, s01, s11, s0, s1;
-	double t00, t10, t01, t11, t0, t1;
-	double nx00, nx10, nx01, nx11, nx0, nx1;
-	double ny00, ny10, ny01, ny11, ny0, ny1;
-	double nz00, nz10, nz01, nz11, nz0, nz1;
-	double gx00, gx10, gx01, gx11, gx0, gx1;
-	double gy00, gy10, gy01, gy11, gy0, gy1;
-	double gz00, gz10, gz01, gz11, gz0, gz1;
-
-	p00 = tri.v[0].pos;
-	p10 = tri.v[1].pos;
-	p01 = p11 = tri.v[2].pos;
-
-	s00 = tri.v[0].tex.x; t00 = tri.v[0].tex.y;
-	s10 = tri.v[1].tex.x; t10 = tri.v[1].tex.y;
-	s01 = s11 = tri.v[2].tex.x; t01 = t11 = tri.v[2].tex.y;
-
-	nx00 = tri.v[0].norm.x; ny00 = tri.v[0].norm.y; nz00 = tri.v[0].norm.z;
-	nx10 = tri.v[1].norm.x; ny10 = tri.v[1].norm.y; nz10 = tri.v[1].norm.z;
-	nx01 = nx11 = tri.v[2].norm.x; ny01 = ny11 = tri.v[2].norm.y; nz01 = nz11 = tri.v[2].norm.z;
-	
-	gx00 = tri.v[0].tang.x; gy00 = tri.v[0].tang.y; gz00 = tri.v[0].tang.z;
-	gx10 = tri.v[1].tang.x; gy10 = tri.v[1].tang.y; gz10 = tri.v[1].tang.z;
-	gx01 = gx11 = tri.v[2].tang.x; gy01 = gy11 = tri.v[2].tang.y; gz01 = gz11 = tri.v[2].tang.z;
-
-	pa = (p00 - p10) + (p11 - p01);
-	pb = p10 - p00;
-	pc = p01 - p00;
-	pd = p00;
-
-	na = cross_product(pa, normal);
-	nb = cross_product(pb, normal);
-	nc = cross_product(pc, normal);
-
-	du0 = dot_product(nc, pd);
-	du1 = dot_product(na, pd) + dot_product(nc, pb);
-	du2 = dot_product(na, pb);
-
-	dv0 = dot_product(nb, pd);
-	dv1 = dot_product(na, pd) + dot_product(nb, pc);
-	dv2 = dot_product(na, pc);
-
-	if(fabs(du2) <= XSMALL_NUMBER) {
-		double divisor = du1 - dot_product(na, ispos);
-		res.x = fabs(divisor) > XSMALL_NUMBER ? ((dot_product(nc, ispos) - du0) / divisor) : 0.0;
-	} else {
-		Vector3 qux, quy;
-		double dux, duy, ka, kb, u0, u1;
-		
-		qux = na / (2.0 * du2);
-		quy = -nc / du2;
+	int face0 = -1;
+	double t0 = DBL_MAX, u0 = 0.0, v0 = 0.0;
 
-		dux = -du1 / (2.0 * du2);
-		duy = du0 / du2;
+	if(!valid_octree) {
+		((Mesh*)this)->build_tree();
+	}
 
-		ka = dux + dot_product(qux, ispos);
-		kb = duy + dot_product(quy, ispos);
+	if(valid_octree) {
+		if(!num_packets) {
+			return false;
+		}
 
-		u0 = ka - sqrt(ka * ka - kb);
-		u1 = ka + sqrt(ka * ka - kb);
+		LeafQuery q;
+		q.ray = &ray;
+		q.packets = pkt_arr;
+		q.leaf_packets = leaf_pkt_arr;
+		q.face = -1;
+
+		octree.visit_leaves(ray, intersect_leaf, &q);
+
+		if(q.face >= 0) {
+			face0 = q.face;
+			t0 = q.t;
+			u0 = q.u;
+			v0 = q.v;
+
+#ifndef GEOM_DOUBLE
+			/* the packets are single precision, recompute the hit in double
+			 * precision, unless it's so close to an edge that it now misses.
+			 */
+			double t, u, v;
+			if(intersect_face(face0, ray, &t, &u, &v)) {
+				t0 = t;
+				u0 = u;
+				v0 = v;
+			}
+#endif
+		}
+	} else {
+		static bool warned = false;
+		if(!warned) {
+			printf("warning: tracing rays through a mesh without an octree (slow)\n");
+			warned = true;
+		}
 
-		res.x = (u0 < 0.0 || u0 > 1.0) ? u1 : u0;
+		for(size_t i=0; i<faces.size(); i++) {
+			double t, u, v;
+			if(intersect_face((int)i, ray, &t, &u, &v) && t < t0) {
+				face0 = (int)i;
+				t0 = t;
+				u0 = u;
+				v0 = v;
+			}
+		}
 	}
 
-	if(fabs(dv2) <= XSMALL_NUMBER) {
-		double divisor = dv1 - dot_product(na, ispos);
-		res.y = fabs(divisor) > XSMALL_NUMBER ? ((dot_product(nb, ispos) - dv0) / divisor) : 0.0;
-	} else {
-		Vector3 qvx, qvy;
-		double dvx, dvy, ka, kb, v0, v1;
+	if(face0 == -1) {
+		return false;
+	}
 
-		qvx = na / (2.0 * dv2);
-		qvy = -nb / dv2;
+	if(sp) {
+		// only now that we have the closest hit, fetch its vertex attributes
+		calc_surface(sp, face0, ray, t0, u0, v0);
+	}
+	return true;
+}
 
-		dvx = -dv1 / (2.0 * dv2);
-		dvy = dv0 / dv2;
+bool Mesh::occluded_local(const Ray &ray) const
+{
+	if(!valid_octree) {
+		((Mesh*)this)->build_tree();
+	}
 
-		ka = dvx + dot_product(qvx, ispos);
-		kb = dvy + dot_product(qvy, ispos);
+	if(valid_octree) {
+		if(!num_packets) {
+			return false;
+		}
 
-		v0 = ka - sqrt(ka * ka - kb);
-		v1 = ka + sqrt(ka * ka - kb);
+		LeafQuery q;
+		q.ray = &ray;
+		q.packets = pkt_arr;
+		q.leaf_packets = leaf_pkt_arr;
+		q.vpos = &vpos[0];
+		q.faces = &faces[0];
 
-		res.y = (v0 < 0.0 || v0 > 1.0) ? v1 : v0;
+		return octree.visit_leaves(ray, occluded_leaf, &q);
 	}
 
-	s0 = LERP(s00, s01, res.y);
-	s1 = LERP(s10, s11, res.y);
-	interp->tex.x = LERP(s0, s1, res.x);
-
-	t0 = LERP(t00, t01, res.y);
-	t1 = LERP(t10, t11, res.y);
-	interp->tex.y = LERP(t0, t1, res.x);
-
-	nx0 = LERP(nx00, nx01, res.y);
-	nx1 = LERP(nx10, nx11, res.y);
-	interp->norm.x = LERP(nx0, nx1, res.x);
+	for(size_t i=0; i<faces.size(); i++) {
+		double t, u, v;
+		if(intersect_face((int)i, ray, &t, &u, &v)) {
+			return true;
+		}
+	}
+	return false;
+}
 
-	ny0 = LERP(ny00, ny01, res.y);
-	ny1 = LERP(ny10, ny11, res.y);
-	interp->norm.y = LERP(ny0, ny1, res.x);
+/* Moller-Trumbore ray-triangle intersection. u and v are the barycentric
+ * coordinates of the hit with respect to the 2nd and 3rd vertex.
+ */
+static inline bool intersect_tri(const Vector3 &v0, const Vector3 &e1, const Vector3 &e2,
+		const Ray &ray, double *t, double *u, double *v)
+{
+	Vector3 pvec = cross_product(ray.dir, e2);
 
-	nz0 = LERP(nz00, nz01, res.y);
-	nz1 = LERP(nz10, nz11, res.y);
-	interp->norm.z = LERP(nz0, nz1, res.x);
+	double det = dot_product(e1, pvec);
+	if(fabs(det) < Scene::epsilon) {
+		return false;	// parallel to the plane
+	}
+	double inv_det = 1.0 / det;
 
-	gx0 = LERP(gx00, gx01, res.y);
-	gx1 = LERP(gx10, gx11, res.y);
-	interp->tang.x = LERP(gx0, gx1, res.x);
+	Vector3 tvec = ray.origin - v0;
+	*u = dot_product(tvec, pvec) * inv_det;
+	if(*u < 0.0 || *u > 1.0) {
+		return false;
+	}
 
-	gy0 = LERP(gy00, gy01, res.y);
-	gy1 = LERP(gy10, gy11, res.y);
-	interp->tang.y = LERP(gy0, gy1, res.x);
+	Vector3 qvec = cross_product(tvec, e1);
+	*v = dot_product(ray.dir, qvec) * inv_det;
+	if(*v < 0.0 || *u + *v > 1.0) {
+		return false;
+	}
 
-	gz0 = LERP(gz00, gz01, res.y);
-	gz1 = LERP(gz10, gz11, res.y);
-	interp->tang.z = LERP(gz0, gz1, res.x);
+	*t = dot_product(e2, qvec) * inv_det;
+	if(*t < Scene::epsilon || *t > 1.0) {
+		return false;	// behind the origin or after the end of the ray
+	}
+	return true;
 }
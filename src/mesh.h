@@ -19,51 +19,127 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MESH_H_
 
 #include <vector>
+#include <stdint.h>
 #include "object.h"
 #include "octree.h"
+#include "tripacket.h"
+
+struct MeshData;
 
 struct Vertex {
 	Vector3 pos, norm, tang;
 	Vector2 tex;
 };
 
-class Triangle {
-public:
-	Vertex v[3];
-	Vector3 norm;
-
-	void calc_normal();
-
-	void calc_bounds(AABox *aabb, const Matrix4x4 &xform) const;
-	bool in_box(const AABox *box, const Matrix4x4 &xform) const;
-
-	bool intersect(const Ray &ray, SurfPoint *sp) const;
+/** A mesh triangle, as indices into the vertex arrays of its mesh */
+struct Face {
+	int v[3];
 };
 
 /** Triangle mesh class */
 class Mesh : public Object {
 private:
-	std::vector<Triangle> faces;
-	Octree<Triangle*> octree;
+	/* vertex attribute streams, indexed by the vertex indices of the faces.
+	 * Only positions are needed for intersection tests, the rest are fetched
+	 * after a hit. Attributes missing from the mesh have empty streams.
+	 */
+	std::vector<Vector3> vpos, vnorm, vtang;
+	std::vector<Vector2> vtex;
+
+	std::vector<Face> faces;
+	Octree<int> octree;
 	bool valid_octree;
 
+	/* the triangles of each octree leaf, packed for SIMD intersection tests.
+	 * the packets of node n are [leaf_packets[n], leaf_packets[n + 1]).
+	 */
+	std::vector<TriPacket> packets;
+	std::vector<int> leaf_packets;
+
+	/* the packet arrays used for intersection: either the vectors above, or
+	 * the ones in a mesh cache file mapped at cache_map (see meshcache.cc).
+	 */
+	const TriPacket *pkt_arr;
+	const int *leaf_pkt_arr;
+	int num_packets;
+
+	void *cache_map;
+	size_t cache_map_size;
+
+	// hash of the vertex attributes and faces, computed when first needed
+	uint64_t geom_hash;
+	void calc_geom_hash();
+
 	virtual void calc_bounds(AABox *box, int msec) const;
 
+	void calc_face_bounds(int face, AABox *box, const Matrix4x4 &xform) const;
+	bool face_in_box(int face, const AABox *box, const Matrix4x4 &xform) const;
+	bool intersect_face(int face, const Ray &ray, double *t, double *u, double *v) const;
+	void calc_surface(SurfPoint *sp, int face, const Ray &ray, double t, double u, double v) const;
+
+	bool load_mesh_data(MeshData *md);
+
+	bool load_cache(const char *dir);
+	bool save_cache(const char *dir) const;
+	void free_cache();
+
 public:
+	Mesh();
+	virtual ~Mesh();
+
 	virtual bool load_xml(struct xml_node *node);
 
-	void add_face(const Triangle &face);
+	/** loads the geometry from a <mesh> element, either inside a mesh object,
+	 * or in the mesh library of the scene.
+	 */
+	bool load_mesh_xml(struct xml_node *node);
+	/** loads the geometry from a binary mesh file (see meshfile.h). The
+	 * <mesh> element does this instead, when it has a file attribute.
+	 */
+	bool load_mesh_file(const char *fname);
+
+	/** adds a vertex and returns its index. Any attributes not given are
+	 * left zero, and not stored at all if no vertex of the mesh has them.
+	 */
+	int add_vertex(const Vector3 &pos, const Vector3 *norm = 0, const Vector3 *tang = 0,
+			const Vector2 *tex = 0);
+	void add_face(int v0, int v1, int v2);
+
+	int get_vertex_count() const;
+	Vertex get_vertex(int n) const;
 
 	int get_face_count() const;
-	const Triangle *get_face(int n) const;
+	const Face *get_face(int n) const;
 
+	/** builds the octree and triangle packets of the mesh, or maps them from
+	 * the mesh cache directory if one is set (opt.meshcache), and it holds
+	 * a tree built from the same geometry and parameters.
+	 */
 	void build_tree(void);
-	Octree<Triangle*> *get_tree();
-	const Octree<Triangle*> *get_tree() const;
+	/** returns a hash of the vertex attributes and faces of the mesh, which
+	 * changes whenever its geometry does.
+	 */
+	uint64_t get_geometry_hash() const;
+	Octree<int> *get_tree();
+	const Octree<int> *get_tree() const;
 
 	virtual bool in_box(const AABox *box, int msec) const;
 
 	virtual bool intersect(const Ray &ray, SurfPoint *sp) const;
+	virtual bool occluded(const Ray &ray) const;
+
+	/* same as above, but with the ray in the local coordinate system of the
+	 * mesh, ignoring its transformation. Used by MeshInstance, which applies
+	 * its own transformation instead.
+	 */
+	bool intersect_local(const Ray &ray, SurfPoint *sp) const;
+	bool occluded_local(const Ray &ray) const;
 };
 
+/** streams the contents of <mesh> elements while the scene is parsed, which
+ * load_mesh_xml then turns into the mesh, without them ever being added to
+ * the xml tree.
+ */
+extern struct xml_stream_handler mesh_stream_handler;
+
 #endif	// MESH_H_
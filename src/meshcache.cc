@@ -0,0 +1,269 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* mesh octree cache: the octree nodes and triangle packets built for a mesh
+ * are written to a file named after a hash of everything they depend on, and
+ * later runs map that file and use the arrays in it directly, instead of
+ * building them again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "mesh.h"
+#include "opt.h"
+#include "mapfile.h"
+
+#define MCACHE_MAGIC	"SRAYMSH"
+#define MCACHE_VERSION	1
+/* the arrays in the file start at multiples of this */
+#define MCACHE_ALIGN	64
+
+struct MeshCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t geom_size;
+	uint64_t hash;
+
+	int32_t num_faces;
+	int32_t num_nodes;
+	int32_t num_packets;
+	int32_t padding;
+
+	double bounds[6];
+
+	/* file offsets of the node, leaf packet index, and packet arrays */
+	uint64_t node_offs, leaf_offs, pkt_offs;
+	uint64_t size;
+};
+
+template <typename T>
+static uint64_t hash_array(uint64_t hash, const std::vector<T> &arr)
+{
+	hash = hash_int(hash, (int)arr.size());
+	if(!arr.empty()) {
+		hash = hash_bytes(hash, &arr[0], arr.size() * sizeof arr[0]);
+	}
+	return hash;
+}
+
+void Mesh::calc_geom_hash()
+{
+	uint64_t hash = HASH_INIT;
+
+	hash = hash_array(hash, vpos);
+	hash = hash_array(hash, vnorm);
+	hash = hash_array(hash, vtang);
+	hash = hash_array(hash, vtex);
+	geom_hash = hash_array(hash, faces);
+}
+
+/* hashes the geometry of the mesh, along with the tree parameters and the
+ * layout of the cached structures, so that any change to either results in
+ * a different cache file.
+ */
+static uint64_t cache_hash(uint64_t geom_hash)
+{
+	uint64_t hash = HASH_INIT;
+
+	hash = hash_int(hash, MCACHE_VERSION);
+	hash = hash_int(hash, (int)sizeof(geom_t));
+	hash = hash_int(hash, (int)sizeof(OctFlatNode));
+	hash = hash_int(hash, (int)sizeof(TriPacket));
+	hash = hash_int(hash, TRI_PACKET_SIZE);
+	hash = hash_int(hash, opt.meshoct_max_depth);
+	hash = hash_int(hash, opt.meshoct_max_items);
+
+	return hash_bytes(hash, &geom_hash, sizeof geom_hash);
+}
+
+static void cache_path(char *buf, size_t sz, const char *dir, uint64_t hash)
+{
+	snprintf(buf, sz, "%s/%016llx.mcache", dir, (unsigned long long)hash);
+}
+
+static bool valid_header(const MeshCacheHeader *hdr, uint64_t hash, int num_faces, size_t size)
+{
+	if(size < sizeof *hdr || memcmp(hdr->magic, MCACHE_MAGIC, 8) != 0) {
+		return false;
+	}
+	if(hdr->version != MCACHE_VERSION || hdr->geom_size != sizeof(geom_t)) {
+		return false;
+	}
+	if(hdr->hash != hash || hdr->num_faces != num_faces || hdr->size != size) {
+		return false;
+	}
+	if(hdr->num_nodes <= 0 || hdr->num_packets < 0) {
+		return false;
+	}
+
+	if(!valid_file_array(hdr->node_offs, hdr->num_nodes, sizeof(OctFlatNode), MCACHE_ALIGN, size)) {
+		return false;
+	}
+	if(!valid_file_array(hdr->leaf_offs, hdr->num_nodes + 1, sizeof(int), MCACHE_ALIGN, size)) {
+		return false;
+	}
+	if(!valid_file_array(hdr->pkt_offs, hdr->num_packets, sizeof(TriPacket), MCACHE_ALIGN, size)) {
+		return false;
+	}
+	return true;
+}
+
+/* checks every index stored in the arrays, so that a corrupt file can't make
+ * the traversal read outside of them, or loop forever.
+ */
+static bool valid_indices(const MeshCacheHeader *hdr, const char *base)
+{
+	const OctFlatNode *nodes = (const OctFlatNode*)(base + hdr->node_offs);
+	const int *leaf_pkt = (const int*)(base + hdr->leaf_offs);
+	const TriPacket *pkt = (const TriPacket*)(base + hdr->pkt_offs);
+	int num_nodes = hdr->num_nodes;
+
+	// children always come after their parent, which also rules out cycles
+	for(int i=0; i<num_nodes; i++) {
+		int child = nodes[i].child;
+		if(child && (child <= i || child > num_nodes - 8)) {
+			return false;
+		}
+	}
+
+	// the packet ranges of the nodes must be in order, and cover all packets
+	if(leaf_pkt[0] != 0 || leaf_pkt[num_nodes] != hdr->num_packets) {
+		return false;
+	}
+	for(int i=0; i<num_nodes; i++) {
+		if(leaf_pkt[i + 1] < leaf_pkt[i]) {
+			return false;
+		}
+	}
+
+	for(int i=0; i<hdr->num_packets; i++) {
+		for(int j=0; j<TRI_PACKET_SIZE; j++) {
+			int face = pkt[i].face[j];
+			if(face < -1 || face >= hdr->num_faces) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool Mesh::load_cache(const char *dir)
+{
+	uint64_t hash = cache_hash(geom_hash);
+
+	char fname[1024];
+	cache_path(fname, sizeof fname, dir, hash);
+
+	void *data;
+	size_t size;
+
+	if(!(data = map_file(fname, &size))) {
+		if(errno != ENOENT) {
+			fprintf(stderr, "failed to map mesh cache file %s: %s\n", fname, strerror(errno));
+		}
+		return false;
+	}
+
+	cache_map = data;
+	cache_map_size = size;
+
+	const MeshCacheHeader *hdr = (const MeshCacheHeader*)data;
+	const char *base = (const char*)data;
+
+	if(!valid_header(hdr, hash, (int)faces.size(), size) || !valid_indices(hdr, base)) {
+		fprintf(stderr, "ignoring invalid mesh cache file: %s\n", fname);
+		free_cache();
+		return false;
+	}
+
+	AABox bounds;
+	bounds.min = Vector3(hdr->bounds[0], hdr->bounds[1], hdr->bounds[2]);
+	bounds.max = Vector3(hdr->bounds[3], hdr->bounds[4], hdr->bounds[5]);
+
+	octree.set_nodes(bounds, (const OctFlatNode*)(base + hdr->node_offs), hdr->num_nodes);
+
+	leaf_pkt_arr = (const int*)(base + hdr->leaf_offs);
+	pkt_arr = (const TriPacket*)(base + hdr->pkt_offs);
+	num_packets = hdr->num_packets;
+
+	if(VERBOSE) {
+		printf("loaded mesh octree of %s from cache: %s\n", get_name(), fname);
+	}
+	return true;
+}
+
+bool Mesh::save_cache(const char *dir) const
+{
+	uint64_t hash = cache_hash(geom_hash);
+	int num_nodes = octree.get_node_count();
+
+	MeshCacheHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, MCACHE_MAGIC, 8);
+	hdr.version = MCACHE_VERSION;
+	hdr.geom_size = sizeof(geom_t);
+	hdr.hash = hash;
+	hdr.num_faces = (int32_t)faces.size();
+	hdr.num_nodes = num_nodes;
+	hdr.num_packets = num_packets;
+
+	const AABox &bounds = octree.get_bounds();
+	hdr.bounds[0] = bounds.min.x;
+	hdr.bounds[1] = bounds.min.y;
+	hdr.bounds[2] = bounds.min.z;
+	hdr.bounds[3] = bounds.max.x;
+	hdr.bounds[4] = bounds.max.y;
+	hdr.bounds[5] = bounds.max.z;
+
+	hdr.node_offs = align_offs(sizeof hdr, MCACHE_ALIGN);
+	hdr.leaf_offs = align_offs(hdr.node_offs + num_nodes * sizeof(OctFlatNode), MCACHE_ALIGN);
+	hdr.pkt_offs = align_offs(hdr.leaf_offs + (num_nodes + 1) * sizeof(int), MCACHE_ALIGN);
+	hdr.size = hdr.pkt_offs + num_packets * sizeof(TriPacket);
+
+	char fname[1024], tmpname[1040];
+	cache_path(fname, sizeof fname, dir, hash);
+
+	FILE *fp;
+	if(!(fp = create_tmp_file(fname, tmpname, sizeof tmpname))) {
+		fprintf(stderr, "failed to create mesh cache file: %s\n", tmpname);
+		return false;
+	}
+
+	bool res = fwrite(&hdr, sizeof hdr, 1, fp) == 1 &&
+		write_file_array(fp, octree.get_node(0), num_nodes * sizeof(OctFlatNode), hdr.node_offs) != -1 &&
+		write_file_array(fp, leaf_pkt_arr, (num_nodes + 1) * sizeof(int), hdr.leaf_offs) != -1 &&
+		write_file_array(fp, pkt_arr, num_packets * sizeof(TriPacket), hdr.pkt_offs) != -1;
+
+	if(commit_tmp_file(fp, tmpname, fname, res) == -1) {
+		fprintf(stderr, "failed to write mesh cache file: %s\n", fname);
+		return false;
+	}
+
+	if(VERBOSE) {
+		printf("saved mesh octree of %s to cache: %s\n", get_name(), fname);
+	}
+	return true;
+}
+
+void Mesh::free_cache()
+{
+	unmap_file(cache_map, cache_map_size);
+	cache_map = 0;
+	cache_map_size = 0;
+}
@@ -0,0 +1,155 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "meshfile.h"
+#include "mapfile.h"
+
+/* arrays are aligned to this in the file */
+#define ALIGN	16
+
+static int check_array(const struct mesh_file_header *hdr, uint64_t offs, uint64_t count,
+		size_t elem_size);
+
+const struct mesh_file_header *map_mesh_file(const char *fname)
+{
+	void *data;
+	size_t size;
+	const struct mesh_file_header *hdr;
+	const uint32_t *faces;
+	uint32_t i, nverts;
+	int valid;
+
+	if(!(data = map_file(fname, &size))) {
+		perror(fname);
+		return 0;
+	}
+	if(size < sizeof *hdr) {
+		fprintf(stderr, "invalid mesh file: %s\n", fname);
+		unmap_file(data, size);
+		return 0;
+	}
+	hdr = data;
+
+	valid = memcmp(hdr->magic, MESH_FILE_MAGIC, 8) == 0 && hdr->version == MESH_FILE_VERSION &&
+		hdr->byte_order == MESH_FILE_BYTE_ORDER && hdr->size == size &&
+		check_array(hdr, hdr->pos_offs, hdr->num_verts, 3 * sizeof(float)) &&
+		check_array(hdr, hdr->norm_offs, hdr->num_verts, 3 * sizeof(float)) &&
+		check_array(hdr, hdr->tang_offs, hdr->num_verts, 3 * sizeof(float)) &&
+		check_array(hdr, hdr->tex_offs, hdr->num_verts, 2 * sizeof(float)) &&
+		check_array(hdr, hdr->face_offs, hdr->num_faces, 3 * sizeof(uint32_t)) &&
+		(hdr->pos_offs || !hdr->num_verts) && (hdr->face_offs || !hdr->num_faces);
+
+	if(valid) {
+		faces = MESH_FILE_ARRAY(hdr, uint32_t, hdr->face_offs);
+		nverts = hdr->num_verts;
+
+		for(i=0; i<3 * hdr->num_faces; i++) {
+			if(faces[i] >= nverts) {
+				valid = 0;
+				break;
+			}
+		}
+	}
+
+	if(!valid) {
+		fprintf(stderr, "invalid mesh file: %s\n", fname);
+		unmap_file(data, size);
+		return 0;
+	}
+	return hdr;
+}
+
+void unmap_mesh_file(const struct mesh_file_header *hdr)
+{
+	if(hdr) {
+		unmap_file((void*)hdr, hdr->size);
+	}
+}
+
+int write_mesh_file(const char *fname, int num_verts, const float *pos, const float *norm,
+		const float *tang, const float *tex, int num_faces, const uint32_t *faces)
+{
+	FILE *fp;
+	struct mesh_file_header hdr;
+	uint64_t offs;
+	size_t vec3_size = 3 * sizeof(float) * num_verts;
+	size_t vec2_size = 2 * sizeof(float) * num_verts;
+	size_t face_size = 3 * sizeof(uint32_t) * num_faces;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, MESH_FILE_MAGIC, 8);
+	hdr.version = MESH_FILE_VERSION;
+	hdr.byte_order = MESH_FILE_BYTE_ORDER;
+	hdr.num_verts = num_verts;
+	hdr.num_faces = num_faces;
+
+	offs = align_offs(sizeof hdr, ALIGN);
+	hdr.pos_offs = offs;
+	offs = align_offs(offs + vec3_size, ALIGN);
+	if(norm) {
+		hdr.norm_offs = offs;
+		offs = align_offs(offs + vec3_size, ALIGN);
+	}
+	if(tang) {
+		hdr.tang_offs = offs;
+		offs = align_offs(offs + vec3_size, ALIGN);
+	}
+	if(tex) {
+		hdr.tex_offs = offs;
+		offs = align_offs(offs + vec2_size, ALIGN);
+	}
+	hdr.face_offs = offs;
+	hdr.size = offs + face_size;
+
+	if(!(fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to create mesh file %s: ", fname);
+		perror(0);
+		return -1;
+	}
+
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+			write_file_array(fp, pos, vec3_size, hdr.pos_offs) == -1 ||
+			(norm && write_file_array(fp, norm, vec3_size, hdr.norm_offs) == -1) ||
+			(tang && write_file_array(fp, tang, vec3_size, hdr.tang_offs) == -1) ||
+			(tex && write_file_array(fp, tex, vec2_size, hdr.tex_offs) == -1) ||
+			write_file_array(fp, faces, face_size, hdr.face_offs) == -1) {
+		fclose(fp);
+		goto err;
+	}
+	/* buffered data is written out on close, which may fail too */
+	if(fclose(fp) != 0) {
+		goto err;
+	}
+	return 0;
+
+err:
+	fprintf(stderr, "failed to write mesh file: %s\n", fname);
+	remove(fname);
+	return -1;
+}
+
+static int check_array(const struct mesh_file_header *hdr, uint64_t offs, uint64_t count,
+		size_t elem_size)
+{
+	if(!offs) {
+		return 1;	/* missing arrays are fine */
+	}
+	return offs >= sizeof *hdr && valid_file_array(offs, count, elem_size, ALIGN, hdr->size);
+}
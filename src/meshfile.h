@@ -0,0 +1,74 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MESHFILE_H_
+#define MESHFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* binary mesh files hold the geometry of a single mesh as flat arrays, which
+ * can be mapped and copied into a Mesh without any parsing. They're referenced
+ * from the scene with <mesh file="foo.smesh"/>, and written by the converters.
+ *
+ * All values are in the byte order of the machine that wrote the file (the
+ * byte_order field detects a mismatch). Vertex attributes are 32bit floats,
+ * 3 per position, normal and tangent, 2 per texture coordinate, and every
+ * face is 3 32bit vertex indices. Missing attribute arrays have offset 0.
+ */
+#define MESH_FILE_MAGIC		"SRAYMESH"
+#define MESH_FILE_VERSION	1
+#define MESH_FILE_BYTE_ORDER	0x01020304
+
+struct mesh_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+
+	uint32_t num_verts, num_faces;
+
+	/* file offsets of the attribute and face arrays */
+	uint64_t pos_offs, norm_offs, tang_offs, tex_offs;
+	uint64_t face_offs;
+	uint64_t size;
+};
+
+/* returns a pointer to the array at offs, or null if it's missing */
+#define MESH_FILE_ARRAY(hdr, type, offs)	\
+	((offs) ? (const type*)((const char*)(hdr) + (offs)) : (const type*)0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** maps a mesh file in memory and checks that its header and arrays are
+ * valid. Returns 0 on failure. The file must be released with unmap_mesh_file.
+ */
+const struct mesh_file_header *map_mesh_file(const char *fname);
+void unmap_mesh_file(const struct mesh_file_header *hdr);
+
+/** writes a mesh file. Any of the norm, tang, and tex arrays may be null.
+ * Returns -1 on failure.
+ */
+int write_mesh_file(const char *fname, int num_verts, const float *pos, const float *norm,
+		const float *tang, const float *tex, int num_faces, const uint32_t *faces);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* MESHFILE_H_ */
@@ -15,7 +15,12 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <stdlib.h>
+#include <ctype.h>
+#include <map>
 #include "mesh.h"
+#include "meshfile.h"
+#include "datapath.h"
 
 struct VertexElement {
 	Vector3 v;
@@ -38,6 +43,11 @@ enum {
 	NUM_VERTEX_ELEM
 };
 
+/* the vertex elements used by a face corner, -1 for missing ones */
+struct VertexRef {
+	int idx[NUM_VERTEX_ELEM];
+};
+
 static const char *velem_name[] = {
 	"vertex",
 	"normal",
@@ -46,10 +56,43 @@ static const char *velem_name[] = {
 	0
 };
 
+/* the contents of a <mesh> element, collected while the scene is parsed
+ * (see mesh_stream_handler), or from its children when it's already in the
+ * xml tree.
+ */
+struct MeshData {
+	bool ordered[NUM_VERTEX_ELEM];
+	int cur_idx[NUM_VERTEX_ELEM];
+
+	std::vector<VertexElement> velem[NUM_VERTEX_ELEM];
+	std::vector<FaceRef> faceref;
+
+	/* true while every face corner used the same index for an element as
+	 * for its position, which lets the elements become the mesh vertices
+	 * as they are.
+	 */
+	bool same_idx[NUM_VERTEX_ELEM];
+
+	int depth;			// element nesting depth inside <mesh>
+	int face_corners;	// vrefs read so far in the current face, -1 outside faces
+
+	MeshData();
+};
+
 static bool operator <(const VertexElement &a, const VertexElement &b);
+static bool operator <(const VertexRef &a, const VertexRef &b);
 static int vertex_element(const char *name);
-static void read_vertex_element(VertexElement *elem, struct xml_node *node, int cur_idx);
-static void read_face(FaceRef *face, struct xml_node *node);
+static const char *find_att(const char **atts, const char *name);
+
+static void *mesh_begin(struct xml_node *node);
+static int mesh_start(void *data, const char *name, const char **atts);
+static void mesh_end(void *data, const char *name);
+static void mesh_free(void *data);
+static void stream_subtree(MeshData *md, struct xml_node *node);
+
+struct xml_stream_handler mesh_stream_handler = {
+	"mesh", mesh_begin, mesh_start, mesh_end, mesh_free
+};
 
 
 bool Mesh::load_xml(struct xml_node *node)
@@ -71,47 +114,38 @@ bool Mesh::load_xml(struct xml_node *node)
 		return false;
 	}
 
-	bool ordered[NUM_VERTEX_ELEM] = {true, true, true, true};
-	int cur_idx[NUM_VERTEX_ELEM] = {0};
-
-	std::vector<VertexElement> velem[NUM_VERTEX_ELEM];
-	std::vector<FaceRef> faceref;
+	return load_mesh_xml(node);
+}
 
-	node = node->chld;
-	while(node) {
-		int elem_idx = vertex_element(node->name);
-
-		switch(elem_idx) {
-		case EL_VERTEX:
-		case EL_NORMAL:
-		case EL_TEXCOORD:
-		case EL_TANGENT:
-			{
-				VertexElement elem;
-				read_vertex_element(&elem, node, cur_idx[elem_idx]);
-
-				if(elem.id != cur_idx[elem_idx]++) {
-					ordered[elem_idx] = false;
-				}
-				velem[elem_idx].push_back(elem);
-			}
-			break;
+bool Mesh::load_mesh_xml(struct xml_node *node)
+{
+	struct xml_attr *attr;
+	if((attr = xml_get_attr(node, "file"))) {
+		return load_mesh_file(attr->str);
+	}
 
-		default:
-			if(strcmp(node->name, "face") == 0) {
-				FaceRef f;
-				read_face(&f, node);
+	bool res;
 
-				faceref.push_back(f);
-			}
-			break;
-		}
+	if(node->data) {
+		// the contents were streamed while parsing, release them once used
+		res = load_mesh_data((MeshData*)node->data);
 
-		node = node->next;
+		mesh_free(node->data);
+		node->data = 0;
+	} else {
+		MeshData md;
+		stream_subtree(&md, node);
+		res = load_mesh_data(&md);
 	}
+	return res;
+}
+
+bool Mesh::load_mesh_data(MeshData *md)
+{
+	std::vector<VertexElement> *velem = md->velem;
 
 	for(int i=0; i<NUM_VERTEX_ELEM; i++) {
-		if(!ordered[i]) {
+		if(!md->ordered[i]) {
 			std::sort(velem[i].begin(), velem[i].end());
 		}
 		if(!velem[i].empty() && velem[i].back().id != (int)velem[i].size() - 1) {
@@ -120,38 +154,166 @@ bool Mesh::load_xml(struct xml_node *node)
 		}
 	}
 
-	for(size_t i=0; i<faceref.size(); i++) {
-		Triangle tri;
+	int num_verts = (int)velem[EL_VERTEX].size();
+	bool direct = true;
 
-		for(int j=0; j<3; j++) {
-			Vertex v;
-			v.pos = velem[EL_VERTEX][faceref[i].vert_idx[j]].v;
+	for(int i=0; i<NUM_VERTEX_ELEM; i++) {
+		if(!velem[i].empty() && (!md->same_idx[i] || (int)velem[i].size() != num_verts)) {
+			direct = false;
+		}
+	}
 
-			if(velem[EL_NORMAL].empty()) {
-				v.norm = Vector3(0, 0, 0);
-			} else {
-				v.norm = velem[EL_NORMAL][faceref[i].norm_idx[j]].v;
-			}
+	if(direct) {
+		/* every face corner uses the same index for all the elements, so
+		 * they can be used as the vertices of the mesh in their own order.
+		 */
+		vpos.resize(num_verts);
+		vnorm.resize(velem[EL_NORMAL].size());
+		vtex.resize(velem[EL_TEXCOORD].size());
+		vtang.resize(velem[EL_TANGENT].size());
+
+		for(int i=0; i<num_verts; i++) {
+			vpos[i] = velem[EL_VERTEX][i].v;
+		}
+		for(size_t i=0; i<vnorm.size(); i++) {
+			vnorm[i] = velem[EL_NORMAL][i].v;
+		}
+		for(size_t i=0; i<vtex.size(); i++) {
+			vtex[i] = velem[EL_TEXCOORD][i].v;
+		}
+		for(size_t i=0; i<vtang.size(); i++) {
+			vtang[i] = velem[EL_TANGENT][i].v;
+		}
+
+		for(size_t i=0; i<md->faceref.size(); i++) {
+			const int *vidx = md->faceref[i].vert_idx;
 
-			if(velem[EL_TANGENT].empty()) {
-				v.tang = Vector3(0, 0, 0);
-			} else {
-				v.tang = velem[EL_TANGENT][faceref[i].tang_idx[j]].v;
+			for(int j=0; j<3; j++) {
+				if(vidx[j] < 0 || vidx[j] >= num_verts) {
+					fprintf(stderr, "error loading mesh %s: invalid vertex index\n", get_name());
+					return false;
+				}
 			}
+			add_face(vidx[0], vidx[1], vidx[2]);
+		}
+
+	} else {
+		/* faces index each vertex element separately, every distinct
+		 * combination of them used by the faces becomes a shared vertex.
+		 */
+		std::map<VertexRef, int> vmap;
+
+		for(size_t i=0; i<md->faceref.size(); i++) {
+			const FaceRef *fref = &md->faceref[i];
+			int vidx[3];
+
+			for(int j=0; j<3; j++) {
+				VertexRef ref;
+				ref.idx[EL_VERTEX] = fref->vert_idx[j];
+				ref.idx[EL_NORMAL] = velem[EL_NORMAL].empty() ? -1 : fref->norm_idx[j];
+				ref.idx[EL_TEXCOORD] = velem[EL_TEXCOORD].empty() ? -1 : fref->tex_idx[j];
+				ref.idx[EL_TANGENT] = velem[EL_TANGENT].empty() ? -1 : fref->tang_idx[j];
+
+				for(int k=0; k<NUM_VERTEX_ELEM; k++) {
+					if(k != EL_VERTEX && ref.idx[k] == -1) {
+						continue;	// missing element
+					}
+					if(ref.idx[k] < 0 || ref.idx[k] >= (int)velem[k].size()) {
+						fprintf(stderr, "error loading mesh %s: invalid %s index\n", get_name(), velem_name[k]);
+						return false;
+					}
+				}
 
-			if(velem[EL_TEXCOORD].empty()) {
-				v.tex = Vector2(0, 0);
-			} else {
-				v.tex = velem[EL_TEXCOORD][faceref[i].tex_idx[j]].v;
+				std::map<VertexRef, int>::iterator it = vmap.find(ref);
+				if(it != vmap.end()) {
+					vidx[j] = it->second;
+					continue;
+				}
+
+				const Vector3 *norm = 0, *tang = 0;
+				Vector2 tex;
+
+				if(ref.idx[EL_NORMAL] != -1) {
+					norm = &velem[EL_NORMAL][ref.idx[EL_NORMAL]].v;
+				}
+				if(ref.idx[EL_TANGENT] != -1) {
+					tang = &velem[EL_TANGENT][ref.idx[EL_TANGENT]].v;
+				}
+				if(ref.idx[EL_TEXCOORD] != -1) {
+					tex = velem[EL_TEXCOORD][ref.idx[EL_TEXCOORD]].v;
+				}
+
+				vidx[j] = add_vertex(velem[EL_VERTEX][ref.idx[EL_VERTEX]].v, norm, tang,
+						ref.idx[EL_TEXCOORD] != -1 ? &tex : 0);
+				vmap[ref] = vidx[j];
 			}
 
-			tri.v[j] = v;
+			add_face(vidx[0], vidx[1], vidx[2]);
+		}
+	}
+
+	// the elements aren't needed any more, free them before building the tree
+	for(int i=0; i<NUM_VERTEX_ELEM; i++) {
+		std::vector<VertexElement>().swap(velem[i]);
+	}
+	std::vector<FaceRef>().swap(md->faceref);
+
+	build_tree();
+	return true;
+}
+
+/* copies an array of num vectors with dim float elements each, if present */
+template <typename T>
+static void copy_attrib(std::vector<T> *stream, const float *src, int dim, int num)
+{
+	if(!src) {
+		stream->clear();
+		return;
+	}
+
+	stream->resize(num);
+	for(int i=0; i<num; i++) {
+		T &v = (*stream)[i];
+		for(int j=0; j<dim; j++) {
+			v[j] = src[j];
 		}
+		src += dim;
+	}
+}
+
+bool Mesh::load_mesh_file(const char *fname)
+{
+	char path[512];
+
+	// search the data path first, then try the name as given
+	if(find_file(fname, path, sizeof path) == -1) {
+		snprintf(path, sizeof path, "%s", fname);
+	}
+
+	const struct mesh_file_header *hdr;
+	if(!(hdr = map_mesh_file(path))) {
+		fprintf(stderr, "error loading mesh %s from file: %s\n", get_name(), fname);
+		return false;
+	}
+
+	int num_verts = (int)hdr->num_verts;
+	copy_attrib(&vpos, MESH_FILE_ARRAY(hdr, float, hdr->pos_offs), 3, num_verts);
+	copy_attrib(&vnorm, MESH_FILE_ARRAY(hdr, float, hdr->norm_offs), 3, num_verts);
+	copy_attrib(&vtang, MESH_FILE_ARRAY(hdr, float, hdr->tang_offs), 3, num_verts);
+	copy_attrib(&vtex, MESH_FILE_ARRAY(hdr, float, hdr->tex_offs), 2, num_verts);
+
+	// the indices have already been checked against the vertex count
+	const uint32_t *fidx = MESH_FILE_ARRAY(hdr, uint32_t, hdr->face_offs);
 
-		tri.calc_normal();
-		add_face(tri);
+	faces.resize(hdr->num_faces);
+	for(size_t i=0; i<faces.size(); i++) {
+		for(int j=0; j<3; j++) {
+			faces[i].v[j] = (int)*fidx++;
+		}
 	}
 
+	unmap_mesh_file(hdr);
+
 	build_tree();
 	return true;
 }
@@ -162,6 +324,16 @@ static bool operator <(const VertexElement &a, const VertexElement &b)
 	return a.id < b.id;
 }
 
+static bool operator <(const VertexRef &a, const VertexRef &b)
+{
+	for(int i=0; i<NUM_VERTEX_ELEM; i++) {
+		if(a.idx[i] != b.idx[i]) {
+			return a.idx[i] < b.idx[i];
+		}
+	}
+	return false;
+}
+
 static int vertex_element(const char *name)
 {
 	for(int i=0; velem_name[i]; i++) {
@@ -172,71 +344,183 @@ static int vertex_element(const char *name)
 	return -1;
 }
 
+static const char *find_att(const char **atts, const char *name)
+{
+	for(int i=0; atts[i]; i+=2) {
+		if(strcmp(atts[i], name) == 0) {
+			return atts[i + 1];
+		}
+	}
+	return 0;
+}
 
-static void read_vertex_element(VertexElement *elem, struct xml_node *node, int cur_idx)
+/* parses an integer attribute, returns false if it's missing or invalid */
+static bool int_att(const char **atts, const char *name, int *res)
 {
-	struct xml_attr *attr;
+	const char *str = find_att(atts, name);
+	char *end;
+
+	if(!str) return false;
+
+	long val = strtol(str, &end, 10);
+	if(end == str || *end) {
+		return false;
+	}
+	*res = (int)val;
+	return true;
+}
+
+
+MeshData::MeshData()
+{
+	for(int i=0; i<NUM_VERTEX_ELEM; i++) {
+		ordered[i] = true;
+		same_idx[i] = true;
+		cur_idx[i] = 0;
+	}
+	depth = 0;
+	face_corners = -1;
+}
+
+static void *mesh_begin(struct xml_node *node)
+{
+	return new MeshData;
+}
+
+static void read_vertex_element(MeshData *md, int elem_idx, const char *name, const char **atts)
+{
+	VertexElement elem;
+	int cur_idx = md->cur_idx[elem_idx]++;
 
 	// retreive the element ID number
-	if((attr = xml_get_attr(node, "id")) && attr->type == ATYPE_INT) {
-		elem->id = attr->ival;
-	} else {
-		fprintf(stderr, "invalid, or no id in %s element\n", node->name);
-		elem->id = cur_idx;
+	if(!int_att(atts, "id", &elem.id)) {
+		fprintf(stderr, "invalid, or no id in %s element\n", name);
+		elem.id = cur_idx;
+	}
+	if(elem.id != cur_idx) {
+		md->ordered[elem_idx] = false;
 	}
 
-	// retreive the value
-	if((attr = xml_get_attr(node, "val")) && attr->type == ATYPE_VEC) {
-		elem->v = Vector3(attr->vval[0], attr->vval[1], attr->vval[2]);
-	} else {
-		fprintf(stderr, "invalid, or no value in %s element\n", node->name);
+	// retreive the value, the same way xml attributes are parsed
+	const char *str = find_att(atts, "val");
+	int num = 0;
+
+	if(str && (isdigit(str[0]) || ((str[0] == '+' || str[0] == '-') && isdigit(str[1])))) {
+		float val[3] = {1.0, 1.0, 1.0};
+
+		while(*str && num < 3) {
+			val[num++] = atof(str);
+
+			while(*str && !isspace(*str)) str++;
+			while(*str && isspace(*str)) str++;
+		}
+		if(num >= 2) {
+			elem.v = Vector3(val[0], val[1], val[2]);
+		}
+	}
+	if(num < 2) {
+		fprintf(stderr, "invalid, or no value in %s element\n", name);
 	}
+
+	md->velem[elem_idx].push_back(elem);
 }
 
-static void read_face(FaceRef *face, struct xml_node *node)
+static void read_vref(MeshData *md, const char **atts)
 {
 	static bool warn_non_triangle;
-	int i = 0;
-	struct xml_attr *attr;
 
-	node = node->chld;
-	while(node && i < 3) {
-		if(strcmp(node->name, "vref") != 0) {
-			fprintf(stderr, "unknown tag %s in <face>\n", node->name);
-			node = node->next;
-			continue;
+	if(md->face_corners >= 3) {
+		if(!warn_non_triangle) {
+			fprintf(stderr, "warning: only triangle meshes are supported at the moment\n");
+			warn_non_triangle = true;
 		}
+		return;
+	}
 
-		if((attr = xml_get_attr(node, "vertex")) && attr->type == ATYPE_INT) {
-			face->vert_idx[i] = attr->ival;
-		} else {
-			face->vert_idx[i] = 0;
-		}
+	FaceRef *face = &md->faceref.back();
+	int i = md->face_corners++;
 
-		if((attr = xml_get_attr(node, "normal")) && attr->type == ATYPE_INT) {
-			face->norm_idx[i] = attr->ival;
-		} else {
-			face->norm_idx[i] = 0;
-		}
+	if(!int_att(atts, "vertex", face->vert_idx + i)) {
+		face->vert_idx[i] = 0;
+	}
+	if(!int_att(atts, "normal", face->norm_idx + i)) {
+		face->norm_idx[i] = 0;
+	}
+	if(!int_att(atts, "tangent", face->tang_idx + i)) {
+		face->tang_idx[i] = 0;
+	}
+	if(!int_att(atts, "texcoord", face->tex_idx + i)) {
+		face->tex_idx[i] = 0;
+	}
 
-		if((attr = xml_get_attr(node, "tangent")) && attr->type == ATYPE_INT) {
-			face->tang_idx[i] = attr->ival;
-		} else {
-			face->tang_idx[i] = 0;
+	int vidx = face->vert_idx[i];
+	if(face->norm_idx[i] != vidx) md->same_idx[EL_NORMAL] = false;
+	if(face->tang_idx[i] != vidx) md->same_idx[EL_TANGENT] = false;
+	if(face->tex_idx[i] != vidx) md->same_idx[EL_TEXCOORD] = false;
+}
+
+static int mesh_start(void *data, const char *name, const char **atts)
+{
+	MeshData *md = (MeshData*)data;
+	int lvl = ++md->depth;
+
+	if(lvl == 1) {
+		int elem_idx = vertex_element(name);
+
+		if(elem_idx != -1) {
+			read_vertex_element(md, elem_idx, name, atts);
+
+		} else if(strcmp(name, "face") == 0) {
+			FaceRef f;
+			memset(&f, 0, sizeof f);
+			md->faceref.push_back(f);
+			md->face_corners = 0;
 		}
 
-		if((attr = xml_get_attr(node, "texcoord")) && attr->type == ATYPE_INT) {
-			face->tex_idx[i] = attr->ival;
+	} else if(lvl == 2 && md->face_corners != -1) {
+		if(strcmp(name, "vref") == 0) {
+			read_vref(md, atts);
 		} else {
-			face->tex_idx[i] = 0;
+			fprintf(stderr, "unknown tag %s in <face>\n", name);
 		}
+	}
+	return 0;
+}
 
-		i++;
-		node = node->next;
+static void mesh_end(void *data, const char *name)
+{
+	MeshData *md = (MeshData*)data;
+
+	if(--md->depth == 0) {
+		md->face_corners = -1;	// not in a face any more
 	}
+}
+
+static void mesh_free(void *data)
+{
+	delete (MeshData*)data;
+}
+
+/* feeds the children of an element already in the xml tree to the mesh
+ * stream handler, as if they were being parsed.
+ */
+static void stream_subtree(MeshData *md, struct xml_node *node)
+{
+	std::vector<const char*> atts;
+
+	for(node = node->chld; node; node = node->next) {
+		atts.clear();
+
+		struct xml_attr *attr = node->attr;
+		while(attr) {
+			atts.push_back(attr->name);
+			atts.push_back(attr->str);
+			attr = attr->next;
+		}
+		atts.push_back(0);
 
-	if(node && !warn_non_triangle) {
-		fprintf(stderr, "warning: only triangle meshes are supported at the moment\n");
-		warn_non_triangle = true;
+		mesh_start(md, node->name, &atts[0]);
+		stream_subtree(md, node);
+		mesh_end(md, node->name);
 	}
 }
@@ -23,10 +23,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "sphere.h"
 #include "cylinder.h"
 #include "mesh.h"
+#include "instance.h"
 
 
-enum { OBJ_SPHERE, OBJ_CYLINDER, OBJ_MESH };
-static const char *obj_type_name[] = { "sphere", "cylinder", "mesh", 0 };
+enum { OBJ_SPHERE, OBJ_CYLINDER, OBJ_MESH, OBJ_INSTANCE };
+static const char *obj_type_name[] = { "sphere", "cylinder", "mesh", "instance", 0 };
 
 static int get_obj_type(const char *str);
 
@@ -103,6 +104,11 @@ bool Object::in_box(const AABox *box, int t0, int t1) const
 	return false;
 }
 
+bool Object::occluded(const Ray &ray) const
+{
+	return intersect(ray, 0);
+}
+
 void Object::get_bounds(AABox *aabb, int msec) const
 {
 	if(bbcache.is_valid(msec)) {
@@ -127,6 +133,9 @@ Object *create_object(const char *typestr)
 	case OBJ_MESH:
 		return new Mesh;
 
+	case OBJ_INSTANCE:
+		return new MeshInstance;
+
 	default:
 		fprintf(stderr, "unknown object type: %s\n", typestr);
 		break;
@@ -79,6 +79,11 @@ public:
 	 * \return true if an intersection is found, false otherwise.
 	 */
 	virtual bool intersect(const Ray &ray, SurfPoint *pt) const = 0;
+
+	/** occluded returns true if the ray hits the object anywhere along its
+	 * length, without computing any surface properties. Used for shadow rays.
+	 */
+	virtual bool occluded(const Ray &ray) const;
 };
 
 /** creates an object of the type specified by the argument string */
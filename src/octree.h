@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <list>
 #include <vector>
 #include "aabb.h"
+#include "raypacket.h"
 
 template <typename T>
 struct OctItem {
@@ -29,6 +30,9 @@ struct OctItem {
 	AABox box;
 };
 
+/** OctNode is only used while building the tree, which is then flattened
+ * into an array of OctFlatNode for traversal.
+ */
 template <typename T>
 class OctNode {
 public:
@@ -40,6 +44,24 @@ public:
 	OctNode();
 };
 
+/** Nodes of the built tree are stored in a single array. The 8 children of
+ * an inner node are stored consecutively starting at index child. Leaves have
+ * child == 0 (the root can't be anyone's child), and their items are the
+ * num_items entries of the item index array, starting at first.
+ */
+struct OctFlatNode {
+	GeomBox box;
+	int child;
+	int first, num_items;
+};
+
+/** leaf visitor for Octree::visit_leaves. It's called with the index of a
+ * non-empty leaf node, and the distance of the closest intersection found so
+ * far, which it should lower when it finds a closer one. Returning true stops
+ * the traversal.
+ */
+typedef bool (*OctLeafFunc)(int leaf, double *tmax, void *cls);
+
 struct OctStats {
 	int height;
 	int num_inner, num_leaves;
@@ -47,29 +69,37 @@ struct OctStats {
 	int min_items, max_items, avg_items;
 };
 
-enum {
-	OCT_PREORDER = 0,
-	OCT_POSTORDER = 8
-};
-
 /** Abstract Octree data structure */
 template <typename T>
 class Octree {
 private:
 	int items_per_node, max_depth;
-	OctNode<T> *root;
 
 	std::vector<OctItem<T> > items;
 	AABox bounds;
 
+	std::vector<OctFlatNode> nodes;
+	std::vector<int> leaf_items;
+
+	/* the node array used for traversal: either nodes, or an external array
+	 * given to set_nodes.
+	 */
+	const OctFlatNode *node_arr;
+	int num_nodes;
+
 	bool show_build_stats;
 
 	void subdivide(OctNode<T> *node, int lvl);
-	OctItem<T> *intersect_rec(OctNode<T> *node, const Ray &ray, SurfPoint *pt) const;
+	void flatten(const OctNode<T> *node, int idx);
+
+	OctItem<T> *intersect_rec(int nidx, const BoxTestRay &bray, const Ray &ray, SurfPoint *pt) const;
+	bool occluded_rec(int nidx, const BoxTestRay &bray, const Ray &ray) const;
+	bool visit_rec(int nidx, const BoxTestRay &bray, double *tmax, OctLeafFunc func, void *cls) const;
+	void intersect_packet_rec(int nidx, const RayPacket &pkt, int first, double *tmax,
+			SurfPoint *pt, OctItem<T> **item) const;
 
 public:
 	Octree();
-	~Octree();
 
 	/** set the maximum tree depth. no tree will grow deeper than this limit */
 	void set_max_depth(int max_depth);
@@ -93,16 +123,43 @@ public:
 	 * If an intersection is found, a pointer to the item is returned, and
 	 * the sp pointer is filled with details about the point of intersection.
 	 * Otherwise, null is returned if no intersection occurs.
+	 *
+	 * Children are visited front to back, and subtrees starting beyond the
+	 * closest intersection found so far are skipped.
 	 */
 	OctItem<T> *intersect(const Ray &ray, SurfPoint *pt = 0) const;
 
-	/** traverse the tree in the order specified (OCT_PREORDER or OCT_POSTORDER),
-	 * and call the supplied function for each node.
+	/** packet version of intersect. For each ray of the packet, item[i] is
+	 * set to the nearest item hit (or null), and pt[i] is filled in.
+	 */
+	void intersect(const RayPacket &pkt, SurfPoint *pt, OctItem<T> **item) const;
+
+	/** returns true as soon as any item is found to intersect the ray.
+	 * Items must provide an occluded(const Ray&) function.
+	 */
+	bool occluded(const Ray &ray) const;
+
+	/** calls func for each leaf the ray passes through, front to back, skipping
+	 * leaves beyond the distance maintained by func. This lets the user keep
+	 * their own per-leaf data, indexed by node, instead of going through the
+	 * items' intersect functions.
+	 * \return true if func stopped the traversal.
+	 */
+	bool visit_leaves(const Ray &ray, OctLeafFunc func, void *cls) const;
+
+	/** replaces the tree with count nodes of an already built node array, which
+	 * must outlive it (or the next clear). Such a tree has no items, so only visit_leaves
+	 * and the node accessors can be used with it.
 	 */
-	void traverse(int ord, void (*op)(OctNode<T>*, void*), void *cls);
+	void set_nodes(const AABox &bounds, const OctFlatNode *arr, int count);
+
+	/** bounding box of all the items in the tree */
+	const AABox &get_bounds() const;
 
-	OctNode<T> *get_root();
-	const OctNode<T> *get_root() const;
+	int get_node_count() const;
+	const OctFlatNode *get_node(int idx) const;
+	/** returns the i-th item of a leaf node */
+	const OctItem<T> *get_leaf_item(int leaf, int i) const;
 
 	bool stats(OctStats *st) const;
 };
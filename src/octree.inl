@@ -30,7 +30,6 @@ OctNode<T>::OctNode()
 template <typename T>
 Octree<T>::Octree()
 {
-	root = 0;
 	items_per_node = 5;
 	max_depth = 5;
 	show_build_stats = VERBOSE;
@@ -38,12 +37,6 @@ Octree<T>::Octree()
 	clear();
 }
 
-template <typename T>
-Octree<T>::~Octree()
-{
-	clear();
-}
-
 template <typename T>
 void Octree<T>::set_max_depth(int max_depth)
 {
@@ -90,9 +83,11 @@ static void free_tree(OctNode<T> *node)
 template <typename T>
 void Octree<T>::clear()
 {
-	free_tree(root);
 	items.clear();
-	root = 0;
+	nodes.clear();
+	leaf_items.clear();
+	node_arr = 0;
+	num_nodes = 0;
 	bounds.min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
 	bounds.max = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 }
@@ -118,11 +113,10 @@ void Octree<T>::add(const AABox &box, const T &data)
 template <typename T>
 void Octree<T>::build()
 {
-	if(root) {
-		delete root;
-	}
+	nodes.clear();
+	leaf_items.clear();
 
-	root = new OctNode<T>;
+	OctNode<T> *root = new OctNode<T>;
 	root->box = bounds;
 	root->num_items = items.size();
 
@@ -134,6 +128,14 @@ void Octree<T>::build()
 		subdivide(root, 0);
 	}
 
+	// flatten the tree into the node and leaf item arrays, and discard it
+	nodes.resize(1);
+	flatten(root, 0);
+	free_tree(root);
+
+	node_arr = &nodes[0];
+	num_nodes = (int)nodes.size();
+
 	if(show_build_stats) {
 		OctStats st;
 		
@@ -190,97 +192,350 @@ void Octree<T>::subdivide(OctNode<T> *node, int lvl)
 	node->num_items = 0;
 }
 
-
+/* writes node into nodes[idx], which must already exist, appending its
+ * children (if any) to the node array, and its items to the leaf item array.
+ */
 template <typename T>
-OctItem<T> *Octree<T>::intersect(const Ray &ray, SurfPoint *pt) const
+void Octree<T>::flatten(const OctNode<T> *node, int idx)
 {
-	return intersect_rec(root, ray, pt);
+	nodes[idx].box.set(node->box);
+	nodes[idx].child = 0;
+	nodes[idx].first = (int)leaf_items.size();
+	nodes[idx].num_items = node->num_items;
+
+	if(node->child[0]) {
+		int first_child = (int)nodes.size();
+		nodes[idx].child = first_child;
+		nodes.resize(first_child + 8);
+
+		for(int i=0; i<8; i++) {
+			flatten(node->child[i], first_child + i);
+		}
+	} else {
+		typename std::list<OctItem<T>*>::const_iterator iter = node->items.begin();
+		while(iter != node->items.end()) {
+			leaf_items.push_back((int)(*iter - &items[0]));
+			iter++;
+		}
+	}
 }
 
+
 template <typename T>
-OctItem<T> *Octree<T>::intersect_rec(OctNode<T> *node, const Ray &ray, SurfPoint *pt) const
+OctItem<T> *Octree<T>::intersect(const Ray &ray, SurfPoint *pt) const
 {
-	if(!node || !node->box.intersect(ray)) {
+	BoxTestRay bray(ray);
+
+	if(!num_nodes || !node_arr[0].box.intersect(bray, 0.0, 1.0)) {
 		return 0;
 	}
 
 	SurfPoint pt0;
 	pt0.dist = FLT_MAX;
+
+	OctItem<T> *closest = intersect_rec(0, bray, ray, &pt0);
+	if(closest && pt) {
+		*pt = pt0;
+	}
+	return closest;
+}
+
+/* pt->dist holds the distance of the closest intersection found so far, and
+ * is updated (along with the rest of pt) whenever a closer one is found.
+ */
+template <typename T>
+OctItem<T> *Octree<T>::intersect_rec(int nidx, const BoxTestRay &bray,
+		const Ray &ray, SurfPoint *pt) const
+{
+	const OctFlatNode *node = &node_arr[nidx];
 	OctItem<T> *closest = 0;
 
-	if(node->num_items) {
-		typename std::list<OctItem<T>*>::iterator iter = node->items.begin();
-		while(iter != node->items.end()) {
-			SurfPoint pt;
+	if(!node->child) {
+		for(int i=0; i<node->num_items; i++) {
+			OctItem<T> *item = const_cast<OctItem<T>*>(&items[leaf_items[node->first + i]]);
+			SurfPoint sp;
 
 			// XXX data must be a pointer to an object with an intersect function
-			if(((*iter)->data->intersect(ray, &pt)) && pt.dist < pt0.dist) {
-				pt0 = pt;
-				closest = *iter;
+			if(item->data->intersect(ray, &sp) && sp.dist < pt->dist) {
+				*pt = sp;
+				closest = item;
 			}
-			iter++;
 		}
+		return closest;
+	}
 
-	} else {
+	// sort the children the ray passes through by entry distance
+	int cidx[8];
+	double cnear[8];
+	int num_hit = 0;
 
-		for(int i=0; i<8; i++) {
-			SurfPoint pt;
-			OctItem<T> *item;
+	for(int i=0; i<8; i++) {
+		int c = node->child + i;
+		const OctFlatNode *cnode = &node_arr[c];
+		double tnear;
 
-			if((item = intersect_rec(node->child[i], ray, &pt)) && pt.dist < pt0.dist) {
-				pt0 = pt;
-				closest = item;
-			}
+		if((!cnode->child && !cnode->num_items) || !cnode->box.intersect(bray, 0.0, 1.0, &tnear)) {
+			continue;
 		}
+
+		int j = num_hit++;
+		while(j > 0 && cnear[j - 1] > tnear) {
+			cidx[j] = cidx[j - 1];
+			cnear[j] = cnear[j - 1];
+			j--;
+		}
+		cidx[j] = c;
+		cnear[j] = tnear;
 	}
 
-	if(closest && pt) {
-		*pt = pt0;
+	for(int i=0; i<num_hit; i++) {
+		if(cnear[i] > pt->dist) {
+			break;	// every remaining child starts beyond the closest hit
+		}
+
+		OctItem<T> *item = intersect_rec(cidx[i], bray, ray, pt);
+		if(item) {
+			closest = item;
+		}
 	}
+
 	return closest;
 }
 
 template <typename T>
-static void traverse_rec(OctNode<T> *node, int ord, void (*op)(OctNode<T>*, void*), void *cls)
+void Octree<T>::intersect(const RayPacket &pkt, SurfPoint *pt, OctItem<T> **item) const
 {
-	if(!node) return;
+	double tmax[RAY_PACKET_SIZE];
+	for(int i=0; i<pkt.count; i++) {
+		tmax[i] = 1.0;
+		item[i] = 0;
+	}
 
-	if(ord < 0) {
-		op(node, cls);
+	if(!num_nodes || pkt.misses(node_arr[0].box, 1.0)) {
+		return;
+	}
+
+	double tnear;
+	int first = pkt.first_hit(node_arr[0].box, 0, tmax, &tnear);
+	if(first >= 0) {
+		intersect_packet_rec(0, pkt, first, tmax, pt, item);
 	}
+}
+
+/* first is the first ray of the packet known to hit this node. rays before
+ * it have either missed the node, or have already found a closer hit.
+ */
+template <typename T>
+void Octree<T>::intersect_packet_rec(int nidx, const RayPacket &pkt, int first, double *tmax,
+		SurfPoint *pt, OctItem<T> **item) const
+{
+	const OctFlatNode *node = &node_arr[nidx];
+
+	if(!node->child) {
+		for(int i=0; i<node->num_items; i++) {
+			OctItem<T> *it = const_cast<OctItem<T>*>(&items[leaf_items[node->first + i]]);
+
+			for(int j=first; j<pkt.count; j++) {
+				if(j > first && !node->box.intersect(pkt.bray[j], 0.0, tmax[j])) {
+					continue;
+				}
+
+				SurfPoint sp;
+				if(it->data->intersect(pkt.ray[j], &sp) && sp.dist < tmax[j]) {
+					pt[j] = sp;
+					tmax[j] = sp.dist;
+					item[j] = it;
+				}
+			}
+		}
+		return;
+	}
+
+	double pkt_tmax = 0.0;
+	for(int i=first; i<pkt.count; i++) {
+		if(tmax[i] > pkt_tmax) pkt_tmax = tmax[i];
+	}
+
+	// sort the children the packet passes through, by the entry distance of
+	// the first ray hitting each one.
+	int cidx[8];
+	double cnear[8];
+	int num_hit = 0;
+
 	for(int i=0; i<8; i++) {
-		if(ord == i) {
-			op(node, cls);
+		int c = node->child + i;
+		const OctFlatNode *cnode = &node_arr[c];
+		double tnear;
+
+		if((!cnode->child && !cnode->num_items) || pkt.misses(cnode->box, pkt_tmax)) {
+			continue;
+		}
+		if(pkt.first_hit(cnode->box, first, tmax, &tnear) == -1) {
+			continue;
 		}
 
-		traverse_rec(node->child[i], ord, op, cls);
+		int j = num_hit++;
+		while(j > 0 && cnear[j - 1] > tnear) {
+			cidx[j] = cidx[j - 1];
+			cnear[j] = cnear[j - 1];
+			j--;
+		}
+		cidx[j] = c;
+		cnear[j] = tnear;
 	}
-	if(ord > 7) {
-		op(node, cls);
+
+	for(int i=0; i<num_hit; i++) {
+		// hits found in the previous children may have shortened some rays
+		double tnear;
+		int cfirst = pkt.first_hit(node_arr[cidx[i]].box, first, tmax, &tnear);
+
+		if(cfirst >= 0) {
+			intersect_packet_rec(cidx[i], pkt, cfirst, tmax, pt, item);
+		}
 	}
 }
 
 template <typename T>
-void Octree<T>::traverse(int ord, void (*op)(OctNode<T>*, void*), void *cls)
+bool Octree<T>::occluded(const Ray &ray) const
 {
-	traverse_rec(root, ord, op, cls);
+	BoxTestRay bray(ray);
+
+	if(!num_nodes || !node_arr[0].box.intersect(bray, 0.0, 1.0)) {
+		return false;
+	}
+	return occluded_rec(0, bray, ray);
 }
 
 template <typename T>
-static void gather_stats(const OctNode<T> *node, OctStats *st, int lvl)
+bool Octree<T>::occluded_rec(int nidx, const BoxTestRay &bray, const Ray &ray) const
 {
-	if(!node) return;
+	const OctFlatNode *node = &node_arr[nidx];
 
-	st->height = MAX(st->height, lvl);
+	if(!node->child) {
+		for(int i=0; i<node->num_items; i++) {
+			if(items[leaf_items[node->first + i]].data->occluded(ray)) {
+				return true;
+			}
+		}
+		return false;
+	}
 
-	if(node->child[0] == 0) {
-		// leaf node
-#ifndef NDEBUG
-		for(int i=1; i<8; i++) {
-			assert(node->child[i] == 0);
+	// any hit will do, so there's no point in sorting the children
+	for(int i=0; i<8; i++) {
+		int c = node->child + i;
+		const OctFlatNode *cnode = &node_arr[c];
+
+		if(!cnode->child && !cnode->num_items) {
+			continue;
+		}
+		if(cnode->box.intersect(bray, 0.0, 1.0) && occluded_rec(c, bray, ray)) {
+			return true;
 		}
-#endif
+	}
+	return false;
+}
+
+template <typename T>
+bool Octree<T>::visit_leaves(const Ray &ray, OctLeafFunc func, void *cls) const
+{
+	BoxTestRay bray(ray);
+
+	if(!num_nodes || !node_arr[0].box.intersect(bray, 0.0, 1.0)) {
+		return false;
+	}
+
+	double tmax = 1.0;
+	return visit_rec(0, bray, &tmax, func, cls);
+}
+
+template <typename T>
+bool Octree<T>::visit_rec(int nidx, const BoxTestRay &bray, double *tmax,
+		OctLeafFunc func, void *cls) const
+{
+	const OctFlatNode *node = &node_arr[nidx];
+
+	if(!node->child) {
+		return node->num_items && func(nidx, tmax, cls);
+	}
+
+	// same ordering as intersect_rec
+	int cidx[8];
+	double cnear[8];
+	int num_hit = 0;
+
+	for(int i=0; i<8; i++) {
+		int c = node->child + i;
+		const OctFlatNode *cnode = &node_arr[c];
+		double tnear;
+
+		if((!cnode->child && !cnode->num_items) || !cnode->box.intersect(bray, 0.0, *tmax, &tnear)) {
+			continue;
+		}
+
+		int j = num_hit++;
+		while(j > 0 && cnear[j - 1] > tnear) {
+			cidx[j] = cidx[j - 1];
+			cnear[j] = cnear[j - 1];
+			j--;
+		}
+		cidx[j] = c;
+		cnear[j] = tnear;
+	}
+
+	for(int i=0; i<num_hit; i++) {
+		if(cnear[i] > *tmax) {
+			break;
+		}
+		if(visit_rec(cidx[i], bray, tmax, func, cls)) {
+			return true;
+		}
+	}
+	return false;
+}
 
+template <typename T>
+void Octree<T>::set_nodes(const AABox &bounds, const OctFlatNode *arr, int count)
+{
+	clear();
+
+	this->bounds = bounds;
+	node_arr = arr;
+	num_nodes = count;
+}
+
+template <typename T>
+const AABox &Octree<T>::get_bounds() const
+{
+	return bounds;
+}
+
+template <typename T>
+int Octree<T>::get_node_count() const
+{
+	return num_nodes;
+}
+
+template <typename T>
+const OctFlatNode *Octree<T>::get_node(int idx) const
+{
+	return &node_arr[idx];
+}
+
+template <typename T>
+const OctItem<T> *Octree<T>::get_leaf_item(int leaf, int i) const
+{
+	return &items[leaf_items[node_arr[leaf].first + i]];
+}
+
+static inline void oct_gather_stats(const OctFlatNode *nodes, int nidx,
+		OctStats *st, int lvl)
+{
+	const OctFlatNode *node = &nodes[nidx];
+
+	st->height = MAX(st->height, lvl);
+
+	if(!node->child) {
+		// leaf node
 		st->num_leaves++;
 		st->num_items += node->num_items;
 
@@ -291,41 +546,25 @@ static void gather_stats(const OctNode<T> *node, OctStats *st, int lvl)
 			st->max_items = node->num_items;
 		}
 	} else {
-		assert(node->num_items == 0);
-
 		// inner node
 		st->num_inner++;
 
 		for(int i=0; i<8; i++) {
-			assert(node->child[i] != 0);
-
-			gather_stats(node->child[i], st, lvl + 1);
+			oct_gather_stats(nodes, node->child + i, st, lvl + 1);
 		}
 	}
 }
 
-template <typename T>
-OctNode<T> *Octree<T>::get_root()
-{
-	return root;
-}
-
-template <typename T>
-const OctNode<T> *Octree<T>::get_root() const
-{
-	return root;
-}
-
 template <typename T>
 bool Octree<T>::stats(OctStats *st) const
 {
-	if(!root) return false;
+	if(!num_nodes) return false;
 
 	memset(st, 0, sizeof *st);
 	st->min_items = INT_MAX;
 	st->max_items = 0;
 
-	gather_stats(root, st, 0);
+	oct_gather_stats(node_arr, 0, st, 0);
 
 	st->avg_items = st->num_items / st->num_leaves;
 	st->num_items = (int)items.size();
@@ -38,7 +38,10 @@ enum {
 	OPT_CAUST_PHOTONS,
 	OPT_GI_PHOTONS,
 	OPT_GATHER_DIST,
+	OPT_GATHER_PHOTONS,
 	OPT_PHOTON_ENERGY,
+	OPT_PRECOMP,
+	OPT_IRR_CACHE,
 	OPT_FPS,
 	OPT_TRANGE,
 	OPT_MBLUR,
@@ -50,6 +53,11 @@ enum {
 	OPT_SOCT_MAX_ITEMS,
 	OPT_MOCT_MAX_DEPTH,
 	OPT_MOCT_MAX_ITEMS,
+	OPT_MESH_CACHE,
+	OPT_PHOTON_CACHE,
+	OPT_ACCEL,
+	OPT_BVH_MAX_ITEMS,
+	OPT_NO_PACKETS,
 	OPT_HELP
 };
 
@@ -71,7 +79,10 @@ static struct {
 	{OPT_CAUST_PHOTONS,	'c', "cphot",		"number of caustics photons to use"},
 	{OPT_GI_PHOTONS,	'g', "gphot",		"number of global illumination photons to use"},
 	{OPT_GATHER_DIST,	0, "gatherdisc",	"radius of the photon gathering disc (rel. scene size)"},
+	{OPT_GATHER_PHOTONS, 0, "gatherphot",	"max number of photons used in each photon map estimate"},
 	{OPT_PHOTON_ENERGY, 0, "photonenergy",	"photon energy (multiplier)"},
+	{OPT_PRECOMP,		0, "precomp",		"precompute gi radiance at every n-th photon (e.g. 4), 0 disables it"},
+	{OPT_IRR_CACHE,		0, "irrcache",		"irradiance cache accuracy for gi (0.1-0.3), 0 disables it"},
 	{OPT_FPS,			'f', "fps",			"animation frames per second (24)"},
 	{OPT_TRANGE,		'a', "range",		"animation time range"},
 	{OPT_MBLUR,			'm', "mblur",		"enable motion blur"},
@@ -80,6 +91,11 @@ static struct {
 	{OPT_SOCT_MAX_ITEMS, 0, "soctitems",	"scene octree: max items per node"},
 	{OPT_MOCT_MAX_DEPTH, 0, "moctdepth",	"mesh octree: max tree depth"},
 	{OPT_MOCT_MAX_ITEMS, 0, "moctitems",	"mesh octree: max items per node"},
+	{OPT_MESH_CACHE,	0, "meshcache",		"directory to cache built mesh octrees in"},
+	{OPT_PHOTON_CACHE,	0, "photoncache",	"directory to cache photon maps in"},
+	{OPT_ACCEL,			0, "accel",			"scene acceleration structure: octree or bvh"},
+	{OPT_BVH_MAX_ITEMS,	0, "bvhitems",		"scene bvh: max items per leaf"},
+	{OPT_NO_PACKETS,	0, "nopackets",		"trace primary rays one at a time, instead of in packets"},
 	{OPT_QUIET,			'q', "quiet",		"run quietly (no output)"},
 	{OPT_VERBOSE,		'v', "verbose",		"produce verbose output (add more for greater effect)"},
 	{OPT_BACKEND,		0, "backend",		"run as a backend, emmiting only status info"},
@@ -215,6 +231,13 @@ int parse_opt(int argc, char **argv)
 			opt.gather_dist = atof(argv[i]);
 			break;
 
+		case OPT_GATHER_PHOTONS:
+			if(!isdigit(argv[++i][0]) || !(opt.gather_photons = atoi(argv[i]))) {
+				fprintf(stderr, "%s must be followed by the number of photons to gather\n", argv[i - 1]);
+				return -1;
+			}
+			break;
+
 		case OPT_PHOTON_ENERGY:
 			if(!isdigit(argv[++i][0])) {
 				fprintf(stderr, "%s must be followed by the photon energy multiplier\n", argv[i - 1]);
@@ -223,6 +246,22 @@ int parse_opt(int argc, char **argv)
 			opt.photon_energy = atof(argv[i]);
 			break;
 
+		case OPT_PRECOMP:
+			if(!isdigit(argv[++i][0])) {
+				fprintf(stderr, "%s must be followed by the photon step of the precomputed estimates\n", argv[i - 1]);
+				return -1;
+			}
+			opt.precomp_step = atoi(argv[i]);
+			break;
+
+		case OPT_IRR_CACHE:
+			if(!isdigit(argv[++i][0])) {
+				fprintf(stderr, "%s must be followed by the irradiance cache accuracy\n", argv[i - 1]);
+				return -1;
+			}
+			opt.irrcache = atof(argv[i]);
+			break;
+
 		case OPT_FPS:
 			if(!isdigit(argv[++i][0])) {
 				fprintf(stderr, "%s must be followed by the frames per second\n", argv[i - 1]);
@@ -287,6 +326,45 @@ int parse_opt(int argc, char **argv)
 			opt.meshoct_max_items = atoi(argv[i]);
 			break;
 
+		case OPT_MESH_CACHE:
+			if(!argv[++i]) {
+				fprintf(stderr, "%s must be followed by the mesh cache directory\n", argv[i - 1]);
+				return -1;
+			}
+			opt.meshcache = argv[i];
+			break;
+
+		case OPT_PHOTON_CACHE:
+			if(!argv[++i]) {
+				fprintf(stderr, "%s must be followed by the photon cache directory\n", argv[i - 1]);
+				return -1;
+			}
+			opt.photoncache = argv[i];
+			break;
+
+		case OPT_ACCEL:
+			if(strcmp(argv[++i], "octree") == 0) {
+				opt.accel = ACCEL_OCTREE;
+			} else if(strcmp(argv[i], "bvh") == 0) {
+				opt.accel = ACCEL_BVH;
+			} else {
+				fprintf(stderr, "%s must be followed by the acceleration structure: octree or bvh\n", argv[i - 1]);
+				return -1;
+			}
+			break;
+
+		case OPT_BVH_MAX_ITEMS:
+			if(!isdigit(argv[++i][0])) {
+				fprintf(stderr, "%s must be followed by the maximum number of items in a scene bvh leaf\n", argv[i - 1]);
+				return -1;
+			}
+			opt.bvh_max_items = atoi(argv[i]);
+			break;
+
+		case OPT_NO_PACKETS:
+			opt.packets = 0;
+			break;
+
 		case OPT_QUIET:
 			opt.verb--;
 			break;
@@ -373,18 +451,27 @@ static void default_opt(void)
 	opt.iter = 7;
 	opt.caust_photons = opt.gi_photons = 0;
 	opt.gather_dist = 0.001;
+	opt.gather_photons = 200;
 	opt.photon_energy = 300.0;
+	opt.precomp_step = 0;
+	opt.irrcache = 0.0;
 	opt.verb = 0;
 	opt.fps = 30;
 	opt.time_start = opt.time_end = 0;
 	opt.mblur = 0;
+	opt.packets = 1;
 	opt.shutter = 0;
 
 	opt.meshoct_max_depth = 7;
 	opt.meshoct_max_items = 14;
+	opt.meshcache = 0;
+	opt.photoncache = 0;
 
 	opt.scnoct_max_depth = 5;
 	opt.scnoct_max_items = 5;
+
+	opt.accel = ACCEL_OCTREE;
+	opt.bvh_max_items = 4;
 }
 
 static void print_opt(void)
@@ -402,7 +489,17 @@ static void print_opt(void)
 	printf("caust. photons: %d\n", opt.caust_photons);
 	printf("    gi photons: %d\n", opt.gi_photons);
 	printf("   gather disc: %f\n", opt.gather_dist);
+	printf("gather photons: %d\n", opt.gather_photons);
 	printf(" photon energy: %f\n", opt.photon_energy);
+	if(opt.photoncache) {
+		printf("  photon cache: %s\n", opt.photoncache);
+	}
+	if(opt.precomp_step) {
+		printf("   precomputed: every %d photon(s)\n", opt.precomp_step);
+	}
+	if(opt.irrcache > 0.0) {
+		printf("    irr. cache: %f\n", opt.irrcache);
+	}
 	printf("           fps: %d\n", opt.fps);
 	printf("    frame time: %d-%d msec (%d frame(s))\n", opt.time_start, opt.time_end, opt.num_frames);
 	printf("   motion blur: %s\n", opt.mblur ? "yes" : "no");
@@ -412,10 +509,19 @@ static void print_opt(void)
 		}
 		printf("       shutter: %d msec\n", opt.shutter);
 	}
-	printf(" scn octree max depth: %d\n", opt.scnoct_max_depth);
-	printf(" scn octree max items: %d\n", opt.scnoct_max_items);
+	printf("   ray packets: %s\n", opt.packets ? "yes" : "no");
+	printf("          accelerator: %s\n", opt.accel == ACCEL_BVH ? "bvh" : "octree");
+	if(opt.accel == ACCEL_BVH) {
+		printf("    scn bvh max items: %d\n", opt.bvh_max_items);
+	} else {
+		printf(" scn octree max depth: %d\n", opt.scnoct_max_depth);
+		printf(" scn octree max items: %d\n", opt.scnoct_max_items);
+	}
 	printf("mesh octree max depth: %d\n", opt.meshoct_max_depth);
 	printf("mesh octree max items: %d\n", opt.meshoct_max_items);
+	if(opt.meshcache) {
+		printf("    mesh octree cache: %s\n", opt.meshcache);
+	}
 	putchar('\n');
 }
 
@@ -31,6 +31,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #define BACKEND			(opt.verb < -50)
 
+/* scene acceleration structures */
+enum {
+	ACCEL_OCTREE,
+	ACCEL_BVH
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -49,14 +55,22 @@ extern struct options {
 	int verb;
 	int fps;
 	int mblur;
+	int packets;
 	int shutter;
 	int time_start, time_end;
 	int caust_photons, gi_photons;
 	float gather_dist;
+	int gather_photons;
 	float photon_energy;
+	int precomp_step;
+	float irrcache;
 
+	int accel;
 	int scnoct_max_depth, scnoct_max_items;
 	int meshoct_max_depth, meshoct_max_items;
+	char *meshcache;
+	char *photoncache;
+	int bvh_max_items;
 
 	int num_frames;
 } opt;
@@ -19,164 +19,450 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
 #include "pmap.h"
+#include "tpool.h"
 #include "opt.h"
 
-// TODO implement photon pool for the allocator?
-static Photon *alloc_photon()
-{
-	try {
-		return new Photon;
-	}
-	catch(...) {}
-	return 0;
-}
-
-static void free_photon(Photon *p)
-{
-	delete p;
-}
+/* minimum cosine between the normals of a precomputed estimate and the
+ * surface it is used for.
+ */
+#define PRECOMP_MIN_COS		0.9
+
+/* precomputed estimates are calculated in batches of this many, one thread
+ * pool task each.
+ */
+#define PRECOMP_BATCH		4096
+
+/* the photons nearest to a point found so far, kept in a max-heap on their
+ * distance once it's full, so that the farthest one can be replaced.
+ */
+struct NearestPhotons {
+	Vector3 pos;
+	const Vector3 *norm;	// if not null, skip photons with other normals
+	int max_found, found;
+	double max_dist_sq;
+
+	int idx[PMAP_MAX_GATHER];
+	double dist_sq[PMAP_MAX_GATHER];
+
+	void add(int pidx, double dsq);
+};
+
+static void init_tables();
+static void encode_dir(unsigned char *sph, const Vector3 &dir);
+static inline Vector3 decode_dir(const unsigned char *sph);
+static void encode_rgbe(unsigned char *rgbe, const Color &col);
+static inline Color decode_rgbe(const unsigned char *rgbe);
 
 PhotonMap::PhotonMap()
 {
-	if(!(kd = kd_create(3))) {
-		throw std::bad_alloc();
-	}
-	kd_data_destructor(kd, (void (*)(void*))free_photon);
-	
-	prev_scale = 0;
+	balanced = true;
+	phot_arr = 0;
+	num_phot = 0;
+	precomp = 0;
+	init_tables();
 }
 
 PhotonMap::~PhotonMap()
 {
-	kd_free(kd);
+	delete precomp;
 }
 
 void PhotonMap::clear()
 {
-	kd_clear(kd);
-	photons.clear();
+	std::vector<PackedPhoton>().swap(photons);	// free the memory too
+	balanced = true;
+	phot_arr = 0;
+	num_phot = 0;
 
-	prev_scale = 0;
+	delete precomp;
+	precomp = 0;
 }
 
 bool PhotonMap::empty() const
 {
-	return photons.empty();
+	return num_phot == 0;
 }
 
 size_t PhotonMap::size() const
 {
-	return photons.size();
+	return num_phot;
 }
 
 bool PhotonMap::add_photon(const Vector3 &pos, const Vector3 &dir, const Vector3 &norm, const Color &col)
 {
-	Photon *phot = alloc_photon();
-	if(!phot) {
+	PackedPhoton phot;
+	phot.pos[0] = pos.x;
+	phot.pos[1] = pos.y;
+	phot.pos[2] = pos.z;
+	encode_rgbe(phot.power, col);
+	encode_dir(phot.dir, dir);
+	encode_dir(phot.norm, norm);
+	phot.split = 0;
+
+	try {
+		photons.push_back(phot);
+	}
+	catch(...) {
 		return false;
 	}
-	
-	phot->pos = pos;
-	phot->dir = dir;
-	phot->col = col;
-	phot->norm = norm;
+	phot_arr = &photons[0];
+	num_phot = (int)photons.size();
+	balanced = false;
+	return true;
+}
+
+/* number of nodes in the left subtree of a left-balanced tree of num nodes */
+static int left_subtree_size(int num)
+{
+	int half = 1;
+	while(4 * half <= num) {
+		half *= 2;
+	}
+	return 3 * half <= num ? 2 * half - 1 : num - half;
+}
+
+struct PhotonAxisLess {
+	const PackedPhoton *photons;
+	int axis;
+
+	bool operator ()(int a, int b) const
+	{
+		return photons[a].pos[axis] < photons[b].pos[axis];
+	}
+};
+
+void PhotonMap::balance()
+{
+	if(balanced) return;
+	balanced = true;
+
+	int num = (int)photons.size();
+
+	AABox box;
+	box.min = box.max = photon_pos(&photons[0]);
+	for(int i=1; i<num; i++) {
+		const float *pos = photons[i].pos;
+		for(int j=0; j<3; j++) {
+			if(pos[j] < box.min[j]) box.min[j] = pos[j];
+			if(pos[j] > box.max[j]) box.max[j] = pos[j];
+		}
+	}
+
+	// tree[node] is the index of the photon placed at node
+	std::vector<int> idx(num), tree(num);
+	for(int i=0; i<num; i++) {
+		idx[i] = i;
+	}
+	balance_rec(&idx[0], num, 0, box, &tree[0]);
+
+	std::vector<PackedPhoton> sorted(num);
+	for(int i=0; i<num; i++) {
+		sorted[i] = photons[tree[i]];
+	}
+	photons.swap(sorted);
+	phot_arr = &photons[0];
+}
+
+/* places the median of the num photons in idx, along the longest axis of
+ * their bounding box, at node, and the photons on either side in its subtrees.
+ */
+void PhotonMap::balance_rec(int *idx, int num, int node, const AABox &box, int *tree)
+{
+	Vector3 size = box.max - box.min;
+	int axis = 0;
+	if(size.y > size[axis]) axis = 1;
+	if(size.z > size[axis]) axis = 2;
+
+	int left = left_subtree_size(num);
+
+	PhotonAxisLess less;
+	less.photons = &photons[0];
+	less.axis = axis;
+	std::nth_element(idx, idx + left, idx + num, less);
+
+	tree[node] = idx[left];
+	photons[idx[left]].split = axis;
+
+	double median = photons[idx[left]].pos[axis];
+
+	if(left > 0) {
+		AABox lbox = box;
+		lbox.max[axis] = median;
+		balance_rec(idx, left, 2 * node + 1, lbox, tree);
+	}
+	if(num - left - 1 > 0) {
+		AABox rbox = box;
+		rbox.min[axis] = median;
+		balance_rec(idx + left + 1, num - left - 1, 2 * node + 2, rbox, tree);
+	}
+}
 
-	photons.push_back(phot);
+void PhotonMap::set_photons(const PackedPhoton *arr, int count)
+{
+	clear();
+	phot_arr = count > 0 ? arr : 0;
+	num_phot = count > 0 ? count : 0;
+}
 
-	return kd_insert3f(kd, pos.x, pos.y, pos.z, phot) != -1;
+const PackedPhoton *PhotonMap::get_photons() const
+{
+	return phot_arr;
 }
 
-void PhotonMap::scale_photon_power(double scale)
+void NearestPhotons::add(int pidx, double dsq)
 {
-	printf("DBG scale_photon_power(%f)\n", scale);
-	int num_photons = (int)photons.size();
-	for(int i=prev_scale; i<num_photons; i++) {
-		photons[i]->col.x *= scale;
-		photons[i]->col.y *= scale;
-		photons[i]->col.z *= scale;
+	int i;
+
+	if(found < max_found) {
+		// sift the new photon up the heap
+		i = found++;
+		while(i > 0) {
+			int parent = (i - 1) / 2;
+			if(dist_sq[parent] >= dsq) break;
+
+			idx[i] = idx[parent];
+			dist_sq[i] = dist_sq[parent];
+			i = parent;
+		}
+		idx[i] = pidx;
+		dist_sq[i] = dsq;
+
+		if(found == max_found) {
+			max_dist_sq = dist_sq[0];
+		}
+		return;
 	}
-	prev_scale = num_photons;
+
+	// replace the farthest photon, and sift the new one down
+	i = 0;
+	for(;;) {
+		int child = 2 * i + 1;
+		if(child >= found) break;
+
+		if(child + 1 < found && dist_sq[child + 1] > dist_sq[child]) {
+			child++;
+		}
+		if(dist_sq[child] <= dsq) break;
+
+		idx[i] = idx[child];
+		dist_sq[i] = dist_sq[child];
+		i = child;
+	}
+	idx[i] = pidx;
+	dist_sq[i] = dsq;
+
+	max_dist_sq = dist_sq[0];
 }
 
-Photon **PhotonMap::get_photons()
+void PhotonMap::locate(int node, NearestPhotons *np) const
 {
-	return photons.empty() ? 0 : &photons[0];
+	const PackedPhoton *phot = phot_arr + node;
+	int num = num_phot;
+	int child = 2 * node + 1;
+
+	if(child < num) {
+		int axis = phot->split;
+		double dist = np->pos[axis] - phot->pos[axis];
+
+		// visit the side of the split plane the point is on first
+		if(dist < 0.0) {
+			locate(child, np);
+			if(dist * dist < np->max_dist_sq && child + 1 < num) {
+				locate(child + 1, np);
+			}
+		} else {
+			if(child + 1 < num) {
+				locate(child + 1, np);
+			}
+			if(dist * dist < np->max_dist_sq) {
+				locate(child, np);
+			}
+		}
+	}
+
+	double dx = phot->pos[0] - np->pos.x;
+	double dy = phot->pos[1] - np->pos.y;
+	double dz = phot->pos[2] - np->pos.z;
+	double dsq = dx * dx + dy * dy + dz * dz;
+	if(dsq < np->max_dist_sq) {
+		if(!np->norm || dot_product(decode_dir(phot->norm), *np->norm) >= PRECOMP_MIN_COS) {
+			np->add(node, dsq);
+		}
+	}
+}
+
+/* finds the nearest photons to pos, and returns how many were found. The
+ * radius of the disc they were found in is left in np->max_dist_sq.
+ */
+int PhotonMap::find_nearest(const Vector3 &pos, double max_dist, int max_photons, NearestPhotons *np,
+		const Vector3 *norm) const
+{
+	if(max_photons <= 0) {
+		max_photons = opt.gather_photons;
+	}
+
+	np->pos = pos;
+	np->norm = norm;
+	np->max_found = max_photons < PMAP_MAX_GATHER ? max_photons : PMAP_MAX_GATHER;
+	np->found = 0;
+	np->max_dist_sq = max_dist * max_dist;
+
+	if(!num_phot) {
+		return 0;
+	}
+	assert(balanced);
+
+	locate(0, np);
+	return np->found;
 }
 
 // estimates irradiance at any given point
-// TODO: max_photons is unused for now
 Color PhotonMap::irradiance_est(const Vector3 &pos, const Vector3 &norm, double max_dist, int max_photons) const
 {
-	kdres *res;
+	NearestPhotons np;
 	Color irrad(0, 0, 0);
 
-	if(!(res = kd_nearest_range3f(kd, pos.x, pos.y, pos.z, max_dist))) {
-		return irrad;
-	}
-
-	if(kd_res_size(res) < 8) {
-		kd_res_free(res);
+	if(find_nearest(pos, max_dist, max_photons, &np) < 8) {
 		return irrad;
 	}
 
 	// sum irradiance
-	while(!kd_res_end(res)) {
-		Photon *phot = (Photon*)kd_res_item(res, 0);
+	for(int i=0; i<np.found; i++) {
+		const PackedPhoton *phot = phot_arr + np.idx[i];
 
 		// add if it came from the front of the surface
-		if(dot_product(phot->dir, norm) < 0.0) {
-			irrad += phot->col;
+		if(dot_product(decode_dir(phot->dir), norm) < 0.0) {
+			irrad += decode_rgbe(phot->power);
 		}
-
-		kd_res_next(res);
 	}
-	kd_res_free(res);
 
 	// density estimate
-	irrad *= 1.0 / (M_PI * SQ(max_dist));
+	irrad *= 1.0 / (M_PI * np.max_dist_sq);
 	return irrad;
 }
 
 // estimates radiance exiting towards direction dir from a given point
-// TODO: max_photons is unused for now
 Color PhotonMap::radiance_est(const Vector3 &pos, const Vector3 &norm, const Vector3 &dir, double max_dist, int max_photons) const
 {
-	kdres *res;
+	NearestPhotons np;
 	Color flux(0, 0, 0);
 	static const double max_cos_angle = cos(M_PI / 2.5);
 
-	if(!(res = kd_nearest_range3f(kd, pos.x, pos.y, pos.z, max_dist))) {
-		return flux;
-	}
-
-	if(kd_res_size(res) <= 0) {
-		kd_res_free(res);
+	if(find_nearest(pos, max_dist, max_photons, &np) <= 0) {
 		return flux;
 	}
 
 	// sum radiant flux
-	while(!kd_res_end(res)) {
-		Photon *phot = (Photon*)kd_res_item(res, 0);
+	for(int i=0; i<np.found; i++) {
+		const PackedPhoton *phot = phot_arr + np.idx[i];
 
-		double ndotl = dot_product(-phot->dir, norm);
+		double ndotl = -dot_product(decode_dir(phot->dir), norm);
 
 		/* if the photon came from the front of the surface, and it's
 		 * stored on a surface with a normal similar to the one we hit,
 		 * use it.
 		 */
-		if(ndotl > 0.0 && dot_product(phot->norm, norm) > max_cos_angle) {
-			flux += phot->col * ndotl;
+		if(ndotl > 0.0 && dot_product(decode_dir(phot->norm), norm) > max_cos_angle) {
+			flux += decode_rgbe(phot->power) * ndotl;
 		}
-
-		kd_res_next(res);
 	}
-	kd_res_free(res);
 
-	flux *= 1.0 / (M_PI * SQ(max_dist));
+	flux *= 1.0 / (M_PI * np.max_dist_sq);
 	return flux;
 }
 
+struct PrecompBatch {
+	const PhotonMap *map;
+	const PackedPhoton *photons;
+	double max_dist;
+	int start, count, step;
+	Color *rad;
+};
+
+static void precomp_batch_proc(void *cls)
+{
+	PrecompBatch *batch = (PrecompBatch*)cls;
+
+	for(int i=0; i<batch->count; i++) {
+		const PackedPhoton *phot = batch->photons + (batch->start + i) * batch->step;
+		Vector3 pos = photon_pos(phot);
+		Vector3 norm = photon_norm(phot);
+
+		batch->rad[i] = batch->map->radiance_est(pos, norm, -norm, batch->max_dist);
+	}
+}
+
+void PhotonMap::precompute_radiance(double max_dist, int step, ThreadPool *tpool)
+{
+	delete precomp;
+	precomp = 0;
+
+	if(step <= 0 || !num_phot) {
+		return;
+	}
+	assert(balanced);
+
+	int num = (num_phot + step - 1) / step;
+	std::vector<Color> rad(num);
+
+	int num_batches = (num + PRECOMP_BATCH - 1) / PRECOMP_BATCH;
+	PrecompBatch *batches = new PrecompBatch[num_batches];
+	Task *tasks = new Task[num_batches];
+
+	for(int i=0; i<num_batches; i++) {
+		PrecompBatch *batch = batches + i;
+		batch->map = this;
+		batch->photons = phot_arr;
+		batch->max_dist = max_dist;
+		batch->start = i * PRECOMP_BATCH;
+		batch->count = i < num_batches - 1 ? PRECOMP_BATCH : num - batch->start;
+		batch->step = step;
+		batch->rad = &rad[batch->start];
+
+		tasks[i] = Task(precomp_batch_proc, 0, batch);
+	}
+
+	if(tpool) {
+		tpool->add_work(tasks, num_batches);
+		tpool->wait_work();
+	} else {
+		for(int i=0; i<num_batches; i++) {
+			tasks[i].proc(tasks[i].closure);
+		}
+	}
+
+	delete [] tasks;
+	delete [] batches;
+
+	// keep the estimates in a photon map of their own, to look them up
+	precomp = new PhotonMap;
+	for(int i=0; i<num; i++) {
+		const PackedPhoton *phot = phot_arr + i * step;
+		Vector3 norm = photon_norm(phot);
+		precomp->add_photon(photon_pos(phot), -norm, norm, rad[i]);
+	}
+	precomp->balance();
+
+	if(VERBOSE) {
+		printf("precomputed %d radiance estimates\n", num);
+	}
+}
+
+Color PhotonMap::precomp_radiance_est(const Vector3 &pos, const Vector3 &norm, const Vector3 &dir, double max_dist) const
+{
+	if(precomp) {
+		NearestPhotons np;
+		if(precomp->find_nearest(pos, max_dist, 1, &np, &norm) > 0) {
+			return decode_rgbe(precomp->phot_arr[np.idx[0]].power);
+		}
+	}
+	return radiance_est(pos, norm, dir, max_dist);
+}
+
 bool PhotonMap::dump(const char *fname) const
 {
 	FILE *fp;
@@ -188,16 +474,20 @@ bool PhotonMap::dump(const char *fname) const
 
 	fprintf(fp, "energy %f\n", opt.photon_energy);
 
-	for(size_t i=0; i<photons.size(); i++) {
-		const Photon *p = photons[i];
-		fprintf(fp, "<%f %f %f> ", p->pos.x, p->pos.y, p->pos.z);
-		fprintf(fp, "<%f %f %f> ", p->dir.x, p->dir.y, p->dir.z);
-		fprintf(fp, "<%f %f %f> ", p->norm.x, p->norm.y, p->norm.z);
-		fprintf(fp, "<%f %f %f>\n", p->col.x, p->col.y, p->col.z);
+	for(int i=0; i<num_phot; i++) {
+		const PackedPhoton *p = phot_arr + i;
+		Vector3 dir = photon_dir(p);
+		Vector3 norm = photon_norm(p);
+		Color col = photon_power(p);
+
+		fprintf(fp, "<%f %f %f> ", p->pos[0], p->pos[1], p->pos[2]);
+		fprintf(fp, "<%f %f %f> ", dir.x, dir.y, dir.z);
+		fprintf(fp, "<%f %f %f> ", norm.x, norm.y, norm.z);
+		fprintf(fp, "<%f %f %f>\n", col.x, col.y, col.z);
 	}
 
 	if(opt.verb) {
-		printf("dumped %d photons at %s\n", (int)photons.size(), fname);
+		printf("dumped %d photons at %s\n", num_phot, fname);
 	}
 
 	fclose(fp);
@@ -243,9 +533,113 @@ bool PhotonMap::restore(const char *fname)
 		count++;
 	}
 
+	balance();
+
 	if(count && opt.verb) {
 		printf("restored %d photons from dump file: %s\n", count, fname);
 	}
 	fclose(fp);
 	return true;
 }
+
+Vector3 photon_pos(const PackedPhoton *p)
+{
+	return Vector3(p->pos[0], p->pos[1], p->pos[2]);
+}
+
+Vector3 photon_dir(const PackedPhoton *p)
+{
+	return decode_dir(p->dir);
+}
+
+Vector3 photon_norm(const PackedPhoton *p)
+{
+	return decode_dir(p->norm);
+}
+
+Color photon_power(const PackedPhoton *p)
+{
+	return decode_rgbe(p->power);
+}
+
+// decoding tables for the quantized directions, indexed by theta and phi
+static float cos_theta[256], sin_theta[256];
+static float cos_phi[256], sin_phi[256];
+
+/* called by the PhotonMap constructor, before any photons can be stored
+ * or looked up.
+ */
+static void init_tables()
+{
+	static bool done;
+	if(done) return;
+
+	for(int i=0; i<256; i++) {
+		double theta = (i + 0.5) * M_PI / 256.0;
+		double phi = (i + 0.5) * 2.0 * M_PI / 256.0;
+
+		cos_theta[i] = cos(theta);
+		sin_theta[i] = sin(theta);
+		cos_phi[i] = cos(phi);
+		sin_phi[i] = sin(phi);
+	}
+	done = true;
+}
+
+static void encode_dir(unsigned char *sph, const Vector3 &dir)
+{
+	double len = dir.length();
+	if(len == 0.0) {
+		sph[0] = sph[1] = 0;
+		return;
+	}
+
+	double z = dir.z / len;
+	int theta = (int)(acos(z < -1.0 ? -1.0 : (z > 1.0 ? 1.0 : z)) * 256.0 / M_PI);
+	double phi = atan2(dir.y, dir.x);
+	if(phi < 0.0) {
+		phi += 2.0 * M_PI;
+	}
+
+	sph[0] = theta > 255 ? 255 : theta;
+	sph[1] = (int)(phi * 256.0 / (2.0 * M_PI)) & 0xff;
+}
+
+static inline Vector3 decode_dir(const unsigned char *sph)
+{
+	return Vector3(sin_theta[sph[0]] * cos_phi[sph[1]],
+			sin_theta[sph[0]] * sin_phi[sph[1]], cos_theta[sph[0]]);
+}
+
+static void encode_rgbe(unsigned char *rgbe, const Color &col)
+{
+	double r = col.x > 0.0 ? col.x : 0.0;
+	double g = col.y > 0.0 ? col.y : 0.0;
+	double b = col.z > 0.0 ? col.z : 0.0;
+
+	double maxc = r > g ? r : g;
+	if(b > maxc) maxc = b;
+
+	int e;
+	double mant = frexp(maxc, &e);
+	if(maxc < 1e-32 || e < -127) {
+		rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+		return;
+	}
+
+	double scale = mant * 256.0 / maxc;
+	rgbe[0] = (unsigned char)(r * scale);
+	rgbe[1] = (unsigned char)(g * scale);
+	rgbe[2] = (unsigned char)(b * scale);
+	rgbe[3] = e + 128;
+}
+
+static inline Color decode_rgbe(const unsigned char *rgbe)
+{
+	if(!rgbe[3]) {
+		return Color(0, 0, 0);
+	}
+
+	double scale = ldexp(1.0, rgbe[3] - (128 + 8));
+	return Color((rgbe[0] + 0.5) * scale, (rgbe[1] + 0.5) * scale, (rgbe[2] + 0.5) * scale);
+}
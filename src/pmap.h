@@ -20,8 +20,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <vector>
 #include <vmath/vmath.h>
-#include "kdtree.h"
 #include "color.h"
+#include "aabb.h"
 
 enum PhotonType {
 	DIRECT_PHOTON,
@@ -35,12 +35,45 @@ struct Photon {
 	Color col;
 };
 
+/* upper limit of the number of photons used in a single estimate */
+#define PMAP_MAX_GATHER		512
+
+/** Photon as stored in the photon map (24 bytes): the power is kept in RGBE
+ * form (a shared exponent), and the incident direction and surface normal as
+ * quantized spherical coordinates (theta, phi), decoded through lookup tables.
+ */
+struct PackedPhoton {
+	float pos[3];
+	unsigned char power[4];
+	unsigned char dir[2], norm[2];
+	unsigned char split;	// kd-tree split axis
+};
+
+struct NearestPhotons;
+class ThreadPool;
+
+/** The photons are stored in a flat array, which balance() reorders into a
+ * left-balanced kd-tree: the children of photon i are 2i+1 and 2i+2.
+ */
 class PhotonMap {
 private:
-	kdtree *kd;
+	std::vector<PackedPhoton> photons;
+	bool balanced;
+
+	// the photons in use: either the vector above, or an array set_photons got
+	const PackedPhoton *phot_arr;
+	int num_phot;
+
+	// precomputed radiance estimates at a subset of the photons
+	PhotonMap *precomp;
+
+	void balance_rec(int *idx, int num, int node, const AABox &box, int *tree);
+	void locate(int node, NearestPhotons *np) const;
+	int find_nearest(const Vector3 &pos, double max_dist, int max_photons, NearestPhotons *np,
+			const Vector3 *norm = 0) const;
 
-	std::vector<Photon*> photons;
-	int prev_scale;
+	PhotonMap(const PhotonMap&);
+	PhotonMap &operator =(const PhotonMap&);
 
 public:
 	PhotonMap();
@@ -51,16 +84,48 @@ public:
 	bool empty() const;
 	size_t size() const;
 
+	/** photon power is quantized when added, so any scaling must be
+	 * applied to col beforehand.
+	 */
 	bool add_photon(const Vector3 &pos, const Vector3 &dir, const Vector3 &norm, const Color &col);
-	void scale_photon_power(double scale);
 
-	Photon **get_photons();
+	/** builds the kd-tree, must be called after adding photons, and before
+	 * any estimates. Reorders the photons.
+	 */
+	void balance();
 
+	/** uses an external array of balanced photons (e.g. returned by
+	 * get_photons), which must outlive the photon map or the next clear().
+	 */
+	void set_photons(const PackedPhoton *arr, int count);
+
+	const PackedPhoton *get_photons() const;
+
+	/** the estimates use the max_photons photons nearest to pos, up to a
+	 * distance of max_dist. max_photons defaults to opt.gather_photons, and
+	 * can't exceed PMAP_MAX_GATHER.
+	 */
 	Color irradiance_est(const Vector3 &pos, const Vector3 &norm, double max_dist, int max_photons = -1) const;
 	Color radiance_est(const Vector3 &pos, const Vector3 &norm, const Vector3 &dir, double max_dist, int max_photons = -1) const;
 
+	/** precomputes radiance_est at the position of every step-th photon
+	 * (Christensen), on the worker threads of tpool, or on this thread if
+	 * tpool is null. Must be called after balance().
+	 */
+	void precompute_radiance(double max_dist, int step, ThreadPool *tpool = 0);
+
+	/** returns the precomputed estimate nearest to pos, from a surface with
+	 * a similar normal, or falls back to radiance_est if there isn't one.
+	 */
+	Color precomp_radiance_est(const Vector3 &pos, const Vector3 &norm, const Vector3 &dir, double max_dist) const;
+
 	bool dump(const char *fname) const;
 	bool restore(const char *fname);
 };
 
+Vector3 photon_pos(const PackedPhoton *p);
+Vector3 photon_dir(const PackedPhoton *p);
+Vector3 photon_norm(const PackedPhoton *p);
+Color photon_power(const PackedPhoton *p);
+
 #endif	// PHOTON_MAP_H_
@@ -0,0 +1,336 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* photon cache: the photon maps are written to a file named after a hash of
+ * everything they depend on, and later frames or runs which hash to the same
+ * value map that file and use the photons in it directly, instead of
+ * shooting them again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include "scene.h"
+#include "instance.h"
+#include "opt.h"
+#include "mapfile.h"
+
+#define PCACHE_MAGIC	"SRAYPHT"
+#define PCACHE_VERSION	1
+/* the arrays in the file start at multiples of this */
+#define PCACHE_ALIGN	64
+
+struct PhotonCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t photon_size;
+	uint64_t hash;
+
+	/* frame time interval the photons were shot for */
+	int32_t t0, t1;
+	/* photons shot and stored in the caustics and global maps */
+	int32_t caust_shot, gi_shot;
+	int32_t num_caust, num_gi;
+
+	/* file offsets of the photon arrays */
+	uint64_t caust_offs, gi_offs;
+	uint64_t size;
+};
+
+static inline uint64_t hash_vec(uint64_t hash, const Vector4 &v)
+{
+	double d[4] = {v.x, v.y, v.z, v.w};
+	return hash_bytes(hash, d, sizeof d);
+}
+
+static inline uint64_t hash_matrix(uint64_t hash, const Matrix4x4 &m)
+{
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++) {
+			hash = hash_double(hash, m.m[i][j]);
+		}
+	}
+	return hash;
+}
+
+void Scene::hash_scene_file(FILE *fp)
+{
+	file_hash = hash_file(HASH_INIT, fp);
+}
+
+/* hashes the scene file, the photon options, the geometry and texture images
+ * it references, and the state of the objects, materials and lights during
+ * the frame, so that the hash of two frames matches only if shooting photons
+ * would give the same maps (apart from the random numbers). The frame time
+ * itself isn't included.
+ */
+uint64_t Scene::photon_hash(int t0, int t1) const
+{
+	uint64_t hash = HASH_INIT;
+
+	hash = hash_int(hash, PCACHE_VERSION);
+	hash = hash_int(hash, (int)sizeof(PackedPhoton));
+	hash = hash_bytes(hash, &file_hash, sizeof file_hash);
+
+	hash = hash_int(hash, opt.caust_photons);
+	hash = hash_int(hash, opt.gi_photons);
+	hash = hash_double(hash, opt.photon_energy);
+	hash = hash_int(hash, opt.iter);
+	hash = hash_int(hash, t1 - t0);
+
+	int tm[2] = {t0, t1};
+
+	hash = hash_int(hash, (int)objects.size());
+	for(size_t i=0; i<objects.size(); i++) {
+		for(int j=0; j<2; j++) {
+			hash = hash_matrix(hash, objects[i]->get_xform_matrix(tm[j]));
+		}
+
+		// the geometry may come from a mesh file, or change after loading
+		const Mesh *mesh;
+		const MeshInstance *inst;
+		if((inst = dynamic_cast<const MeshInstance*>(objects[i]))) {
+			mesh = inst->get_mesh();
+		} else {
+			mesh = dynamic_cast<const Mesh*>(objects[i]);
+		}
+		if(mesh) {
+			uint64_t geom_hash = mesh->get_geometry_hash();
+			hash = hash_bytes(hash, &geom_hash, sizeof geom_hash);
+		}
+	}
+	// bounds at every motion key, as built by build_tree
+	if(!tree_keys.empty()) {
+		hash = hash_bytes(hash, &tree_keys[0], tree_keys.size() * sizeof tree_keys[0]);
+	}
+
+	hash = hash_int(hash, (int)mat.size());
+	for(size_t i=0; i<mat.size(); i++) {
+		int num_attr = mat[i]->get_attribute_count();
+		hash = hash_int(hash, num_attr);
+
+		for(int j=0; j<num_attr; j++) {
+			const MatAttrib &attr = mat[i]->get_attribute(j);
+			hash = hash_bytes(hash, attr.name.c_str(), attr.name.size() + 1);
+			hash = hash_vec(hash, attr.col);
+
+			// textures are loaded from image files, which the scene file doesn't cover
+			if(attr.tex) {
+				uint64_t tex_hash = attr.tex->get_file_hash();
+				hash = hash_bytes(hash, &tex_hash, sizeof tex_hash);
+
+				for(int k=0; k<2; k++) {
+					hash = hash_matrix(hash, attr.tex->get_xform_matrix(tm[k]));
+				}
+			}
+		}
+	}
+
+	hash = hash_int(hash, (int)lights.size());
+	for(size_t i=0; i<lights.size(); i++) {
+		const Light *lt = lights[i];
+
+		for(int j=0; j<2; j++) {
+			hash = hash_matrix(hash, lt->get_xform_matrix(tm[j]));
+		}
+		hash = hash_vec(hash, lt->get_color());
+		hash = hash_double(hash, lt->get_attenuation_dist());
+		hash = hash_double(hash, lt->get_attenuation_power());
+
+		const SphLight *sph;
+		const BoxLight *box;
+		if((sph = dynamic_cast<const SphLight*>(lt))) {
+			hash = hash_double(hash, sph->get_radius());
+		} else if((box = dynamic_cast<const BoxLight*>(lt))) {
+			hash = hash_vec(hash, box->get_dimensions());
+		}
+	}
+	return hash;
+}
+
+static void cache_path(char *buf, size_t sz, const char *dir, uint64_t hash)
+{
+	snprintf(buf, sz, "%s/%016llx.pcache", dir, (unsigned long long)hash);
+}
+
+static bool valid_header(const PhotonCacheHeader *hdr, uint64_t hash, size_t size)
+{
+	if(size < sizeof *hdr || memcmp(hdr->magic, PCACHE_MAGIC, 8) != 0) {
+		return false;
+	}
+	if(hdr->version != PCACHE_VERSION || hdr->photon_size != sizeof(PackedPhoton)) {
+		return false;
+	}
+	if(hdr->hash != hash || hdr->size != size) {
+		return false;
+	}
+	if(hdr->num_caust < 0 || hdr->num_gi < 0) {
+		return false;
+	}
+
+	if(!valid_file_array(hdr->caust_offs, hdr->num_caust, sizeof(PackedPhoton), PCACHE_ALIGN, size)) {
+		return false;
+	}
+	if(!valid_file_array(hdr->gi_offs, hdr->num_gi, sizeof(PackedPhoton), PCACHE_ALIGN, size)) {
+		return false;
+	}
+	return true;
+}
+
+/* the kd-tree search uses the split axis of each photon to index its
+ * position, so a corrupt file mustn't be able to make it read past it.
+ */
+static bool valid_photons(const PackedPhoton *phot, int count)
+{
+	for(int i=0; i<count; i++) {
+		if(phot[i].split > 2) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Scene::load_photon_cache(const char *dir, uint64_t hash)
+{
+	char fname[1024];
+	cache_path(fname, sizeof fname, dir, hash);
+
+	void *data;
+	size_t size;
+
+	if(!(data = map_file(fname, &size))) {
+		if(errno != ENOENT) {
+			fprintf(stderr, "failed to map photon cache file %s: %s\n", fname, strerror(errno));
+		}
+		return false;
+	}
+
+	const PhotonCacheHeader *hdr = (const PhotonCacheHeader*)data;
+	const char *base = (const char*)data;
+
+	if(!valid_header(hdr, hash, size) ||
+			!valid_photons((const PackedPhoton*)(base + hdr->caust_offs), hdr->num_caust) ||
+			!valid_photons((const PackedPhoton*)(base + hdr->gi_offs), hdr->num_gi)) {
+		fprintf(stderr, "ignoring invalid photon cache file: %s\n", fname);
+		unmap_file(data, size);
+		return false;
+	}
+
+	caust_map.set_photons((const PackedPhoton*)(base + hdr->caust_offs), hdr->num_caust);
+	gi_map.set_photons((const PackedPhoton*)(base + hdr->gi_offs), hdr->num_gi);
+
+	// the maps don't point into the previous file any more
+	free_photon_cache();
+	pmap_file = data;
+	pmap_file_size = size;
+
+	if(VERBOSE) {
+		printf("loaded photon maps shot at %d-%d from cache: %s\n", hdr->t0, hdr->t1, fname);
+		printf("caustics photons: %d, gi photons: %d\n", hdr->num_caust, hdr->num_gi);
+	}
+	return true;
+}
+
+bool Scene::save_photon_cache(const char *dir, uint64_t hash, int t0, int t1) const
+{
+	int num_caust = (int)caust_map.size();
+	int num_gi = (int)gi_map.size();
+
+	PhotonCacheHeader hdr;
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, PCACHE_MAGIC, 8);
+	hdr.version = PCACHE_VERSION;
+	hdr.photon_size = sizeof(PackedPhoton);
+	hdr.hash = hash;
+	hdr.t0 = t0;
+	hdr.t1 = t1;
+	hdr.caust_shot = opt.caust_photons;
+	hdr.gi_shot = opt.gi_photons;
+	hdr.num_caust = num_caust;
+	hdr.num_gi = num_gi;
+
+	hdr.caust_offs = align_offs(sizeof hdr, PCACHE_ALIGN);
+	hdr.gi_offs = align_offs(hdr.caust_offs + num_caust * sizeof(PackedPhoton), PCACHE_ALIGN);
+	hdr.size = hdr.gi_offs + num_gi * sizeof(PackedPhoton);
+
+	char fname[1024], tmpname[1040];
+	cache_path(fname, sizeof fname, dir, hash);
+
+	FILE *fp;
+	if(!(fp = create_tmp_file(fname, tmpname, sizeof tmpname))) {
+		fprintf(stderr, "failed to create photon cache file: %s\n", tmpname);
+		return false;
+	}
+
+	bool res = fwrite(&hdr, sizeof hdr, 1, fp) == 1 &&
+		write_file_array(fp, caust_map.get_photons(), num_caust * sizeof(PackedPhoton), hdr.caust_offs) != -1 &&
+		write_file_array(fp, gi_map.get_photons(), num_gi * sizeof(PackedPhoton), hdr.gi_offs) != -1;
+
+	if(commit_tmp_file(fp, tmpname, fname, res) == -1) {
+		fprintf(stderr, "failed to write photon cache file: %s\n", fname);
+		return false;
+	}
+
+	if(VERBOSE) {
+		printf("saved photon maps to cache: %s\n", fname);
+	}
+	return true;
+}
+
+void Scene::free_photon_cache()
+{
+	unmap_file(pmap_file, pmap_file_size);
+	pmap_file = 0;
+	pmap_file_size = 0;
+}
+
+bool Scene::restore_photon_maps(int t0, int t1, ThreadPool *tpool)
+{
+	uint64_t hash = photon_hash(t0, t1);
+
+	if(pmap_hash && hash == pmap_hash) {
+		if(VERBOSE) {
+			printf("nothing affecting the photons changed, keeping the photon maps\n");
+		}
+		return true;
+	}
+	pmap_hash = 0;
+
+	// the scene file is part of the hash, so other runs can't reuse it without one
+	if(!opt.photoncache || !file_hash || !load_photon_cache(opt.photoncache, hash)) {
+		return false;
+	}
+	pmap_hash = hash;
+
+	if(opt.precomp_step > 0) {
+		gi_map.precompute_radiance(gather_dist, opt.precomp_step, tpool);
+	}
+	return true;
+}
+
+void Scene::save_photon_maps(int t0, int t1)
+{
+	// the maps have been rebuilt, and don't point into any cache file
+	free_photon_cache();
+
+	pmap_hash = photon_hash(t0, t1);
+
+	if(opt.photoncache && file_hash) {
+		save_photon_cache(opt.photoncache, pmap_hash, t0, t1);
+	}
+}
@@ -16,6 +16,7 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "projmap.h"
+#include "rng.h"
 
 ProjMap::ProjMap()
 {
@@ -165,10 +166,10 @@ void ProjMap::cell_from_dir(const Vector3 &dir, int *ucell, int *vcell) const
 void ProjMap::rand_cell(int *ucell, int *vcell) const
 {
 	if(ucell) {
-		*ucell = rand() % udiv;
+		*ucell = rng_int(udiv);
 	}
 	if(vcell) {
-		*vcell = rand() % vdiv;
+		*vcell = rng_int(vdiv);
 	}
 }
 
@@ -180,8 +181,8 @@ Vector3 ProjMap::gen_dir(int ucell, int vcell) const
 	double umin = ucell * du;
 	double vmin = vcell * dv;
 
-	double u = frand(du) + umin;
-	double v = frand(dv) + vmin;
+	double u = rng_frand(du) + umin;
+	double v = rng_frand(dv) + vmin;
 
 	double theta = u * M_PI * 2.0;	// map u -> [0, 2pi]
 	double phi = v * M_PI;			// map v -> [0, pi]
@@ -197,11 +198,11 @@ Vector3 ProjMap::gen_dir(bool towards_full) const
 	int uc, vc;
 
 	if(!towards_full) {
-		return sphrand(1.0);
+		return rng_sphrand(1.0);
 	}
 
 	do {
-		v = sphrand(1.0);
+		v = rng_sphrand(1.0);
 		cell_from_dir(v, &uc, &vc);
 	} while(!get_cell(uc, vc));
 
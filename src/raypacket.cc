@@ -0,0 +1,61 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "raypacket.h"
+
+RayPacket::RayPacket()
+{
+	count = 0;
+	coherent = false;
+}
+
+void RayPacket::setup()
+{
+	for(int i=0; i<count; i++) {
+		bray[i] = BoxTestRay(ray[i]);
+	}
+
+	coherent = count > 0;
+	if(!coherent) {
+		return;
+	}
+
+	for(int i=0; i<3; i++) {
+		origin[i] = bray[0].origin[i];
+		inv_min[i] = inv_max[i] = bray[0].inv_dir[i];
+	}
+
+	for(int i=0; i<count && coherent; i++) {
+		if(ray[i].origin.x != ray[0].origin.x || ray[i].origin.y != ray[0].origin.y ||
+				ray[i].origin.z != ray[0].origin.z) {
+			coherent = false;
+		}
+
+		for(int j=0; j<3; j++) {
+			geom_t inv = bray[i].inv_dir[j];
+
+			// rays parallel to an axis, or differing direction signs
+			if(inv == 0.0 || bray[i].sign[j] != bray[0].sign[j]) {
+				coherent = false;
+				break;
+			}
+
+			if(inv < inv_min[j]) inv_min[j] = inv;
+			if(inv > inv_max[j]) inv_max[j] = inv;
+		}
+	}
+}
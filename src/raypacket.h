@@ -0,0 +1,63 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RAYPACKET_H_
+#define RAYPACKET_H_
+
+#include <vmath/vmath.h>
+#include "aabb.h"
+
+/* packets cover a square tile of RAY_PACKET_DIM x RAY_PACKET_DIM pixels */
+#define RAY_PACKET_DIM		4
+#define RAY_PACKET_SIZE		(RAY_PACKET_DIM * RAY_PACKET_DIM)
+
+/** A group of coherent rays (typically primary rays of neighbouring pixels)
+ * which are traced through the acceleration structures together.
+ *
+ * Fill in the rays and count, then call setup before tracing the packet.
+ */
+struct RayPacket {
+	Ray ray[RAY_PACKET_SIZE];
+	BoxTestRay bray[RAY_PACKET_SIZE];
+	int count;
+
+	/* if all rays share the same origin and direction signs, the bounds of
+	 * their reciprocal directions are used to cull whole boxes at once.
+	 */
+	bool coherent;
+	geom_t origin[3];
+	geom_t inv_min[3], inv_max[3];
+
+	RayPacket();
+
+	void setup();
+
+	/** conservative test: returns true only if none of the rays can hit the
+	 * box within the parametric interval [0, tmax].
+	 */
+	inline bool misses(const GeomBox &box, double tmax) const;
+
+	/** returns the index of the first ray, starting from first, which hits
+	 * the box before its own tmax, or -1 if there isn't one. The entry
+	 * distance of that ray is returned through tnear.
+	 */
+	inline int first_hit(const GeomBox &box, int first, const double *tmax, double *tnear) const;
+};
+
+#include "raypacket.inl"
+
+#endif	// RAYPACKET_H_
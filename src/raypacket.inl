@@ -0,0 +1,63 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* interval arithmetic version of the slab test. Since every ray starts at the
+ * same origin, and its reciprocal direction lies within [inv_min, inv_max],
+ * the entry and exit distances of all the rays lie within the bounds of the
+ * products below.
+ */
+inline bool RayPacket::misses(const GeomBox &box, double tmax) const
+{
+	if(!coherent) {
+		return false;
+	}
+
+	geom_t tmin = 0.0;
+	geom_t tfar = (geom_t)tmax;
+
+	for(int i=0; i<3; i++) {
+		// with uniform direction signs, every ray enters and leaves through the same slabs
+		geom_t near_plane = inv_min[i] > 0.0 ? box.min[i] : box.max[i];
+		geom_t far_plane = inv_min[i] > 0.0 ? box.max[i] : box.min[i];
+
+		geom_t n0 = (near_plane - origin[i]) * inv_min[i];
+		geom_t n1 = (near_plane - origin[i]) * inv_max[i];
+		geom_t f0 = (far_plane - origin[i]) * inv_min[i];
+		geom_t f1 = (far_plane - origin[i]) * inv_max[i];
+
+		geom_t enter = n0 < n1 ? n0 : n1;
+		geom_t leave = (f0 > f1 ? f0 : f1) * GEOM_SLAB_SCALE;
+
+		if(enter > tmin) tmin = enter;
+		if(leave < tfar) tfar = leave;
+
+		if(tmin > tfar) {
+			return true;
+		}
+	}
+	return false;
+}
+
+inline int RayPacket::first_hit(const GeomBox &box, int first, const double *tmax, double *tnear) const
+{
+	for(int i=first; i<count; i++) {
+		if(box.intersect(bray[i], 0.0, tmax[i], tnear)) {
+			return i;
+		}
+	}
+	return -1;
+}
@@ -2,12 +2,14 @@
 #include "tpool.h"
 #include "block.h"
 #include "timer.h"
+#include "rng.h"
 
 static void build_accel(long t0, long t1);
 static void shoot_photons(long t0, long t1);
 static void render_frame(long t0, long t1);
 static bool start_frame(long t0, long t1, bool calc_prior);
 static void render_block(void *cls);
+static void trace_first_samples(const struct block *blk, long ftime, Color *res);
 static void block_done(void *cls);
 static float variance(Color *samples, const Color &sum, int num, float rcp_num);
 static int rtaskcmp(const void *a, const void *b);
@@ -57,7 +59,7 @@ void render(long msec)
 static void build_accel(long t0, long t1)
 {
 	if(VERBOSE) {
-		printf("building octree\n");
+		printf("building %s\n", opt.accel == ACCEL_BVH ? "bvh" : "octree");
 	}
 
 	scn->build_tree(t0, t1);
@@ -82,6 +84,11 @@ static void shoot_photons(long t0, long t1)
 		t1 = t0;
 	}
 
+	// keep the photons of the previous frame, or load them from the cache
+	if(scn->restore_photon_maps(t0, t1, &tpool)) {
+		return;
+	}
+
 	/* assign number of photons to each light source by dividing the total
 	 * number of photons between the light sources, weighted by their intensity.
 	 */
@@ -109,11 +116,13 @@ static void shoot_photons(long t0, long t1)
 		ltpow[i].photon_power = ltpow[i].intensity / acc_power;
 	}
 
-	int cphot = scn->build_caustics_map(t0, t1, opt.caust_photons, ltpow);
-	int gphot = scn->build_global_map(t0, t1, opt.gi_photons, ltpow);
+	int cphot = scn->build_caustics_map(t0, t1, opt.caust_photons, ltpow, &tpool);
+	int gphot = scn->build_global_map(t0, t1, opt.gi_photons, ltpow, &tpool);
 
 	delete [] ltpow;
 
+	scn->save_photon_maps(t0, t1);
+
 	if(VERBOSE) {
 		printf("caustics photons stored: %d (out of %d shot)\n", cphot, opt.caust_photons);
 		printf("gi photons stored: %d (out of %d shot)\n", gphot, opt.gi_photons);
@@ -139,6 +148,9 @@ static void render_frame(long t0, long t1)
 	if(!QUIET) {
 		putchar('\n');
 	}
+	if(VERBOSE && opt.gi_photons && opt.irrcache > 0.0) {
+		printf("irradiance cache records: %d\n", scn->get_irrcache()->size());
+	}
 }
 
 static bool start_frame(long t0, long t1, bool calc_prior)
@@ -194,7 +206,7 @@ static bool start_frame(long t0, long t1, bool calc_prior)
 static void render_block(void *cls)
 {
 	struct block *blk = (struct block*)cls;
-	long ftime = blk->t0;
+	long ftime = (blk->t0 + blk->t1) / 2;	// primary rays are spread around it
 
 	if(BACKEND) {
 		emit_status('s', blk->x, blk->y, blk->xsz, blk->ysz);
@@ -207,6 +219,13 @@ static void render_block(void *cls)
 		rcp_lut[i] = 1.0 / (double)i;
 	}
 
+	// the first sample of every pixel is traced in packets, if enabled
+	Color *first = 0;
+	if(opt.packets) {
+		first = new Color[blk->xsz * blk->ysz];
+		trace_first_samples(blk, ftime, first);
+	}
+
 	int xsz = framebuffer->get_width();
 	int start_offs = blk->y * xsz + blk->x;
 	float *img = framebuffer->get_pixels() + start_offs * 4;
@@ -217,10 +236,16 @@ static void render_block(void *cls)
 
 			img[x * 4] = img[x * 4 + 1] = img[x * 4 + 2] = img[x * 4 + 3] = 0.0f;
 
+			rng_seed(RNG_PIXEL, ftime, x + blk->x, y + blk->y);
+
 			while(i < opt.max_samples) {
-				Ray ray = cam->get_primary_ray(x + blk->x, y + blk->y, i, ftime);
-				ray.iter = opt.iter;
-				subpix[i] = scn->trace_ray(ray);
+				if(i == 0 && first) {
+					subpix[i] = first[y * blk->xsz + x];
+				} else {
+					Ray ray = cam->get_primary_ray(x + blk->x, y + blk->y, i, ftime);
+					ray.iter = opt.iter;
+					subpix[i] = scn->trace_ray(ray);
+				}
 
 				Color pixel;
 				pixel.x = img[x * 4] += subpix[i].x;
@@ -237,10 +262,54 @@ static void render_block(void *cls)
 				}
 			}
 
-			img[x] *= rcp_lut[i];
+			img[x * 4] *= rcp_lut[i];
+			img[x * 4 + 1] *= rcp_lut[i];
+			img[x * 4 + 2] *= rcp_lut[i];
+			img[x * 4 + 3] *= rcp_lut[i];
 		}
 		img += xsz * 4;
 	}
+
+	delete [] first;
+}
+
+/* traces the first (unjittered) sample of each pixel in the block, in packets
+ * covering square tiles of pixels. the results are written in res, which
+ * must be large enough for the whole block.
+ */
+static void trace_first_samples(const struct block *blk, long ftime, Color *res)
+{
+	RayPacket pkt;
+	Color col[RAY_PACKET_SIZE];
+	int idx[RAY_PACKET_SIZE];
+
+	for(int py=0; py<blk->ysz; py+=RAY_PACKET_DIM) {
+		for(int px=0; px<blk->xsz; px+=RAY_PACKET_DIM) {
+			int ymax = MIN(py + RAY_PACKET_DIM, blk->ysz);
+			int xmax = MIN(px + RAY_PACKET_DIM, blk->xsz);
+
+			rng_seed(RNG_PACKET, ftime, px + blk->x, py + blk->y);
+
+			pkt.count = 0;
+			for(int y=py; y<ymax; y++) {
+				for(int x=px; x<xmax; x++) {
+					Ray *ray = pkt.ray + pkt.count;
+
+					*ray = cam->get_primary_ray(x + blk->x, y + blk->y, 0, ftime);
+					ray->iter = opt.iter;
+
+					idx[pkt.count++] = y * blk->xsz + x;
+				}
+			}
+			pkt.setup();
+
+			scn->trace_packet(pkt, col);
+
+			for(int i=0; i<pkt.count; i++) {
+				res[idx[i]] = col[i];
+			}
+		}
+	}
 }
 
 static void block_done(void *cls)
@@ -0,0 +1,40 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "rng.h"
+
+__thread uint64_t rng_state = 0x853c49e6748fea9bULL;
+
+// splitmix64 finalizer, spreads nearby seeds all over the state space
+static inline uint64_t mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+void rng_seed(int stream, unsigned int a, unsigned int b, unsigned int c)
+{
+	uint64_t s = mix((uint64_t)stream);
+	s = mix(s ^ a);
+	s = mix(s ^ b);
+	s = mix(s ^ c);
+
+	rng_state = s;
+	rng_uint();
+}
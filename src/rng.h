@@ -0,0 +1,55 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <stdint.h>
+#include <vmath/vmath.h>
+
+/* Per-thread random number generator (PCG32), used for all the sampling
+ * done while rendering, instead of rand() which serializes the threads on
+ * its internal lock. Each thread draws from its own state, and rng_seed is
+ * called at the start of every independent unit of work (pixel, packet,
+ * photon batch), so that renders don't depend on thread scheduling.
+ */
+
+/** seed streams, to keep units of work with equal coordinates apart */
+enum {
+	RNG_PIXEL,
+	RNG_PACKET,
+	RNG_CAUST_PHOTON,
+	RNG_GI_PHOTON
+};
+
+/** seeds the generator of the calling thread from a stream id and three
+ * coordinates identifying the unit of work (e.g. frame time, x, y).
+ */
+void rng_seed(int stream, unsigned int a, unsigned int b, unsigned int c);
+
+/** uniformly distributed integer in [0, 2^32) */
+inline uint32_t rng_uint();
+/** uniformly distributed integer in [0, n) */
+inline int rng_int(int n);
+/** uniformly distributed real in [0, range), replaces frand */
+inline double rng_frand(double range);
+/** uniformly distributed point on a sphere of radius rad, replaces sphrand */
+inline Vector3 rng_sphrand(double rad);
+
+#include "rng.inl"
+
+#endif	// RNG_H_
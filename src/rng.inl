@@ -0,0 +1,49 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+extern __thread uint64_t rng_state;
+
+inline uint32_t rng_uint()
+{
+	uint64_t prev = rng_state;
+	rng_state = prev * 6364136223846793005ULL + 1442695040888963407ULL;
+
+	// XSH RR output permutation
+	uint32_t xorshifted = (uint32_t)(((prev >> 18) ^ prev) >> 27);
+	uint32_t rot = (uint32_t)(prev >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+inline int rng_int(int n)
+{
+	return (int)(((uint64_t)rng_uint() * (uint64_t)n) >> 32);
+}
+
+inline double rng_frand(double range)
+{
+	return range * (double)rng_uint() * (1.0 / 4294967296.0);
+}
+
+inline Vector3 rng_sphrand(double rad)
+{
+	double u = rng_frand(1.0);
+	double v = rng_frand(1.0);
+
+	double theta = 2.0 * M_PI * u;
+	double phi = acos(2.0 * v - 1.0);
+	return Vector3(cos(theta) * sin(phi), sin(theta) * sin(phi), cos(phi)) * rad;
+}
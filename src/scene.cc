@@ -19,12 +19,28 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <errno.h>
 #include <float.h>
 #include "scene.h"
+#include "tpool.h"
+#include "rng.h"
 
 using namespace std;
 
+// transformation samples per node over the shutter interval
+#define XFORM_SAMPLES	32
+
+// bounding box keys of moving objects over the shutter interval
+#define MBLUR_SEGMENTS		8
+/* times checked against the interpolated keys are subdivided until the
+ * bounds move less than this fraction of the object's size between them.
+ */
+#define MBLUR_MAX_STEP		0.02
+
+// the bvh is rebuilt instead of refitted, once its SAH cost grows this much
+#define REFIT_MAX_COST		1.5
+
 static Object *load_object(struct xml_node *node);
 static Light *load_light(struct xml_node *node);
 static Camera *load_camera(struct xml_node *node);
+static void calc_motion_bounds(const Object *obj, int t0, int t1, int num_keys, AABox *keys);
 
 static Scene *cur_scene;
 
@@ -51,8 +67,14 @@ Scene::Scene()
 	if(!cur_scene) cur_scene = this;
 
 	valid_octree = false;
+	valid_bvh = false;
+	tree_num_keys = 0;
 
 	gather_dist = 0.001;
+
+	pmap_hash = file_hash = 0;
+	pmap_file = 0;
+	pmap_file_size = 0;
 }
 
 Scene::~Scene()
@@ -66,6 +88,11 @@ Scene::~Scene()
 	for(size_t i=0; i<mat.size(); i++) {
 		delete mat[i];
 	}
+	for(size_t i=0; i<meshes.size(); i++) {
+		delete meshes[i];
+	}
+
+	free_photon_cache();
 
 	if(cur_scene == this) {
 		cur_scene = 0;
@@ -84,6 +111,8 @@ bool Scene::load(const char *fname)
 	bool res = load(fp);
 	if(!res) {
 		fprintf(stderr, "failed to load scene: %s\n", fname);
+	} else {
+		hash_scene_file(fp);
 	}
 
 	fclose(fp);
@@ -94,11 +123,18 @@ bool Scene::load(FILE *fp)
 {
 	struct xml_node *xml, *node;
 
-	if(!(xml = xml_read_tree_file(fp))) {
+	/* the contents of <mesh> elements are handed to the mesh loader while
+	 * parsing, instead of being added to the tree.
+	 */
+	struct xml_stream_handler handlers[2];
+	handlers[0] = mesh_stream_handler;
+	memset(handlers + 1, 0, sizeof handlers[1]);
+
+	if(!(xml = xml_read_tree_stream(fp, handlers))) {
 		return false;
 	}
 
-	// first load all materials to make the material library
+	// first load all materials and meshes to make the libraries
 	node = xml->chld;
 	while(node) {
 		if(strcmp(node->name, "material") == 0) {
@@ -109,6 +145,21 @@ bool Scene::load(FILE *fp)
 			}
 			add_material(mat);
 
+		} else if(strcmp(node->name, "mesh") == 0) {
+			// library meshes are shared by instance objects, so load them first too
+			struct xml_attr *attr = xml_get_attr(node, "name");
+			if(!attr) {
+				fprintf(stderr, "invalid library mesh: no name attribute\n");
+				return false;
+			}
+
+			Mesh *mesh = new Mesh;
+			mesh->set_name(attr->str);
+			if(!mesh->load_mesh_xml(node)) {
+				delete mesh;
+				return false;
+			}
+			add_mesh(mesh);
 		}
 		node = node->next;
 	}
@@ -176,6 +227,7 @@ bool Scene::load(FILE *fp)
 		printf("%d objects\n", (int)objects.size());
 		printf("%d lights\n", (int)lights.size());
 		printf("%d materials\n", (int)mat.size());
+		printf("%d library meshes\n", (int)meshes.size());
 	}
 
 	xml_free_tree(xml);
@@ -186,7 +238,7 @@ bool Scene::load(FILE *fp)
 void Scene::add_object(Object *obj)
 {
 	objects.push_back(obj);
-	valid_octree = false;
+	valid_octree = valid_bvh = false;
 }
 
 Object *Scene::get_object(int idx)
@@ -257,6 +309,21 @@ Material *Scene::get_material(const char *name)
 	return 0;
 }
 
+void Scene::add_mesh(Mesh *mesh)
+{
+	meshes.push_back(mesh);
+}
+
+Mesh *Scene::get_mesh(const char *name)
+{
+	for(size_t i=0; i<meshes.size(); i++) {
+		if(strcmp(name, meshes[i]->get_name()) == 0) {
+			return meshes[i];
+		}
+	}
+	return 0;
+}
+
 void Scene::set_camera(Camera *cam)
 {
 	this->cam = cam;
@@ -356,39 +423,253 @@ bool Scene::build_tree(int t0, int t1)
 		t1 = t0;
 	}
 
-	octree.set_max_depth(opt.scnoct_max_depth);
-	octree.set_max_items_per_node(opt.scnoct_max_items);
+	// bake the transformations over the shutter interval, for the ray lookups
+	for(size_t i=0; i<objects.size(); i++) {
+		objects[i]->sample_xform(t0, t1, XFORM_SAMPLES);
+	}
+	for(size_t i=0; i<lights.size(); i++) {
+		lights[i]->sample_xform(t0, t1, XFORM_SAMPLES);
+	}
+	if(cam) {
+		cam->sample_xform(t0, t1, XFORM_SAMPLES);
+	}
 
-	octree.clear();
+	bool use_bvh = opt.accel == ACCEL_BVH;
+	int num_keys = t1 > t0 ? MBLUR_SEGMENTS + 1 : 1;
+	int num_obj = (int)objects.size();
 
-	for(size_t i=0; i<objects.size(); i++) {
-		AABox start, end, box;
+	/* the tree of the previous frame may be kept as it is if nothing moved,
+	 * or refitted (bvh only), if it was built for the same objects and keys.
+	 */
+	bool keep_tree = (use_bvh ? valid_bvh : valid_octree) && tree_num_keys == num_keys;
+	if(!keep_tree) {
+		tree_keys.resize(num_obj * num_keys);
+		tree_num_keys = num_keys;
+	}
+	if(use_bvh && keep_tree) {
+		bvh.set_motion(t0, t1, num_keys);
+	}
 
-		objects[i]->get_bounds(&start, t0);
-		objects[i]->get_bounds(&end, t1);
+	std::vector<AABox> keys(num_keys);
+	int num_moved = 0;
 
-		box.min.x = MIN(start.min.x, end.min.x);
-		box.min.y = MIN(start.min.y, end.min.y);
-		box.min.z = MIN(start.min.z, end.min.z);
+	for(int i=0; i<num_obj; i++) {
+		if(keep_tree && objects[i]->is_static()) {
+			continue;
+		}
+		calc_motion_bounds(objects[i], t0, t1, num_keys, &keys[0]);
 
-		box.max.x = MAX(start.max.x, end.max.x);
-		box.max.y = MAX(start.max.y, end.max.y);
-		box.max.z = MAX(start.max.z, end.max.z);
+		AABox *okeys = &tree_keys[i * num_keys];
+		if(keep_tree && memcmp(okeys, &keys[0], num_keys * sizeof *okeys) == 0) {
+			continue;
+		}
+		memcpy(okeys, &keys[0], num_keys * sizeof *okeys);
+		num_moved++;
 
-		octree.add(box, objects[i]);
+		if(use_bvh && keep_tree) {
+			bvh.set_item_bounds(i, okeys);
+		}
 	}
 
-	octree.build();
-	valid_octree = true;
+	if(keep_tree && !num_moved) {
+		if(VERBOSE) {
+			printf("nothing moved, keeping the %s\n", use_bvh ? "bvh" : "octree");
+		}
+	} else {
+		double cost = 0.0;
+		if(keep_tree && use_bvh && (cost = bvh.refit()) < REFIT_MAX_COST) {
+			if(VERBOSE) {
+				printf("refitted bvh (%d objects moved), cost: %.2f\n", num_moved, cost);
+			}
+		} else {
+			if(VERBOSE && cost > 0.0) {
+				printf("refitted bvh cost: %.2f, rebuilding\n", cost);
+			}
+			build_tree_from_keys(use_bvh, t0, t1);
+		}
+	}
 
-	const AABox *root_box = &octree.get_root()->box;
+	const AABox *root_box = use_bvh ? &bvh.get_bounds() : &octree.get_bounds();
 	double diag_dist = (root_box->max - root_box->min).length();
 
 	gather_dist = diag_dist * opt.gather_dist;
 
+	if(opt.irrcache > 0.0) {
+		irrcache.clear(*root_box, opt.irrcache);
+	}
+
 	return true;
 }
 
+/* builds the octree or bvh from scratch, with the object bounds in tree_keys */
+void Scene::build_tree_from_keys(bool use_bvh, int t0, int t1)
+{
+	int num_keys = tree_num_keys;
+
+	if(use_bvh) {
+		bvh.set_max_items_per_leaf(opt.bvh_max_items);
+		bvh.clear();
+		bvh.set_motion(t0, t1, num_keys);
+	} else {
+		octree.set_max_depth(opt.scnoct_max_depth);
+		octree.set_max_items_per_node(opt.scnoct_max_items);
+		octree.clear();
+	}
+
+	for(size_t i=0; i<objects.size(); i++) {
+		const AABox *keys = &tree_keys[i * num_keys];
+
+		if(use_bvh) {
+			bvh.add(keys, objects[i]);
+		} else {
+			// the octree only knows of the bounds over the whole interval
+			AABox box = keys[0];
+			for(int j=1; j<num_keys; j++) {
+				box.expand(keys[j]);
+			}
+			octree.add(box, objects[i]);
+		}
+	}
+
+	if(use_bvh) {
+		bvh.build();
+		valid_bvh = true;
+		valid_octree = false;
+	} else {
+		octree.build();
+		valid_octree = true;
+		valid_bvh = false;
+	}
+}
+
+/* grows the two keys on either side of time tm, so that interpolating them
+ * at tm encloses box.
+ */
+static void pad_motion_keys(AABox *keys, int nseg, int t0, int t1, int tm, const AABox &box)
+{
+	double f = (double)(tm - t0) / (double)(t1 - t0) * nseg;
+	int k = MIN((int)f, nseg - 1);
+	f -= k;
+
+	for(int j=0; j<3; j++) {
+		double lerp_min = keys[k].min[j] + (keys[k + 1].min[j] - keys[k].min[j]) * f;
+		if(box.min[j] < lerp_min) {
+			keys[k].min[j] -= lerp_min - box.min[j];
+			keys[k + 1].min[j] -= lerp_min - box.min[j];
+		}
+
+		double lerp_max = keys[k].max[j] + (keys[k + 1].max[j] - keys[k].max[j]) * f;
+		if(box.max[j] > lerp_max) {
+			keys[k].max[j] += box.max[j] - lerp_max;
+			keys[k + 1].max[j] += box.max[j] - lerp_max;
+		}
+	}
+}
+
+static double box_distance(const AABox &a, const AABox &b)
+{
+	double d = 0.0;
+	for(int j=0; j<3; j++) {
+		d = MAX(d, fabs(a.min[j] - b.min[j]));
+		d = MAX(d, fabs(a.max[j] - b.max[j]));
+	}
+	return d;
+}
+
+struct MotionCheck {
+	const Object *obj;
+	int t0, t1, nseg;
+	AABox *keys;
+	double max_step;	// subdivide while the bounds move more than this
+	double slack;		// most the bounds moved between two final checks
+};
+
+/* checks the object against the keys between the already checked times ta and
+ * tb, halving the interval as long as the bounds move too much across it.
+ * Ray times are integers, so there's no point going below 1ms.
+ */
+static void check_motion_rec(MotionCheck *mc, int ta, const AABox &boxa, int tb, const AABox &boxb)
+{
+	if(tb - ta <= 1) {
+		return;
+	}
+
+	double dist = box_distance(boxa, boxb);
+	if(dist <= mc->max_step) {
+		mc->slack = MAX(mc->slack, dist);
+		return;
+	}
+
+	int tm = (ta + tb) / 2;
+	AABox box;
+	mc->obj->get_bounds(&box, tm);
+	pad_motion_keys(mc->keys, mc->nseg, mc->t0, mc->t1, tm, box);
+
+	check_motion_rec(mc, ta, boxa, tm, box);
+	check_motion_rec(mc, tm, box, tb, boxb);
+}
+
+/* calculates the bounds of a moving object at num_keys evenly spaced times
+ * over [t0, t1]. Consecutive keys are padded, so that interpolating linearly
+ * between them (see BVH::set_motion) encloses the object at the times in
+ * between as well. That way objects moving along curved paths or rotating
+ * aren't missed between the keys.
+ *
+ * The number of times checked scales with the motion: they are subdivided
+ * until the bounds move at most MBLUR_MAX_STEP of the object's size between
+ * them, and the keys are padded by the largest such movement left, to cover
+ * the times that aren't checked.
+ */
+static void calc_motion_bounds(const Object *obj, int t0, int t1, int num_keys, AABox *keys)
+{
+	if(num_keys == 1 || obj->is_static()) {
+		obj->get_bounds(keys, t0);
+		for(int i=1; i<num_keys; i++) {
+			keys[i] = keys[0];
+		}
+		return;
+	}
+
+	int nseg = num_keys - 1;
+	double range = (double)(t1 - t0);
+
+	std::vector<AABox> key_bounds(num_keys);
+	std::vector<int> key_times(num_keys);
+
+	for(int i=0; i<num_keys; i++) {
+		key_times[i] = t0 + (int)(range * i / nseg + 0.5);
+		obj->get_bounds(&key_bounds[i], key_times[i]);
+		keys[i] = key_bounds[i];
+	}
+
+	/* the key times are rounded to integers, but the keys are interpolated as
+	 * if they were exactly evenly spaced, so check the key times too.
+	 */
+	for(int i=0; i<num_keys; i++) {
+		pad_motion_keys(keys, nseg, t0, t1, key_times[i], key_bounds[i]);
+	}
+
+	Vector3 size = key_bounds[0].max - key_bounds[0].min;
+
+	MotionCheck mc;
+	mc.obj = obj;
+	mc.t0 = t0;
+	mc.t1 = t1;
+	mc.nseg = nseg;
+	mc.keys = keys;
+	mc.max_step = MAX(MAX(size.x, size.y), size.z) * MBLUR_MAX_STEP;
+	mc.slack = 0.0;
+
+	for(int i=0; i<nseg; i++) {
+		check_motion_rec(&mc, key_times[i], key_bounds[i], key_times[i + 1], key_bounds[i + 1]);
+	}
+
+	for(int i=0; i<num_keys; i++) {
+		keys[i].min -= Vector3(mc.slack, mc.slack, mc.slack);
+		keys[i].max += Vector3(mc.slack, mc.slack, mc.slack);
+	}
+}
+
 #if 0
 bool Scene::build_photon_maps(int t0, int t1)
 {
@@ -442,95 +723,147 @@ bool Scene::build_photon_maps(int t0, int t1)
 }
 #endif
 
-int Scene::build_caustics_map(int t0, int t1, int num_photons, LightPower *ltpow)
+/* photons are shot in batches of this many, one thread pool task each */
+#define PHOTON_BATCH	2048
+
+struct PhotonBatch {
+	const Scene *scn;
+	const Light *lt;
+	bool caustics;
+	int t0, t1;
+	int count;
+	int light, idx;	// seed the random numbers of the batch
+
+	std::vector<Photon> photons;	// the photons stored by this batch
+};
+
+void Scene::photon_batch_proc(void *cls)
+{
+	PhotonBatch *batch = (PhotonBatch*)cls;
+	batch->scn->shoot_photons(batch);
+}
+
+static void photon_batch_done(void *cls)
 {
-	caust_map.clear();
+	if(!QUIET) {
+		putchar('.');
+		fflush(stdout);
+	}
+}
+
+int Scene::build_caustics_map(int t0, int t1, int num_photons, LightPower *ltpow, ThreadPool *tpool)
+{
+	return build_photon_map(&caust_map, true, t0, t1, num_photons, ltpow, tpool);
+}
+
+int Scene::build_global_map(int t0, int t1, int num_photons, LightPower *ltpow, ThreadPool *tpool)
+{
+	int count = build_photon_map(&gi_map, false, t0, t1, num_photons, ltpow, tpool);
+
+	if(opt.precomp_step > 0) {
+		gi_map.precompute_radiance(gather_dist, opt.precomp_step, tpool);
+	}
+	return count;
+}
+
+int Scene::build_photon_map(PhotonMap *map, bool caustics, int t0, int t1, int num_photons,
+		LightPower *ltpow, ThreadPool *tpool)
+{
+	map->clear();
 
 	int stored = 0;
 
 	for(size_t i=0; i<lights.size(); i++) {
 		// calculate the number of photons to cast from this source
 		int nphot = (int)ceil((double)num_photons * ltpow[i].photon_power);
+		if(!nphot) continue;
 
 		if(!QUIET) {
-			printf("light %d caustics photons (%d): ", (int)i, nphot);
+			printf("light %d %s photons (%d): ", (int)i, caustics ? "caustics" : "gi", nphot);
 			fflush(stdout);
 		}
 
-		for(int j=0; j<nphot; j++) {
-			// generate photon
-			int msec = t0 == t1 ? t0 : (rand() % (t1 - t0) + t0);
-			Photon p = lights[i]->gen_photon(msec, SAMPLE_SPEC_OBJ);
+		int num_batches = (nphot + PHOTON_BATCH - 1) / PHOTON_BATCH;
+		PhotonBatch *batches = new PhotonBatch[num_batches];
+		Task *tasks = new Task[num_batches];
+
+		for(int j=0; j<num_batches; j++) {
+			PhotonBatch *batch = batches + j;
+			batch->scn = this;
+			batch->lt = lights[i];
+			batch->caustics = caustics;
+			batch->t0 = t0;
+			batch->t1 = t1;
+			batch->count = j < num_batches - 1 ? PHOTON_BATCH : nphot - j * PHOTON_BATCH;
+			batch->light = (int)i;
+			batch->idx = j;
+
+			tasks[j] = Task(photon_batch_proc, photon_batch_done, batch);
+		}
 
-			Ray ray;
-			ray.origin = p.pos;
-			ray.dir = p.dir;
-			ray.time = msec;
-			ray.iter = opt.iter;	// XXX should I use a different limit for photons?
+		if(tpool) {
+			tpool->add_work(tasks, num_batches);
+			tpool->wait_work();
+		} else {
+			for(int j=0; j<num_batches; j++) {
+				tasks[j].proc(tasks[j].closure);
+				tasks[j].done(tasks[j].closure);
+			}
+		}
 
-			if(trace_caustics_photon(ray, &p) && p.type == CAUST_PHOTON) {
-				caust_map.add_photon(p.pos, p.dir, p.norm, p.col);
-				stored++;
+		/* merge the photons of all batches in order, so the map doesn't depend on
+		 * scheduling, scaling their power before the map quantizes it.
+		 */
+		double scale = 1.0 / (double)nphot;
+		for(int j=0; j<num_batches; j++) {
+			const std::vector<Photon> &phot = batches[j].photons;
 
-				if(!QUIET && (stored & 0xff) == 0) {
-					putchar('.');
-					fflush(stdout);
-				}
+			for(size_t k=0; k<phot.size(); k++) {
+				map->add_photon(phot[k].pos, phot[k].dir, phot[k].norm, phot[k].col * scale);
 			}
+			stored += (int)phot.size();
 		}
 
-		if(!QUIET) putchar('\n');
+		delete [] tasks;
+		delete [] batches;
 
-		if(nphot) caust_map.scale_photon_power(1.0 / (double)nphot);
+		if(!QUIET) putchar('\n');
 	}
 
+	map->balance();
 	return stored;
 }
 
-int Scene::build_global_map(int t0, int t1, int num_photons, LightPower *ltpow)
+// shoots the photons of a batch, keeping the ones that end up in the map
+void Scene::shoot_photons(PhotonBatch *batch) const
 {
-	gi_map.clear();
+	int t0 = batch->t0, t1 = batch->t1;
+	unsigned int sampling = batch->caustics ? SAMPLE_SPEC_OBJ : SAMPLE_OBJ;
 
-	int stored = 0;
-	
-	for(size_t i=0; i<lights.size(); i++) {
-		// calculate the number of photons to cast from this source
-		int nphot = (int)ceil((double)num_photons * ltpow[i].photon_power);
-
-		if(!QUIET) {
-			printf("light %d gi photons (%d): ", (int)i, nphot);
-			fflush(stdout);
-		}
+	rng_seed(batch->caustics ? RNG_CAUST_PHOTON : RNG_GI_PHOTON, t0, batch->light, batch->idx);
 
-		for(int j=0; j<nphot; j++) {
-			// generate photon
-			int msec = t0 == t1 ? t0 : (rand() % (t1 - t0) + t0);
-			Photon p = lights[i]->gen_photon(msec, SAMPLE_OBJ);
+	for(int i=0; i<batch->count; i++) {
+		// generate photon
+		int msec = t0 == t1 ? t0 : (rng_int(t1 - t0) + t0);
+		Photon p = batch->lt->gen_photon(msec, sampling);
 
-			Ray ray;
-			ray.origin = p.pos;
-			ray.dir = p.dir;
-			ray.time = msec;
-			ray.iter = opt.iter;	// XXX should I use a different limit for photons?
+		Ray ray;
+		ray.origin = p.pos;
+		ray.dir = p.dir;
+		ray.time = msec;
+		ray.iter = opt.iter;	// XXX should I use a different limit for photons?
 
+		if(batch->caustics) {
+			if(trace_caustics_photon(ray, &p) && p.type == CAUST_PHOTON) {
+				batch->photons.push_back(p);
+			}
+		} else {
 			// include all photons in the global photon map
 			if(trace_global_photon(ray, &p)) {
-				gi_map.add_photon(p.pos, p.dir, p.norm, p.col);
-				stored++;
-
-				if(!QUIET && (stored & 0xff) == 0) {
-					putchar('.');
-					fflush(stdout);
-				}
+				batch->photons.push_back(p);
 			}
 		}
-
-		if(!QUIET) putchar('\n');
-
-		if(nphot) gi_map.scale_photon_power(1.0 / (double)nphot);
 	}
-
-	return stored;
 }
 
 Octree<Object*> *Scene::get_octree()
@@ -538,6 +871,11 @@ Octree<Object*> *Scene::get_octree()
 	return &octree;
 }
 
+BVH<Object*> *Scene::get_bvh()
+{
+	return &bvh;
+}
+
 PhotonMap *Scene::get_caust_map()
 {
 	return &caust_map;
@@ -548,12 +886,38 @@ PhotonMap *Scene::get_gi_map()
 	return &gi_map;
 }
 
-Color Scene::trace_ray(const Ray &ray) const
+IrrCache *Scene::get_irrcache()
+{
+	return &irrcache;
+}
+
+Color Scene::trace_ray(const Ray &ray, double *dist) const
 {
 	SurfPoint sp;
-	Object *obj;
+	Object *obj = cast_ray(ray, &sp);
+
+	if(dist) {
+		*dist = obj ? (sp.pos - ray.origin).length() : -1.0;
+	}
+
+	return shade_hit(ray, obj, sp);
+}
 
-	if((obj = cast_ray(ray, &sp))) {
+void Scene::trace_packet(const RayPacket &pkt, Color *col) const
+{
+	SurfPoint sp[RAY_PACKET_SIZE];
+	Object *obj[RAY_PACKET_SIZE];
+
+	cast_packet(pkt, sp, obj);
+
+	for(int i=0; i<pkt.count; i++) {
+		col[i] = shade_hit(pkt.ray[i], obj[i], sp[i]);
+	}
+}
+
+Color Scene::shade_hit(const Ray &ray, Object *obj, const SurfPoint &sp) const
+{
+	if(obj) {
 		Color color;
 		Material *mat = obj->get_material();
 
@@ -613,7 +977,7 @@ bool Scene::trace_caustics_photon(const Ray &inray, Photon *phot) const
 		refr = (1.0 - fres) * refr;
 
 		double range = 1.0;//MAX(refl + refr, 1.0);
-		double rnum = frand(range);
+		double rnum = rng_frand(range);
 
 		if(rnum < refl) {
 			// reflect photon
@@ -681,11 +1045,11 @@ bool Scene::trace_global_photon(const Ray &inray, Photon *phot) const
 		double spec_avg = (spec.x + spec.y + spec.z) / 3.0;
 
 		double range = 1.0;
-		double rnum = frand(range);
+		double rnum = rng_frand(range);
 
 		if(rnum < diff_avg) {
 			// diffusely reflect photon
-			Vector3 dir = sphrand(1.0);
+			Vector3 dir = rng_sphrand(1.0);
 			// make sure we're on the correct hemisphere
 			if(dot_product(dir, normal) < 0.0) {
 				dir = -dir;
@@ -720,7 +1084,7 @@ bool Scene::trace_global_photon(const Ray &inray, Photon *phot) const
 			refr = (1.0 - fres) * refr;
 
 			// decide on the kind of specular interaction using another random variable
-			double rnum = frand(1.0);
+			double rnum = rng_frand(1.0);
 			if(rnum < refl) {
 				// reflect photon
 				Ray ray = reflect_ray(inray, normal);
@@ -763,6 +1127,10 @@ bool Scene::trace_global_photon(const Ray &inray, Photon *phot) const
 
 Object *Scene::cast_ray(const Ray &ray, SurfPoint *sp_ret) const
 {
+	if(valid_bvh) {
+		const BVHItem<Object*> *item = bvh.intersect(ray, sp_ret);
+		return item ? item->data : 0;
+	}
 	if(valid_octree) {
 		OctItem<Object*> *item = octree.intersect(ray, sp_ret);
 		return item ? item->data : 0;
@@ -793,6 +1161,49 @@ Object *Scene::cast_ray(const Ray &ray, SurfPoint *sp_ret) const
 	return obj0;
 }
 
+void Scene::cast_packet(const RayPacket &pkt, SurfPoint *sp, Object **obj) const
+{
+	if(valid_bvh) {
+		const BVHItem<Object*> *item[RAY_PACKET_SIZE];
+		bvh.intersect(pkt, sp, item);
+
+		for(int i=0; i<pkt.count; i++) {
+			obj[i] = item[i] ? item[i]->data : 0;
+		}
+		return;
+	}
+	if(valid_octree) {
+		OctItem<Object*> *item[RAY_PACKET_SIZE];
+		octree.intersect(pkt, sp, item);
+
+		for(int i=0; i<pkt.count; i++) {
+			obj[i] = item[i] ? item[i]->data : 0;
+		}
+		return;
+	}
+
+	for(int i=0; i<pkt.count; i++) {
+		obj[i] = cast_ray(pkt.ray[i], sp + i);
+	}
+}
+
+bool Scene::occluded(const Ray &ray) const
+{
+	if(valid_bvh) {
+		return bvh.occluded(ray);
+	}
+	if(valid_octree) {
+		return octree.occluded(ray);
+	}
+
+	for(size_t i=0; i<objects.size(); i++) {
+		if(objects[i]->occluded(ray)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 
 static Object *load_object(struct xml_node *node)
 {
@@ -20,14 +20,21 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <vector>
 #include <limits.h>
+#include <stdint.h>
 #include "object.h"
 #include "light.h"
 #include "camera.h"
 #include "material.h"
+#include "mesh.h"
 #include "octree.h"
+#include "bvh.h"
+#include "raypacket.h"
 #include "pmap.h"
+#include "irrcache.h"
 
 class Scene;
+class ThreadPool;
+struct PhotonBatch;
 
 void set_scene(Scene *scn);
 Scene *get_scene();
@@ -42,6 +49,9 @@ private:
 	static Material default_mat;
 	std::vector<Material*> mat;
 
+	// library of meshes shared by instance objects
+	std::vector<Mesh*> meshes;
+
 	double env_ior;
 	Color env_color;
 	Color env_ambient;
@@ -49,10 +59,41 @@ private:
 	bool valid_octree;
 	Octree<Object*> octree;
 
+	bool valid_bvh;
+	BVH<Object*> bvh;
+
+	// object bounds the tree was last built or refitted with, see build_tree
+	std::vector<AABox> tree_keys;
+	int tree_num_keys;
+
 	PhotonMap caust_map, gi_map;
 	double gather_dist;
 
+	// hash of everything the photon maps depend on, when they were built
+	uint64_t pmap_hash;
+	// hash of the scene file, 0 if it wasn't loaded from a file
+	uint64_t file_hash;
+	// photon cache file the maps point into, see restore_photon_maps
+	void *pmap_file;
+	size_t pmap_file_size;
+
+	IrrCache irrcache;
+
 	bool trace_caustics_photon(const Ray &ray, Photon *phot) const;
+	int build_photon_map(PhotonMap *map, bool caustics, int t0, int t1, int num_photons,
+			LightPower *ltpow, ThreadPool *tpool);
+	void shoot_photons(PhotonBatch *batch) const;
+	static void photon_batch_proc(void *cls);
+
+	void build_tree_from_keys(bool use_bvh, int t0, int t1);
+
+	void hash_scene_file(FILE *fp);
+	uint64_t photon_hash(int t0, int t1) const;
+	bool load_photon_cache(const char *dir, uint64_t hash);
+	bool save_photon_cache(const char *dir, uint64_t hash, int t0, int t1) const;
+	void free_photon_cache();
+
+	Color shade_hit(const Ray &ray, Object *obj, const SurfPoint &sp) const;
 	bool trace_global_photon(const Ray &ray, Photon *phot) const;
 
 public:
@@ -79,6 +120,9 @@ public:
 
 	Material *get_material(const char *name);
 
+	void add_mesh(Mesh *mesh);
+	Mesh *get_mesh(const char *name);
+
 	void set_camera(Camera *cam);
 	const Camera *get_camera() const;
 	Camera *get_camera();
@@ -102,8 +146,8 @@ public:
 
 	double get_gather_dist() const;
 
-	/** build_tree creates the octree which is used to accelerate intersection
-	 * tests.
+	/** build_tree creates the acceleration structure (octree or bvh, depending
+	 * on opt.accel) which is used to accelerate intersection tests.
 	 *
 	 * Arguments t0 and t1 specify the time interval in which we're interested
 	 * in. The tree is supposed to be rebuild for each frame, and this interval
@@ -117,16 +161,56 @@ public:
 
 	//bool build_photon_maps(int t0 = 0, int t1 = INT_MIN);
 	
-	int build_caustics_map(int t0, int t1, int num_photons, LightPower *ltpow);
-	int build_global_map(int t0, int t1, int num_photons, LightPower *ltpow);
+	/** build the photon maps, shooting the photons of each light in batches
+	 * on the worker threads of tpool, or on this thread if tpool is null.
+	 * The global map also gets its radiance precomputed, if opt.precomp_step
+	 * is set.
+	 * \return the number of photons stored.
+	 */
+	int build_caustics_map(int t0, int t1, int num_photons, LightPower *ltpow, ThreadPool *tpool = 0);
+	int build_global_map(int t0, int t1, int num_photons, LightPower *ltpow, ThreadPool *tpool = 0);
+
+	/** reuses the photon maps of the previous frame, or loads them from the
+	 * photon cache (opt.photoncache), if nothing they depend on changed
+	 * since they were built. Returns false if they have to be built.
+	 */
+	bool restore_photon_maps(int t0, int t1, ThreadPool *tpool = 0);
+
+	/** must be called after building the photon maps, to record what they
+	 * were built for, and to save them in the photon cache if enabled.
+	 */
+	void save_photon_maps(int t0, int t1);
 
 	Octree<Object*> *get_octree();
+	BVH<Object*> *get_bvh();
 	PhotonMap *get_caust_map();
 	PhotonMap *get_gi_map();
 
-	Color trace_ray(const Ray &ray) const;
+	/** the irradiance cache is cleared by build_tree, if opt.irrcache is set */
+	IrrCache *get_irrcache();
+
+	/** if dist is not null, it's set to the distance of the nearest hit,
+	 * or to -1 if the ray didn't hit anything.
+	 */
+	Color trace_ray(const Ray &ray, double *dist = 0) const;
+
+	/** traces a packet of coherent rays through the scene together, and
+	 * returns the color for each one in the col array.
+	 */
+	void trace_packet(const RayPacket &pkt, Color *col) const;
 
 	Object *cast_ray(const Ray &ray, SurfPoint *sp = 0) const;
+
+	/** packet version of cast_ray: obj[i] is set to the nearest object hit
+	 * by the i-th ray of the packet (or null), and sp[i] is filled in.
+	 */
+	void cast_packet(const RayPacket &pkt, SurfPoint *sp, Object **obj) const;
+
+	/** returns true if anything in the scene blocks the ray. Cheaper than
+	 * cast_ray, as it stops at the first hit it finds and never computes
+	 * surface properties, so use this for shadow rays.
+	 */
+	bool occluded(const Ray &ray) const;
 };
 
 #endif	// SCENE_H_
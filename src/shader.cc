@@ -21,9 +21,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "object.h"
 #include "material.h"
 #include "scene.h"
+#include "rng.h"
+#include "irrcache.h"
 
 static void calc_lighting(Color *diff, Color *spec, const Scene *scn, const Light *lt,
 		double shininess, const Vector3 &pt, const Vector3 &norm, const Vector3 &vdir, int tm);
+static void calc_irradiance(IrrRecord *rec, const Scene *scn, const Ray &ray,
+		const Vector3 &pt, const Vector3 &norm);
 
 ShaderFunc get_shader(const char *sdrname)
 {
@@ -57,7 +61,7 @@ Color shade_undef(const Ray &ray, const SurfPoint &sp, const Material *mat)
 		Vector3 vdir = -ray.dir.normalized();
 		Vector3 hdir = (ldir + vdir).normalized();
 
-		if(!scn->cast_ray(shadow_ray)) {
+		if(!scn->occluded(shadow_ray)) {
 			double ndotl = std::max<double>(dot_product(sp.normal, ldir), 0.0);
 			double ndoth = std::max<double>(dot_product(sp.normal, hdir), 0.0);
 			double att = lt->calc_attenuation(ldist);
@@ -118,7 +122,7 @@ Color shade_phong(const Ray &ray, const SurfPoint &sp, const Material *mat)
 	 */
 	if(IS_DIFFUSE_RAY(ray)) {
 		PhotonMap *gi_map = scn->get_gi_map();
-		Color rad = gi_map->radiance_est(sp.pos, normal, incident, scn->get_gather_dist());
+		Color rad = gi_map->precomp_radiance_est(sp.pos, normal, incident, scn->get_gather_dist());
 		return rad * kd;
 	}
 	
@@ -155,16 +159,30 @@ Color shade_phong(const Ray &ray, const SurfPoint &sp, const Material *mat)
 
 	// Global illumination: diffuse hemisphere sampling
 	Color gi;
-	if(opt.gi_photons) {
+	if(opt.gi_photons && opt.irrcache > 0.0) {
+		// rays too weak to spawn any diffuse rays get no gi, as below
+		if(ray.energy > opt.min_energy) {
+			// interpolate from the irradiance cache, or sample and add a new record
+			IrrCache *cache = scn->get_irrcache();
+
+			if(!cache->lookup(sp.pos, normal, &gi)) {
+				IrrRecord rec;
+				calc_irradiance(&rec, scn, ray, sp.pos, normal);
+				cache->add(rec);
+				gi = rec.irrad;
+			}
+		}
+	} else if(opt.gi_photons) {
 		for(int i=0; i<opt.diffuse_samples; i++) {
 			double ndotl;
 
 			/* TODO instead of randomly sampling the hemisphere, use the global
 			 * photon map to do importance sampling.
 			 */
-			Vector3 dir = sphrand(1.0);
+			Vector3 dir = rng_sphrand(1.0);
 			if((ndotl = dot_product(dir, normal)) < 0.0) {
 				dir = -dir;
+				ndotl = -ndotl;
 			}
 
 			double diff_energy = ndotl * ray.energy;
@@ -246,6 +264,119 @@ Color shade_phong(const Ray &ray, const SurfPoint &sp, const Material *mat)
 	return (diff + gi) * kd + (spec + reflrefr) * ks + irrad;
 }
 
+/** calculate the indirect irradiance at a point, for the irradiance cache, by
+ * sampling the hemisphere in (theta, phi) strata, and its rotational and
+ * translational gradients from the same samples (Ward & Heckbert 92).
+ * Scaled like the gi term of shade_phong, which is irradiance / 2pi.
+ */
+static void calc_irradiance(IrrRecord *rec, const Scene *scn, const Ray &ray,
+		const Vector3 &pt, const Vector3 &norm)
+{
+	// M x N strata, with N = pi * M, at least 8 samples
+	int num_theta = (int)(sqrt(opt.diffuse_samples / M_PI) + 0.5);
+	if(num_theta < 2) num_theta = 2;
+	int num_phi = opt.diffuse_samples / num_theta;
+	if(num_phi < 4) num_phi = 4;
+	int num = num_theta * num_phi;
+
+	// local frame around the normal
+	Vector3 udir = cross_product(norm, fabs(norm.x) < 0.6 ? Vector3(1, 0, 0) : Vector3(0, 1, 0)).normalized();
+	Vector3 vdir = cross_product(norm, udir);
+
+	double ray_mag = ray.dir.length();
+
+	std::vector<Color> rad(num);
+	std::vector<double> dist(num);
+
+	Color sum;
+	double inv_dist_sum = 0.0;
+
+	rec->pos = pt;
+	rec->norm = norm;
+	for(int i=0; i<3; i++) {
+		rec->rot_grad[i] = rec->trans_grad[i] = Vector3(0, 0, 0);
+	}
+
+	for(int j=0; j<num_theta; j++) {
+		for(int k=0; k<num_phi; k++) {
+			// cosine weighted within each stratum
+			double sin_theta = sqrt((j + rng_frand(1.0)) / num_theta);
+			double cos_theta = sqrt(1.0 - sin_theta * sin_theta);
+			double phi = 2.0 * M_PI * (k + rng_frand(1.0)) / num_phi;
+
+			Vector3 pdir = udir * cos(phi) + vdir * sin(phi);
+			Vector3 dir = pdir * sin_theta + norm * cos_theta;
+
+			Ray diff_ray = ray;
+			DIFFUSE_RAY(diff_ray);
+			diff_ray.energy = cos_theta * ray.energy;
+			diff_ray.origin = pt;
+			diff_ray.dir = dir * ray_mag;
+
+			int idx = j * num_phi + k;
+			double d;
+			rad[idx] = scn->trace_ray(diff_ray, &d);
+			dist[idx] = d > 0.0 ? d : HUGE_VAL;
+
+			sum += rad[idx];
+			if(d > 0.0) {
+				inv_dist_sum += 1.0 / d;
+			}
+
+			// rotational gradient: towards increasing phi
+			if(cos_theta > 1e-6) {
+				Vector3 tdir = vdir * cos(phi) - udir * sin(phi);
+				double tan_theta = sin_theta / cos_theta;
+				for(int c=0; c<3; c++) {
+					rec->rot_grad[c] += tdir * (tan_theta * rad[idx][c]);
+				}
+			}
+		}
+	}
+
+	// translational gradient: change across the boundaries between the strata
+	for(int k=0; k<num_phi; k++) {
+		double phi = 2.0 * M_PI * (k + 0.5) / num_phi;
+		double phi_min = 2.0 * M_PI * k / num_phi;
+		Vector3 pdir = udir * cos(phi) + vdir * sin(phi);
+		Vector3 tdir = vdir * cos(phi_min) - udir * sin(phi_min);
+
+		for(int j=1; j<num_theta; j++) {
+			int idx = j * num_phi + k;
+			int prev = idx - num_phi;
+
+			double sin_sq = (double)j / num_theta;
+			double fact = 2.0 * M_PI / num_phi * sqrt(sin_sq) * (1.0 - sin_sq) / std::min(dist[idx], dist[prev]);
+			for(int c=0; c<3; c++) {
+				rec->trans_grad[c] += pdir * (fact * (rad[idx][c] - rad[prev][c]));
+			}
+		}
+
+		for(int j=0; j<num_theta; j++) {
+			int idx = j * num_phi + k;
+			int prev = j * num_phi + (k + num_phi - 1) % num_phi;
+
+			double fact = (sqrt((j + 1.0) / num_theta) - sqrt((double)j / num_theta)) / std::min(dist[idx], dist[prev]);
+			for(int c=0; c<3; c++) {
+				rec->trans_grad[c] += tdir * (fact * (rad[idx][c] - rad[prev][c]));
+			}
+		}
+	}
+
+	/* irradiance is pi / num times the sum of the radiance samples, and gi
+	 * is that over 2pi.
+	 */
+	double scale = 1.0 / (2.0 * num);
+	rec->irrad = sum * scale;
+	rec->irrad.w = 0.0;
+	for(int c=0; c<3; c++) {
+		rec->rot_grad[c] *= scale;
+		rec->trans_grad[c] *= 1.0 / (2.0 * M_PI);
+	}
+
+	rec->dist = inv_dist_sum > 0.0 ? num / inv_dist_sum : HUGE_VAL;
+}
+
 /** calculate direct lighting, using the phong reflectance model */
 static void calc_lighting(Color *diff, Color *spec, const Scene *scn, const Light *lt, double shininess,
 		const Vector3 &pt, const Vector3 &norm, const Vector3 &vdir, int tm)
@@ -263,7 +394,7 @@ static void calc_lighting(Color *diff, Color *spec, const Scene *scn, const Ligh
 		shadow_ray.time = tm;
 		ldir /= ldist;
 
-		if(!scn->cast_ray(shadow_ray)) {
+		if(!scn->occluded(shadow_ray)) {
 			Vector3 vref = vdir.reflection(norm);
 			double ndotl = std::max<double>(dot_product(norm, ldir), 0.0);
 			double rdotl = std::max<double>(dot_product(vref, ldir), 0.0);
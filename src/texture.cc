@@ -15,13 +15,16 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <stdio.h>
 #include "texture.h"
 #include "datapath.h"
+#include "mapfile.h"
 
 Texture::Texture()
 {
 	filter = TEX_FILTER_LINEAR;
 	wrap = TEX_WRAP_REPEAT;
+	file_hash = 0;
 }
 
 bool Texture::load(const char *name)
@@ -32,7 +35,22 @@ bool Texture::load(const char *name)
 		return false;
 	}
 
-	return img.load(path);
+	if(!img.load(path)) {
+		return false;
+	}
+
+	// the photon cache must not outlive changes to the image file
+	FILE *fp;
+	if((fp = fopen(path, "rb"))) {
+		file_hash = hash_file(HASH_INIT, fp);
+		fclose(fp);
+	}
+	return true;
+}
+
+uint64_t Texture::get_file_hash() const
+{
+	return file_hash;
 }
 
 void Texture::set_filtering(TexFilter filter)
@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef TEXTURE_H_
 #define TEXTURE_H_
 
+#include <stdint.h>
 #include "img.h"
 #include "anim.h"
 
@@ -39,6 +40,7 @@ private:
 	Image img;
 	TexFilter filter;
 	TexWrap wrap;
+	uint64_t file_hash;
 
 	Color get_texel(int tx, int ty) const;
 
@@ -46,6 +48,10 @@ public:
 	Texture();
 
 	bool load(const char *name);
+	/** returns a hash of the contents of the image file the texture was
+	 * loaded from, or 0 if it wasn't.
+	 */
+	uint64_t get_file_hash() const;
 
 	void set_filtering(TexFilter filter);
 	TexFilter get_filtering() const;
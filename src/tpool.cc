@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
 #include "tpool.h"
 #include "timer.h"
 
@@ -19,20 +20,172 @@ Task::Task(void (*proc)(void*), void (*done)(void*), void *cls)
 struct ThreadData {
 	ThreadPool *tpool;
 	int tid;
+	int index;
 };
 
+// the pool and index of the worker running on this thread, if any
+static __thread ThreadPool *cur_pool;
+static __thread int cur_tid;
+
+__thread int tpool_thread_index;
+static int next_thread_index = 1;	// index 0 is for non-worker threads
+
+
+// ---- work-stealing deque ----
+
+struct TaskArray {
+	long size;	// power of two
+	Task **task;
+};
+
+/* Chase-Lev work-stealing deque of task pointers. The owner thread pushes
+ * and takes tasks at the bottom, any other thread may steal from the top.
+ * Only steals and taking the last task synchronize, through a CAS on top.
+ * See: "Correct and Efficient Work-Stealing for Weak Memory Models",
+ * N. M. Le, A. Pop, A. Cohen, F. Zappa Nardelli, PPoPP 2013.
+ */
+class TaskDeque {
+private:
+	long top, bottom;
+	TaskArray *array;
+	std::vector<TaskArray*> old_arrays;	// may still be read by thieves
+
+	TaskArray *grow(TaskArray *a, long b, long t);
+
+	// keep the deques of different workers off each other's cache lines
+	char pad[64];
+
+public:
+	TaskDeque();
+	~TaskDeque();
+
+	void push(Task *task);	// owner only
+	Task *take();			// owner only
+	Task *steal();			// any thread, returns 0 if empty or contended
+	bool empty() const;
+};
+
+static TaskArray *create_task_array(long size)
+{
+	TaskArray *a = new TaskArray;
+	a->size = size;
+	a->task = new Task*[size];
+	return a;
+}
+
+static void free_task_array(TaskArray *a)
+{
+	delete [] a->task;
+	delete a;
+}
+
+TaskDeque::TaskDeque()
+{
+	top = bottom = 0;
+	array = create_task_array(64);
+}
+
+TaskDeque::~TaskDeque()
+{
+	free_task_array(array);
+	for(size_t i=0; i<old_arrays.size(); i++) {
+		free_task_array(old_arrays[i]);
+	}
+}
+
+TaskArray *TaskDeque::grow(TaskArray *a, long b, long t)
+{
+	TaskArray *na = create_task_array(a->size * 2);
+	for(long i=t; i<b; i++) {
+		na->task[i & (na->size - 1)] = a->task[i & (a->size - 1)];
+	}
+	old_arrays.push_back(a);
+
+	__atomic_store_n(&array, na, __ATOMIC_RELEASE);
+	return na;
+}
+
+void TaskDeque::push(Task *task)
+{
+	long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+	TaskArray *a = __atomic_load_n(&array, __ATOMIC_RELAXED);
+
+	if(b - t > a->size - 1) {
+		a = grow(a, b, t);
+	}
+	__atomic_store_n(a->task + (b & (a->size - 1)), task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+Task *TaskDeque::take()
+{
+	long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+	TaskArray *a = __atomic_load_n(&array, __ATOMIC_RELAXED);
+	__atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+
+	if(t > b) {
+		// empty
+		__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	Task *task = __atomic_load_n(a->task + (b & (a->size - 1)), __ATOMIC_RELAXED);
+	if(t == b) {
+		// last one, race against the thieves for it
+		if(!__atomic_compare_exchange_n(&top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			task = 0;
+		}
+		__atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+Task *TaskDeque::steal()
+{
+	long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+
+	if(t >= b) {
+		return 0;
+	}
+
+	TaskArray *a = __atomic_load_n(&array, __ATOMIC_ACQUIRE);
+	Task *task = __atomic_load_n(a->task + (t & (a->size - 1)), __ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return 0;	// lost the race to another thief, or the owner
+	}
+	return task;
+}
+
+bool TaskDeque::empty() const
+{
+	long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+	long b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+	return t >= b;
+}
+
 
 // ---- thread pool class ----
 ThreadPool::ThreadPool()
 {
 	num_tasks = 0;
+	deques = 0;
+	threads = 0;
+	stats = 0;
+	num_threads = 0;
+
+	pthread_mutex_init(&injectq_mutex, 0);
 
 	pthread_cond_init(&work_pending_cond, 0);
 	pthread_mutex_init(&work_pending_mutex, 0);
 
 	work_left = 0;
 	pthread_cond_init(&done_cond, 0);
-	//pthread_mutex_init(&done_mutex, 0);
 
 	// start the timer if we haven't done so already to avoid getting 0 msec later on
 	get_msec();
@@ -55,6 +208,7 @@ bool ThreadPool::start(int num_threads)
 
 	threads = new pthread_t[num_threads];
 	stats = new ThreadStats[num_threads];
+	deques = new TaskDeque[num_threads];
 	this->num_threads = num_threads;
 
 	memset(stats, 0, num_threads * sizeof *stats);
@@ -63,6 +217,7 @@ bool ThreadPool::start(int num_threads)
 		ThreadData *data = new ThreadData;
 		data->tpool = this;
 		data->tid = i;
+		data->index = __atomic_fetch_add(&next_thread_index, 1, __ATOMIC_RELAXED);
 
 		int res = pthread_create(&threads[i], 0, worker_thread_func, data);
 		if(res != 0) {
@@ -75,7 +230,10 @@ bool ThreadPool::start(int num_threads)
 
 void ThreadPool::stop()
 {
+	pthread_mutex_lock(&work_pending_mutex);
 	stopping = true;
+	pthread_mutex_unlock(&work_pending_mutex);
+
 	clear_work();
 	pthread_cond_broadcast(&work_pending_cond);	// just to wake them up
 
@@ -94,9 +252,13 @@ void ThreadPool::stop()
 
 	delete [] threads;
 	delete [] stats;
+	delete [] deques;
 	threads = 0;
 	stats = 0;
+	deques = 0;
 	num_threads = 0;
+
+	free_task_blocks();
 }
 
 /* inlined and moved to tpool.h
@@ -115,15 +277,42 @@ bool ThreadPool::add_work(const Task *tasks, int count)
 {
 	if(!count) return false;
 
-	pthread_mutex_lock(&work_pending_mutex);
-	num_tasks += count;
-	work_left += count;
+	bool from_worker = cur_pool == this;
 
+	// nothing is queued or running, so the storage of past tasks can go
+	if(!from_worker && is_done()) {
+		free_task_blocks();
+	}
+
+	Task *block = new Task[count];
 	for(int i=0; i<count; i++) {
-		workq.push(tasks[i]);
+		block[i] = tasks[i];
+	}
+
+	// count them before they become visible, so the counters never go negative
+	__atomic_add_fetch(&work_left, count, __ATOMIC_ACQ_REL);
+	__atomic_add_fetch(&num_tasks, count, __ATOMIC_ACQ_REL);
+
+	if(from_worker) {
+		pthread_mutex_lock(&injectq_mutex);
+		task_blocks.push_back(block);
+		pthread_mutex_unlock(&injectq_mutex);
+
+		// in reverse, so that we take them in order
+		for(int i=count-1; i>=0; i--) {
+			deques[cur_tid].push(block + i);
+		}
+	} else {
+		pthread_mutex_lock(&injectq_mutex);
+		task_blocks.push_back(block);
+		for(int i=0; i<count; i++) {
+			injectq.push_back(block + i);
+		}
+		pthread_mutex_unlock(&injectq_mutex);
 	}
 
 	// wake up all worker threads
+	pthread_mutex_lock(&work_pending_mutex);
 	pthread_cond_broadcast(&work_pending_cond);
 	pthread_mutex_unlock(&work_pending_mutex);
 
@@ -132,26 +321,45 @@ bool ThreadPool::add_work(const Task *tasks, int count)
 
 void ThreadPool::clear_work()
 {
-	pthread_mutex_lock(&work_pending_mutex);
+	int count = 0;
+
+	pthread_mutex_lock(&injectq_mutex);
+	count += (int)injectq.size();
+	injectq.clear();
+	pthread_mutex_unlock(&injectq_mutex);
 
-	while(!workq.empty()) {
-		workq.pop();
+	// any thread may steal, so drain the worker deques from the top
+	for(int i=0; i<num_threads; i++) {
+		while(!deques[i].empty()) {
+			if(deques[i].steal()) {
+				count++;
+			}
+		}
+	}
+
+	if(count) {
+		__atomic_sub_fetch(&num_tasks, count, __ATOMIC_ACQ_REL);
+
+		pthread_mutex_lock(&work_pending_mutex);
+		if(__atomic_sub_fetch(&work_left, count, __ATOMIC_ACQ_REL) <= 0) {
+			pthread_cond_broadcast(&done_cond);
+		}
+		pthread_mutex_unlock(&work_pending_mutex);
 	}
-	
-	work_left -= num_tasks;
-	num_tasks = 0;
-	
-	pthread_mutex_unlock(&work_pending_mutex);
 }
 
 // waits for all the work to be completed
 void ThreadPool::wait_work()
 {
 	pthread_mutex_lock(&work_pending_mutex);
-	while(work_left > 0) {
+	while(__atomic_load_n(&work_left, __ATOMIC_ACQUIRE) > 0) {
 		pthread_cond_wait(&done_cond, &work_pending_mutex);
 	}
 	pthread_mutex_unlock(&work_pending_mutex);
+
+	if(cur_pool != this) {
+		free_task_blocks();
+	}
 }
 
 /* inlined and moved to tpool.h
@@ -161,6 +369,60 @@ bool ThreadPool::is_done() const
 }
 */
 
+void ThreadPool::free_task_blocks()
+{
+	pthread_mutex_lock(&injectq_mutex);
+	for(size_t i=0; i<task_blocks.size(); i++) {
+		delete [] task_blocks[i];
+	}
+	task_blocks.clear();
+	pthread_mutex_unlock(&injectq_mutex);
+}
+
+/* finds a task for worker tid: first from its own deque, then from the
+ * injection queue, and then by stealing from the other workers.
+ */
+Task *ThreadPool::get_task(int tid)
+{
+	Task *task;
+
+	if((task = deques[tid].take())) {
+		return task;
+	}
+
+	pthread_mutex_lock(&injectq_mutex);
+	if(!injectq.empty()) {
+		task = injectq.front();
+		injectq.pop_front();
+
+		// grab our share of the rest, to keep the others from waiting on the lock
+		int count = (int)injectq.size() / num_threads;
+
+		// in reverse, so that we take them in order
+		for(int i=count-1; i>=0; i--) {
+			deques[tid].push(injectq[i]);
+		}
+		injectq.erase(injectq.begin(), injectq.begin() + count);
+	}
+	pthread_mutex_unlock(&injectq_mutex);
+
+	if(task) {
+		return task;
+	}
+
+	// start from a different victim every time, to spread the thieves around
+	static __thread unsigned int seed;
+	seed = seed * 1103515245 + 12345 + tid;
+
+	for(int i=0; i<num_threads; i++) {
+		int victim = (seed / 65536 + i) % num_threads;
+		if(victim != tid && (task = deques[victim].steal())) {
+			return task;
+		}
+	}
+	return 0;
+}
+
 // this is called by the worker thread when a task is finished
 void ThreadPool::finish_task(const Task &task)
 {
@@ -169,11 +431,11 @@ void ThreadPool::finish_task(const Task &task)
 		task.done(task.closure);
 	}
 
-	pthread_mutex_lock(&work_pending_mutex);
-	if(!--work_left) {
-		pthread_cond_signal(&done_cond);
+	if(!__atomic_sub_fetch(&work_left, 1, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_lock(&work_pending_mutex);
+		pthread_cond_broadcast(&done_cond);
+		pthread_mutex_unlock(&work_pending_mutex);
 	}
-	pthread_mutex_unlock(&work_pending_mutex);
 }
 
 // this is the function all working threads are running
@@ -182,34 +444,38 @@ void *worker_thread_func(void *arg)
 	int tid = ((ThreadData*)arg)->tid;
 	ThreadPool *tpool = ((ThreadData*)arg)->tpool;
 
+	cur_pool = tpool;
+	cur_tid = tid;
+	tpool_thread_index = ((ThreadData*)arg)->index;
+
 	tpool->stats[tid].start_time = get_msec();
 
 	while(!tpool->stopping) {
 		unsigned long msec = get_msec();
 
-		pthread_mutex_lock(&tpool->work_pending_mutex);
-		if(tpool->num_tasks) {
+		Task *task;
+		if((task = tpool->get_task(tid))) {
 			// there's work to be done, grab a task and do it...
-			Task task = tpool->workq.front();
-			tpool->workq.pop();
-			tpool->num_tasks--;
-
+			__atomic_sub_fetch(&tpool->num_tasks, 1, __ATOMIC_ACQ_REL);
 			tpool->stats[tid].tasks++;
-			pthread_mutex_unlock(&tpool->work_pending_mutex);
-
 
 			tpool->stats[tid].proc_start = msec;
-			
-			task.proc(task.closure);
-			tpool->finish_task(task);	// this will call the done callback if avail.
-			
+
+			task->proc(task->closure);
+			tpool->finish_task(*task);	// this will call the done callback if avail.
+
 			tpool->stats[tid].proc_time += get_msec() - tpool->stats[tid].proc_start;
 			tpool->stats[tid].proc_start = 0;
 
+		} else if(__atomic_load_n(&tpool->num_tasks, __ATOMIC_ACQUIRE) > 0) {
+			// tasks are queued, but someone else got there first, try again
+			sched_yield();
+
 		} else {
 			tpool->stats[tid].idle_start = msec;
 			// no work to be done, go to sleep & wait on the condvar
-			while(!tpool->num_tasks && !tpool->stopping) {
+			pthread_mutex_lock(&tpool->work_pending_mutex);
+			while(!__atomic_load_n(&tpool->num_tasks, __ATOMIC_ACQUIRE) && !tpool->stopping) {
 				pthread_cond_wait(&tpool->work_pending_cond, &tpool->work_pending_mutex);
 			}
 			pthread_mutex_unlock(&tpool->work_pending_mutex);
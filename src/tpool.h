@@ -1,7 +1,8 @@
 #ifndef TPOOL_H_
 #define TPOOL_H_
 
-#include <queue>
+#include <deque>
+#include <vector>
 #include <pthread.h>
 
 // returns the number of processors (cores) in the system
@@ -9,6 +10,13 @@ extern "C" int get_number_processors();
 
 void *worker_thread_func(void *arg);
 
+/** returns a small dense index identifying the calling thread. Worker
+ * threads of every ThreadPool get their own unique index, starting from 1.
+ * Any other thread, such as the main thread, gets index 0, so at most one of
+ * those may use per-thread data indexed by it at any time.
+ */
+inline int get_thread_index();
+
 
 struct Task {
 	void *closure;
@@ -27,10 +35,23 @@ struct ThreadStats {
 	unsigned long tasks;
 };
 
+class TaskDeque;
+
+/** Thread pool with a work-stealing scheduler. Every worker thread owns a
+ * deque of tasks, which it works on from one end, while idle workers steal
+ * from the other end without any locking. Tasks added from outside the pool
+ * go to a shared injection queue, from which workers move them to their own
+ * deques in batches. Tasks added by a worker go straight to its own deque.
+ */
 class ThreadPool {
 private:
-	std::queue<Task> workq;
-	int num_tasks;
+	std::deque<Task*> injectq;
+	pthread_mutex_t injectq_mutex;
+
+	TaskDeque *deques;
+	std::vector<Task*> task_blocks;	// storage of the queued tasks
+
+	int num_tasks;	// queued, but not picked up by any worker yet
 
 	pthread_t *threads;
 	ThreadStats *stats;
@@ -39,11 +60,12 @@ private:
 	pthread_cond_t work_pending_cond;
 	pthread_mutex_t work_pending_mutex;
 
-	volatile int work_left;
+	int work_left;
 	pthread_cond_t done_cond;
-	//pthread_mutex_t done_mutex;
 
+	Task *get_task(int tid);
 	void finish_task(const Task &task);
+	void free_task_blocks();
 
 	bool stopping;
 
@@ -68,6 +90,13 @@ public:
 
 
 // --- threadpool inline functions ---
+extern __thread int tpool_thread_index;
+
+inline int get_thread_index()
+{
+	return tpool_thread_index;
+}
+
 inline int ThreadPool::get_num_threads() const
 {
 	return num_threads;
@@ -80,7 +109,7 @@ inline const ThreadStats *ThreadPool::get_thread_stats(int tid) const
 
 inline bool ThreadPool::is_done() const
 {
-	return work_left == 0;
+	return __atomic_load_n(&work_left, __ATOMIC_ACQUIRE) == 0;
 }
 
 #endif	// TPOOL_H_
@@ -0,0 +1,250 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "tripacket.h"
+#include "scene.h"
+
+/* The SIMD kernels are compiled with per-function target attributes, so
+ * that the rest of the program doesn't require any particular instruction
+ * set, and the widest one supported by the CPU is picked at startup.
+ */
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__)
+#define TRI_PACKET_X86
+#include <immintrin.h>
+
+#ifdef GEOM_DOUBLE
+typedef __m128d sse_vec;
+typedef __m256d avx_vec;
+#define SSE_OP(x)	_mm_##x##_pd
+#define AVX_OP(x)	_mm256_##x##_pd
+#else
+typedef __m128 sse_vec;
+typedef __m256 avx_vec;
+#define SSE_OP(x)	_mm_##x##_ps
+#define AVX_OP(x)	_mm256_##x##_ps
+#endif
+#endif
+
+typedef int (*isect_func_t)(const TriPacket*, int, const Ray&, double*, double*, double*);
+typedef bool (*occl_func_t)(const TriPacket*, int, const Ray&);
+
+static const char *select_kernels();
+
+static isect_func_t isect_func;
+static occl_func_t occl_func;
+static const char *kernel_name = select_kernels();
+
+
+TriPacket::TriPacket()
+{
+	memset(this, 0, sizeof *this);
+	for(int i=0; i<TRI_PACKET_SIZE; i++) {
+		face[i] = -1;
+	}
+}
+
+void TriPacket::set(int slot, int face, const Vector3 &v0, const Vector3 &v1, const Vector3 &v2)
+{
+	for(int i=0; i<3; i++) {
+		this->v0[i][slot] = v0[i];
+		e1[i][slot] = v1[i] - v0[i];
+		e2[i][slot] = v2[i] - v0[i];
+	}
+	this->face[slot] = face;
+}
+
+int tri_packet_intersect(const TriPacket *pkt, int count, const Ray &ray,
+		double *t, double *u, double *v)
+{
+	return isect_func(pkt, count, ray, t, u, v);
+}
+
+bool tri_packet_occluded(const TriPacket *pkt, int count, const Ray &ray)
+{
+	return occl_func(pkt, count, ray);
+}
+
+const char *tri_packet_kernel()
+{
+	return kernel_name;
+}
+
+// ---- scalar kernels ----
+
+/* Moller-Trumbore test of a single packet slot */
+static inline bool isect_slot(const TriPacket *pkt, int i, const geom_t *org, const geom_t *dir,
+		geom_t *tres, geom_t *ures, geom_t *vres)
+{
+	geom_t e1x = pkt->e1[0][i], e1y = pkt->e1[1][i], e1z = pkt->e1[2][i];
+	geom_t e2x = pkt->e2[0][i], e2y = pkt->e2[1][i], e2z = pkt->e2[2][i];
+
+	geom_t px = dir[1] * e2z - dir[2] * e2y;
+	geom_t py = dir[2] * e2x - dir[0] * e2z;
+	geom_t pz = dir[0] * e2y - dir[1] * e2x;
+
+	geom_t det = e1x * px + e1y * py + e1z * pz;
+	if(fabs(det) < Scene::epsilon) {
+		return false;
+	}
+	geom_t inv_det = 1.0 / det;
+
+	geom_t tx = org[0] - pkt->v0[0][i];
+	geom_t ty = org[1] - pkt->v0[1][i];
+	geom_t tz = org[2] - pkt->v0[2][i];
+
+	geom_t u = (tx * px + ty * py + tz * pz) * inv_det;
+	if(u < 0.0 || u > 1.0) {
+		return false;
+	}
+
+	geom_t qx = ty * e1z - tz * e1y;
+	geom_t qy = tz * e1x - tx * e1z;
+	geom_t qz = tx * e1y - ty * e1x;
+
+	geom_t v = (dir[0] * qx + dir[1] * qy + dir[2] * qz) * inv_det;
+	if(v < 0.0 || u + v > 1.0) {
+		return false;
+	}
+
+	geom_t t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+	if(t < Scene::epsilon || t > 1.0) {
+		return false;
+	}
+
+	*tres = t;
+	*ures = u;
+	*vres = v;
+	return true;
+}
+
+static int isect_scalar(const TriPacket *pkt, int count, const Ray &ray,
+		double *t, double *u, double *v)
+{
+	geom_t org[3], dir[3];
+	for(int i=0; i<3; i++) {
+		org[i] = ray.origin[i];
+		dir[i] = ray.dir[i];
+	}
+
+	int hit = -1;
+	for(int i=0; i<count; i++) {
+		for(int j=0; j<TRI_PACKET_SIZE; j++) {
+			geom_t tt, uu, vv;
+			if(isect_slot(pkt + i, j, org, dir, &tt, &uu, &vv) && tt < *t) {
+				*t = tt;
+				*u = uu;
+				*v = vv;
+				hit = pkt[i].face[j];
+			}
+		}
+	}
+	return hit;
+}
+
+static bool occl_scalar(const TriPacket *pkt, int count, const Ray &ray)
+{
+	geom_t org[3], dir[3];
+	for(int i=0; i<3; i++) {
+		org[i] = ray.origin[i];
+		dir[i] = ray.dir[i];
+	}
+
+	for(int i=0; i<count; i++) {
+		for(int j=0; j<TRI_PACKET_SIZE; j++) {
+			geom_t tt, uu, vv;
+			if(isect_slot(pkt + i, j, org, dir, &tt, &uu, &vv)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+#ifdef TRI_PACKET_X86
+
+// ---- SSE2 kernels (half a packet at a time) ----
+
+#define SIMD_TARGET		"sse2"
+#define SIMD_LANES		(sizeof(sse_vec) / sizeof(geom_t))
+#define SIMD_FUNC(x)	x##_sse2
+#define vec				sse_vec
+#define vop(x)			SSE_OP(x)
+#define vcmp_ge(a, b)	SSE_OP(cmpge)(a, b)
+#define vcmp_le(a, b)	SSE_OP(cmple)(a, b)
+#define vcmp_lt(a, b)	SSE_OP(cmplt)(a, b)
+#define vblend(a, b, m)	SSE_OP(or)(SSE_OP(and)(m, b), SSE_OP(andnot)(m, a))
+
+#include "tripacket_simd.inl"
+
+#undef SIMD_TARGET
+#undef SIMD_LANES
+#undef SIMD_FUNC
+#undef vec
+#undef vop
+#undef vcmp_ge
+#undef vcmp_le
+#undef vcmp_lt
+#undef vblend
+
+// ---- AVX kernels (a whole packet at a time) ----
+
+#define SIMD_TARGET		"avx"
+#define SIMD_LANES		(sizeof(avx_vec) / sizeof(geom_t))
+#define SIMD_FUNC(x)	x##_avx
+#define vec				avx_vec
+#define vop(x)			AVX_OP(x)
+#define vcmp_ge(a, b)	AVX_OP(cmp)(a, b, _CMP_GE_OQ)
+#define vcmp_le(a, b)	AVX_OP(cmp)(a, b, _CMP_LE_OQ)
+#define vcmp_lt(a, b)	AVX_OP(cmp)(a, b, _CMP_LT_OQ)
+#define vblend(a, b, m)	AVX_OP(blendv)(a, b, m)
+
+#include "tripacket_simd.inl"
+
+#undef SIMD_TARGET
+#undef SIMD_LANES
+#undef SIMD_FUNC
+#undef vec
+#undef vop
+#undef vcmp_ge
+#undef vcmp_le
+#undef vcmp_lt
+#undef vblend
+
+#endif	// TRI_PACKET_X86
+
+static const char *select_kernels()
+{
+#ifdef TRI_PACKET_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx")) {
+		isect_func = isect_packets_avx;
+		occl_func = occl_packets_avx;
+		return "avx";
+	}
+	if(__builtin_cpu_supports("sse2")) {
+		isect_func = isect_packets_sse2;
+		occl_func = occl_packets_sse2;
+		return "sse2";
+	}
+#endif
+
+	isect_func = isect_scalar;
+	occl_func = occl_scalar;
+	return "scalar";
+}
@@ -0,0 +1,57 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TRIPACKET_H_
+#define TRIPACKET_H_
+
+#include <vmath/vmath.h>
+#include "geom.h"
+
+/* one AVX register wide: 8 triangles in single precision, 4 in double */
+#define TRI_PACKET_SIZE		(int)(32 / sizeof(geom_t))
+
+/** A packet of triangles in structure-of-arrays layout, for testing against
+ * a ray in parallel. Each triangle is stored as its first vertex and the two
+ * edges leaving it. Unused slots have zero edges, and a face index of -1.
+ */
+struct TriPacket {
+	geom_t v0[3][TRI_PACKET_SIZE];
+	geom_t e1[3][TRI_PACKET_SIZE];
+	geom_t e2[3][TRI_PACKET_SIZE];
+	int face[TRI_PACKET_SIZE];
+
+	TriPacket();
+
+	void set(int slot, int face, const Vector3 &v0, const Vector3 &v1, const Vector3 &v2);
+};
+
+/** tests the ray against count consecutive packets. If a triangle is hit
+ * closer than *t, *t is lowered to the distance of the closest hit, u and v
+ * are set to its barycentric coordinates with respect to the 2nd and 3rd
+ * vertex, and its face index is returned. Otherwise -1 is returned.
+ * The results are only as precise as geom_t.
+ */
+int tri_packet_intersect(const TriPacket *pkt, int count, const Ray &ray,
+		double *t, double *u, double *v);
+
+/** returns true if the ray hits any of the triangles in count packets */
+bool tri_packet_occluded(const TriPacket *pkt, int count, const Ray &ray);
+
+/** name of the packet kernels selected for this CPU (avx, sse2, or scalar) */
+const char *tri_packet_kernel();
+
+#endif	// TRIPACKET_H_
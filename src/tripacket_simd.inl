@@ -0,0 +1,146 @@
+/*
+This file is part of the s-ray renderer <http://code.google.com/p/sray>.
+Copyright (C) 2009 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* Packet kernels, written once in terms of the vector macros defined by
+ * tripacket.cc, and included once for every instruction set:
+ *	SIMD_TARGET	- target attribute of the kernels
+ *	SIMD_LANES	- number of geom_t in a vector
+ *	SIMD_FUNC(x)	- name of the kernel x for this instruction set
+ *	vec, vop(x)	- vector type, and name of intrinsic x for geom_t
+ *	vcmp_ge/le/lt	- comparisons returning lane masks
+ *	vblend(a, b, m)	- b where m is set, a elsewhere
+ */
+
+/* tests triangles [offs, offs + SIMD_LANES) of the packet, and returns the
+ * mask of the ones hit in the [eps, tmax) range, along with their t, u, v.
+ */
+__attribute__((target(SIMD_TARGET)))
+static inline int SIMD_FUNC(isect)(const TriPacket *pkt, int offs, const vec *org, const vec *dir,
+		vec tmax, vec *tres, vec *ures, vec *vres)
+{
+	const vec zero = vop(setzero)();
+	const vec one = vop(set1)(1.0);
+	const vec eps = vop(set1)(Scene::epsilon);
+	const vec sign = vop(set1)(-0.0);
+
+	vec e1x = vop(loadu)(pkt->e1[0] + offs);
+	vec e1y = vop(loadu)(pkt->e1[1] + offs);
+	vec e1z = vop(loadu)(pkt->e1[2] + offs);
+	vec e2x = vop(loadu)(pkt->e2[0] + offs);
+	vec e2y = vop(loadu)(pkt->e2[1] + offs);
+	vec e2z = vop(loadu)(pkt->e2[2] + offs);
+
+	vec px = vop(sub)(vop(mul)(dir[1], e2z), vop(mul)(dir[2], e2y));
+	vec py = vop(sub)(vop(mul)(dir[2], e2x), vop(mul)(dir[0], e2z));
+	vec pz = vop(sub)(vop(mul)(dir[0], e2y), vop(mul)(dir[1], e2x));
+
+	vec det = vop(add)(vop(add)(vop(mul)(e1x, px), vop(mul)(e1y, py)), vop(mul)(e1z, pz));
+	vec mask = vcmp_ge(vop(andnot)(sign, det), eps);
+	if(!vop(movemask)(mask)) {
+		return 0;
+	}
+	// keep the division away from zero determinants
+	det = vblend(one, det, mask);
+	vec inv_det = vop(div)(one, det);
+
+	vec tx = vop(sub)(org[0], vop(loadu)(pkt->v0[0] + offs));
+	vec ty = vop(sub)(org[1], vop(loadu)(pkt->v0[1] + offs));
+	vec tz = vop(sub)(org[2], vop(loadu)(pkt->v0[2] + offs));
+
+	vec u = vop(mul)(vop(add)(vop(add)(vop(mul)(tx, px), vop(mul)(ty, py)), vop(mul)(tz, pz)), inv_det);
+	mask = vop(and)(mask, vop(and)(vcmp_ge(u, zero), vcmp_le(u, one)));
+
+	vec qx = vop(sub)(vop(mul)(ty, e1z), vop(mul)(tz, e1y));
+	vec qy = vop(sub)(vop(mul)(tz, e1x), vop(mul)(tx, e1z));
+	vec qz = vop(sub)(vop(mul)(tx, e1y), vop(mul)(ty, e1x));
+
+	vec v = vop(mul)(vop(add)(vop(add)(vop(mul)(dir[0], qx), vop(mul)(dir[1], qy)), vop(mul)(dir[2], qz)), inv_det);
+	mask = vop(and)(mask, vop(and)(vcmp_ge(v, zero), vcmp_le(vop(add)(u, v), one)));
+
+	vec t = vop(mul)(vop(add)(vop(add)(vop(mul)(e2x, qx), vop(mul)(e2y, qy)), vop(mul)(e2z, qz)), inv_det);
+	mask = vop(and)(mask, vop(and)(vcmp_ge(t, eps), vcmp_le(t, one)));
+	mask = vop(and)(mask, vcmp_lt(t, tmax));
+
+	*tres = t;
+	*ures = u;
+	*vres = v;
+	return vop(movemask)(mask);
+}
+
+__attribute__((target(SIMD_TARGET)))
+static int SIMD_FUNC(isect_packets)(const TriPacket *pkt, int count, const Ray &ray,
+		double *t, double *u, double *v)
+{
+	vec org[3], dir[3];
+	for(int i=0; i<3; i++) {
+		org[i] = vop(set1)(ray.origin[i]);
+		dir[i] = vop(set1)(ray.dir[i]);
+	}
+
+	int hit = -1;
+	geom_t tclosest = *t < 1.0 ? (geom_t)*t : 1.0;
+	vec tmax = vop(set1)(tclosest);
+
+	for(int i=0; i<count; i++) {
+		for(int j=0; j<TRI_PACKET_SIZE; j+=SIMD_LANES) {
+			vec tt, uu, vv;
+			int mask = SIMD_FUNC(isect)(pkt + i, j, org, dir, tmax, &tt, &uu, &vv);
+			if(!mask) continue;
+
+			geom_t tarr[SIMD_LANES], uarr[SIMD_LANES], varr[SIMD_LANES];
+			vop(storeu)(tarr, tt);
+			vop(storeu)(uarr, uu);
+			vop(storeu)(varr, vv);
+
+			for(int k=0; k<(int)SIMD_LANES; k++) {
+				if((mask & (1 << k)) && tarr[k] < tclosest) {
+					tclosest = tarr[k];
+					*u = uarr[k];
+					*v = varr[k];
+					hit = pkt[i].face[j + k];
+				}
+			}
+			tmax = vop(set1)(tclosest);
+		}
+	}
+
+	if(hit != -1) {
+		*t = tclosest;
+	}
+	return hit;
+}
+
+__attribute__((target(SIMD_TARGET)))
+static bool SIMD_FUNC(occl_packets)(const TriPacket *pkt, int count, const Ray &ray)
+{
+	vec org[3], dir[3];
+	for(int i=0; i<3; i++) {
+		org[i] = vop(set1)(ray.origin[i]);
+		dir[i] = vop(set1)(ray.dir[i]);
+	}
+	vec tmax = vop(set1)(2.0);
+
+	for(int i=0; i<count; i++) {
+		for(int j=0; j<TRI_PACKET_SIZE; j+=SIMD_LANES) {
+			vec tt, uu, vv;
+			if(SIMD_FUNC(isect)(pkt + i, j, org, dir, tmax, &tt, &uu, &vv)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
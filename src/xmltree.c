@@ -36,6 +36,12 @@ struct parse_data {
 	
 	char *buf;
 	int buf_size;
+
+	/* the stream handlers, the one of the element being streamed, and the
+	 * nesting depth within it (0 when not streaming).
+	 */
+	const struct xml_stream_handler *handlers, *stream;
+	int stream_depth;
 };
 
 static void start(void *udata, const char *name, const char **atts);
@@ -159,6 +165,10 @@ void xml_free_tree(struct xml_node *x)
 		free(tmp);
 	}
 
+	if(x->data && x->free_data) {
+		x->free_data(x->data);
+	}
+
 	free(x->cdata);
 	free(x->name);
 	free(x);
@@ -178,6 +188,11 @@ struct xml_node *xml_read_tree(const char *fname)
 }
 
 struct xml_node *xml_read_tree_file(FILE *fp)
+{
+	return xml_read_tree_stream(fp, 0);
+}
+
+struct xml_node *xml_read_tree_stream(FILE *fp, const struct xml_stream_handler *handlers)
 {
 	struct parse_data pdata;
 	struct xml_node node, *tree;
@@ -197,6 +212,7 @@ struct xml_node *xml_read_tree_file(FILE *fp)
 	memset(&pdata, 0, sizeof pdata);
 	pdata.parser = p;
 	pdata.cur_node = &node;
+	pdata.handlers = handlers;
 
 	do {
 		if(!(buf = XML_GetBuffer(p, 4096))) {
@@ -219,7 +235,7 @@ struct xml_node *xml_read_tree_file(FILE *fp)
 		assert(tree->next == 0);
 	}
 
-	if(pdata.cur_node != &node) {	/* aborted */
+	if(pdata.cur_node != &node || pdata.stream_depth) {	/* aborted */
 		xml_free_tree(tree);
 		tree = 0;
 	}
@@ -236,6 +252,15 @@ static void start(void *udata, const char *name, const char **atts)
 {
 	struct xml_node *node = 0;
 	struct parse_data *pdata = udata;
+	const struct xml_stream_handler *h;
+
+	if(pdata->stream_depth) {
+		pdata->stream_depth++;
+		if(pdata->stream->start(pdata->cur_node->data, name, atts) == -1) {
+			abort_parsing(pdata->parser);
+		}
+		return;
+	}
 
 	finish_cdata(pdata);
 
@@ -263,6 +288,20 @@ static void start(void *udata, const char *name, const char **atts)
 
 	xml_add_child(pdata->cur_node, node);
 	pdata->cur_node = node;
+
+	for(h=pdata->handlers; h && h->name; h++) {
+		if(strcmp(h->name, name) == 0) {
+			if(!(node->data = h->begin(node))) {
+				abort_parsing(pdata->parser);
+				return;
+			}
+			node->free_data = h->free_data;
+
+			pdata->stream = h;
+			pdata->stream_depth = 1;
+			break;
+		}
+	}
 	return;
 
 err:
@@ -278,6 +317,13 @@ static void end(void *udata, const char *name)
 {
 	struct parse_data *pdata = udata;
 
+	if(pdata->stream_depth > 1) {
+		pdata->stream_depth--;
+		pdata->stream->end(pdata->cur_node->data, name);
+		return;
+	}
+	pdata->stream_depth = 0;
+
 	finish_cdata(pdata);
 
 	pdata->cur_node = pdata->cur_node->up;
@@ -288,6 +334,10 @@ static void cdata(void *udata, const char *text, int len)
 	char *tmp;
 	struct parse_data *pdata = udata;
 
+	if(pdata->stream_depth) {
+		return;	/* streamed elements have no cdata */
+	}
+
 	if(!(tmp = realloc(pdata->buf, pdata->buf_size + len))) {
 		abort_parsing(pdata->parser);
 		return;
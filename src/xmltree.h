@@ -49,6 +49,24 @@ struct xml_node {
 	struct xml_node *up;				/* parent pointer */
 	struct xml_node *chld, *chld_tail;	/* children list */
 	struct xml_node *next;				/* next sibling */
+
+	/* data attached by a stream handler, released with the tree */
+	void *data;
+	void (*free_data)(void *data);
+};
+
+/* a stream handler receives the contents of every element with the given
+ * name as a sequence of start/end calls while parsing, instead of them being
+ * added to the tree. The element itself is still added, with the data
+ * returned by begin attached to it. start returns -1 to abort parsing.
+ */
+struct xml_stream_handler {
+	const char *name;
+
+	void *(*begin)(struct xml_node *node);
+	int (*start)(void *data, const char *name, const char **atts);
+	void (*end)(void *data, const char *name);
+	void (*free_data)(void *data);
 };
 
 #ifdef __cplusplus
@@ -66,6 +84,10 @@ void xml_free_tree(struct xml_node *x);
 
 struct xml_node *xml_read_tree(const char *fname);
 struct xml_node *xml_read_tree_file(FILE *fp);
+/* like xml_read_tree_file, with an array of stream handlers terminated by
+ * one with a null name.
+ */
+struct xml_node *xml_read_tree_stream(FILE *fp, const struct xml_stream_handler *handlers);
 
 int xml_write_tree(struct xml_node *x, const char *fname);
 int xml_write_tree_file(struct xml_node *x, FILE *fp);